@@ -0,0 +1,155 @@
+/*=======================================================
+configBench.c
+
+Microbenchmark for ConfigReader_readConfig on generated
+plugin.conf files. Each generated config mixes the kinds
+of lines real configs have: comments, blank lines, CRLF
+endings, quoted values, indexed list properties and
+lines without an '='.
+
+  configBench                 time the default sizes
+  configBench <lines> ...     time configs of these sizes
+  configBench -g <lines> <file>
+                              only write a generated config
+
+Built with -DBENCH_OLD_READER, it uses the three argument
+apply callback the reader took before values were passed
+with their lengths, so the same configs can be timed
+against the older reader.
+=======================================================*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include "configReader.h"
+#include "misc.h"
+
+#define BENCH_MIN_RUNS 5
+#define BENCH_MIN_MS 200.0
+
+static const size_t defaultSizes[] = {200, 20000, 200000};
+
+
+/*
+ * Write a config of the given number of lines to out.
+ */
+static void generateConfig(FILE *out, size_t lines) {
+
+  size_t i = 0;
+  for (i = 0; i < lines; i++) {
+    switch (i % 10) {
+      case 0:
+        fprintf(out, "#Plugin Configuration, section %zu\n", i / 10);
+        break;
+      case 1:
+        fputs("\n", out);
+        break;
+      case 2:
+        fprintf(out, "js-path:%zu=scripts/lib%zu.js\n", i, i);
+        break;
+      case 3:
+        fprintf(out, "css-path:%zu=styles/theme%zu.css\r\n", i, i);
+        break;
+      case 4:
+        fprintf(out, "script-path=\"run plugin %zu.sh\"\n", i);
+        break;
+      case 5:
+        fprintf(out, "  script-timer = %zu\n", i % 600);
+        break;
+      case 6:
+        fprintf(out, "html-path=Plugin%zu.html\n", i);
+        break;
+      case 7:
+        fputs("no assignment on this line\n", out);
+        break;
+      case 8:
+        fprintf(out, "setting%zu=\"quoted value %zu\"\r\n", i, i);
+        break;
+      default:
+        fputs("start-on-load=true\n", out);
+        break;
+    }
+  }
+}
+
+#ifdef BENCH_OLD_READER
+static int noopApply(void *data, char *property, char *value) {
+
+  (*(size_t *) data)++;
+  return 0;
+}
+#else
+static int noopApply(void *data, char *property, size_t propertyLen, char *value, size_t valueLen) {
+
+  (*(size_t *) data)++;
+  return 0;
+}
+#endif
+
+static int benchConfig(size_t lines) {
+
+  char path[] = "/tmp/configBenchXXXXXX";
+  int fd = mkstemp(path);
+  if (fd < 0) {
+    perror("configBench: mkstemp");
+    return -1;
+  }
+
+  FILE *out = fdopen(fd, "w");
+  if (!out) {
+    close(fd);
+    unlink(path);
+    return -1;
+  }
+  generateConfig(out, lines);
+  long bytes = ftell(out);
+  fclose(out);
+
+  //one untimed run to warm the page cache
+  size_t pairs = 0;
+  ConfigReader_readConfig(path, noopApply, &pairs);
+
+  size_t runs = 0;
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  while (runs < BENCH_MIN_RUNS || ElapsedMs(&start) < BENCH_MIN_MS) {
+    pairs = 0;
+    ConfigReader_readConfig(path, noopApply, &pairs);
+    runs++;
+  }
+  double totalMs = ElapsedMs(&start);
+  unlink(path);
+
+  printf("%8zu lines %10ld bytes %8zu pairs: %10.1f us/parse (%zu runs)\n",
+         lines, bytes, pairs, totalMs * 1000.0 / runs, runs);
+  return 0;
+}
+
+int main(int argc, char **argv) {
+
+  if (argc == 4 && !strcmp(argv[1], "-g")) {
+    FILE *out = fopen(argv[3], "w");
+    if (!out) {
+      perror("configBench");
+      return 1;
+    }
+    generateConfig(out, strtoul(argv[2], NULL, 10));
+    fclose(out);
+    return 0;
+  }
+
+  int status = 0;
+  int i = 0;
+  if (argc > 1) {
+    for (i = 1; i < argc; i++)
+      status |= benchConfig(strtoul(argv[i], NULL, 10));
+  }
+  else {
+    for (i = 0; i < (int) (sizeof(defaultSizes) / sizeof(defaultSizes[0])); i++)
+      status |= benchConfig(defaultSizes[i]);
+  }
+
+  return status ? 1 : 0;
+}
@@ -0,0 +1,112 @@
+/*=======================================================
+hashTableBench.c
+
+Microbenchmark for the config hash table. For each size n,
+n keys named like plugin.conf's list properties (js-path:N
+and css-path:N) are inserted into a table created with
+size 13, then each one is looked up, followed by n lookups
+of keys that aren't in the table. Times are ns per op.
+
+  hashTableBench              time the default sizes
+  hashTableBench <n> ...      time these sizes
+
+Only HashData_create, HashTable_init, HashTable_add,
+HashTable_find and HashTable_destroy are used, so the same
+file also builds against older versions of hashtable.c.
+=======================================================*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "hashtable.h"
+#include "misc.h"
+
+#define BENCH_INIT_SIZE 13
+#define BENCH_MIN_ROUNDS 5
+#define BENCH_MIN_MS 200.0
+#define BENCH_KEY_LEN 32
+
+static const size_t defaultSizes[] = {8, 40, 200, 5000};
+
+
+static char *makeKeys(size_t n, const char *evenFmt, const char *oddFmt) {
+
+  char *keys = malloc(n * BENCH_KEY_LEN);
+  if (!keys)
+    return NULL;
+
+  size_t i = 0;
+  for (i = 0; i < n; i++)
+    snprintf(keys + i * BENCH_KEY_LEN, BENCH_KEY_LEN, (i & 1) ? oddFmt : evenFmt, i);
+
+  return keys;
+}
+
+static int benchTable(size_t n) {
+
+  char *keys = makeKeys(n, "js-path:%zu", "css-path:%zu");
+  char *missing = makeKeys(n, "html-path:%zu", "script-path:%zu");
+  if (!keys || !missing) {
+    free(keys);
+    free(missing);
+    return -1;
+  }
+
+  double insertMs = 0, hitMs = 0, missMs = 0;
+  size_t rounds = 0, found = 0, lost = 0;
+  struct timespec start, phase;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  while (rounds < BENCH_MIN_ROUNDS || ElapsedMs(&start) < BENCH_MIN_MS) {
+    size_t i = 0;
+    HashTable_t *table = HashTable_init(BENCH_INIT_SIZE);
+    if (!table)
+      break;
+
+    clock_gettime(CLOCK_MONOTONIC, &phase);
+    for (i = 0; i < n; i++)
+      HashTable_add(table, HashData_create(keys + i * BENCH_KEY_LEN, "value"));
+    insertMs += ElapsedMs(&phase);
+
+    clock_gettime(CLOCK_MONOTONIC, &phase);
+    for (i = 0; i < n; i++)
+      found += (HashTable_find(table, keys + i * BENCH_KEY_LEN) != NULL);
+    hitMs += ElapsedMs(&phase);
+
+    clock_gettime(CLOCK_MONOTONIC, &phase);
+    for (i = 0; i < n; i++)
+      found += (HashTable_find(table, missing + i * BENCH_KEY_LEN) != NULL);
+    missMs += ElapsedMs(&phase);
+
+    HashTable_destroy(table);
+    rounds++;
+  }
+
+  //every key inserted should be found, and none of the missing ones
+  lost = n * rounds - found;
+
+  double ops = (double) n * rounds / 1000000.0;
+  printf("n=%-6zu insert %6.0f   hit %4.0f   miss %4.0f ns/op   lost %zu (%zu rounds)\n",
+         n, insertMs / ops, hitMs / ops, missMs / ops, lost, rounds);
+
+  free(keys);
+  free(missing);
+  return lost ? -1 : 0;
+}
+
+int main(int argc, char **argv) {
+
+  int status = 0;
+  int i = 0;
+  if (argc > 1) {
+    for (i = 1; i < argc; i++)
+      status |= benchTable(strtoul(argv[i], NULL, 10));
+  }
+  else {
+    for (i = 0; i < (int) (sizeof(defaultSizes) / sizeof(defaultSizes[0])); i++)
+      status |= benchTable(defaultSizes[i]);
+  }
+
+  return status ? 1 : 0;
+}
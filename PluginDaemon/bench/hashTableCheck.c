@@ -0,0 +1,144 @@
+/*=======================================================
+hashTableCheck.c
+
+Randomized checker for the config hash table. Runs a
+stream of set/remove/find operations on a small key space
+against a plain reference array, on both a heap table and
+an arena backed one, and stops at the first operation
+where the two disagree. Best run built with
+-fsanitize=address,undefined.
+
+  hashTableCheck [ops] [seed]
+=======================================================*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "hashtable.h"
+#include "arena.h"
+
+#define CHECK_DEFAULT_OPS 2000000
+#define CHECK_KEYS 4096
+#define CHECK_INIT_SIZE 13
+#define CHECK_SCAN_EVERY 65536
+#define CHECK_ARENA_BLOCK 4096
+#define CHECK_STR_LEN 32
+
+static unsigned long long _state = 88172645463325252ULL;
+
+//xorshift64, so a seed always replays the same run
+static unsigned long long nextRandom(void) {
+
+  _state ^= _state << 13;
+  _state ^= _state >> 7;
+  _state ^= _state << 17;
+  return _state;
+}
+
+static int fail(size_t op, const char *what, int key) {
+
+  fprintf(stderr, "hashTableCheck: op %zu: %s for key %d\n", op, what, key);
+  return -1;
+}
+
+/*
+ * Every key in the reference must be found with its value, and the
+ * table must hold nothing else.
+ */
+static int scanTable(HashTable_t *table, const int *values, size_t count, size_t op) {
+
+  size_t i = 0, used = 0;
+  for (i = 0; i < table->size; i++)
+    used += (table->entries[i] != NULL);
+
+  if (used != count || table->count != count)
+    return fail(op, "table holds the wrong number of entries", -1);
+
+  char key[CHECK_STR_LEN], value[CHECK_STR_LEN];
+  int k = 0;
+  for (k = 0; k < CHECK_KEYS; k++) {
+    if (values[k] < 0)
+      continue;
+
+    snprintf(key, sizeof(key), "key:%d", k);
+    snprintf(value, sizeof(value), "%d", values[k]);
+    HashData_t *entry = HashTable_find(table, key);
+    if (!entry || strcmp(entry->value, value))
+      return fail(op, "scan lost an entry", k);
+  }
+
+  return 0;
+}
+
+static int checkTable(HashTable_t *table, size_t ops) {
+
+  int values[CHECK_KEYS];
+  memset(values, -1, sizeof(values));
+  size_t count = 0;
+
+  char key[CHECK_STR_LEN], value[CHECK_STR_LEN];
+  size_t op = 0;
+  for (op = 0; op < ops; op++) {
+    unsigned long long r = nextRandom();
+    int k = (int) ((r >> 8) % CHECK_KEYS);
+    int kind = (int) (r % 100);
+    snprintf(key, sizeof(key), "key:%d", k);
+
+    if (kind < 45) {
+      int v = (int) ((r >> 32) & 0xffff);
+      snprintf(value, sizeof(value), "%d", v);
+      if (!HashTable_set(table, key, value))
+        return fail(op, "set failed", k);
+
+      count += (values[k] < 0);
+      values[k] = v;
+    }
+    else if (kind < 70) {
+      int removed = !HashTable_remove(table, key);
+      if (removed != (values[k] >= 0))
+        return fail(op, "remove disagrees with the reference", k);
+
+      count -= removed;
+      values[k] = -1;
+    }
+    else {
+      HashData_t *entry = HashTable_find(table, key);
+      if (!entry != (values[k] < 0))
+        return fail(op, "find disagrees with the reference", k);
+
+      snprintf(value, sizeof(value), "%d", values[k]);
+      if (entry && strcmp(entry->value, value))
+        return fail(op, "find returned a stale value", k);
+    }
+
+    if (table->count != count)
+      return fail(op, "count disagrees with the reference", k);
+
+    if (!(op % CHECK_SCAN_EVERY) && scanTable(table, values, count, op))
+      return -1;
+  }
+
+  return scanTable(table, values, count, op);
+}
+
+int main(int argc, char **argv) {
+
+  size_t ops = (argc > 1) ? strtoul(argv[1], NULL, 10) : CHECK_DEFAULT_OPS;
+  if (argc > 2)
+    _state = strtoull(argv[2], NULL, 10) | 1;
+
+  HashTable_t *heapTable = HashTable_init(CHECK_INIT_SIZE);
+  if (!heapTable || checkTable(heapTable, ops))
+    return 1;
+  HashTable_destroy(heapTable);
+
+  Arena_t *arena = Arena_init(CHECK_ARENA_BLOCK);
+  HashTable_t *arenaTable = arena ? HashTable_initArena(CHECK_INIT_SIZE, arena) : NULL;
+  if (!arenaTable || checkTable(arenaTable, ops))
+    return 1;
+  HashTable_destroy(arenaTable);
+  Arena_destroy(arena);
+
+  printf("hashTableCheck: %zu ops on heap and arena tables matched the reference\n", ops);
+  return 0;
+}
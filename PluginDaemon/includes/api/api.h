@@ -2,6 +2,7 @@
 #define MAGIC_MIRROR_INPUTREADER_H
 
 #include "libwebsockets.h"
+#include "plugin.h"
 
 typedef enum {
     API_STATUS_SUCCESS = 0,
@@ -46,7 +47,9 @@ typedef struct API_Command_s {
 typedef enum {
     NONE = 0,
     NEED_PLUGIN = (1 << 0),
-    NEED_VALUES = (1 << 1)
+    NEED_VALUES = (1 << 1),
+    //action uses the plugin's config or css, so a deferred plugin is loaded first
+    NEED_LOADED = (1 << 2)
 } APIActionFlags_e;
 
 extern APICommand_t allActions[API_ACTION_COUNT];
@@ -61,6 +64,10 @@ extern void API_Update(void);
 
 extern void API_ShutdownPlugins();
 
+extern int API_ReloadPlugin(Plugin_t *plugin);
+
+extern void API_RemovePlugin(Plugin_t *plugin);
+
 extern int API_Parse(struct lws *socket, char *in, size_t len);
 
 #endif //MAGIC_MIRROR_INPUTREADER_H
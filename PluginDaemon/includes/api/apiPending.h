@@ -22,6 +22,8 @@ extern int APIPending_addAction(APIPendingType_e type, char *id, APIAction_e act
 
 extern void APIPending_freeSlot(int slot);
 
+extern void APIPending_removePlugin(Plugin_t *plugin);
+
 extern void APIPending_update(void);
 
 #endif //MAGICMIRROR_APIPENDING_H
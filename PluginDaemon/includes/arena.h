@@ -0,0 +1,77 @@
+#ifndef __ARENA_H__
+#define __ARENA_H__
+
+#include <stddef.h>
+
+/*
+ * A bump allocator for data that is released all at once.
+ *
+ * Memory is handed out from large blocks and never freed on its own;
+ * Arena_destroy releases every block together. Strings can be interned,
+ * so each distinct string is stored once per arena and equal strings
+ * share one pointer.
+ */
+typedef struct ArenaBlock_s ArenaBlock_t;
+
+typedef struct ArenaString_s {
+    size_t hash;
+    char *str;
+} ArenaString_t;
+
+
+typedef struct Arena_s {
+    ArenaBlock_t *blocks;
+    size_t blockSize;
+    //bytes handed out so far
+    size_t used;
+
+    //interned strings, open addressing
+    ArenaString_t *strings;
+    size_t stringCount, stringSize;
+} Arena_t;
+
+
+/*
+ * Arena_init:
+ *  Create an arena whose blocks hold blockSize bytes. The arena itself
+ *  lives in its first block.
+ *
+ * Returns:
+ *  A new arena, NULL on allocation failure.
+ */
+Arena_t *Arena_init(size_t blockSize);
+
+/*
+ * Arena_destroy:
+ *  Release the arena along with everything allocated from it.
+ */
+void Arena_destroy(Arena_t *arena);
+
+/*
+ * Arena_alloc:
+ *  Allocate size bytes of zeroed, pointer aligned memory.
+ *
+ * Returns:
+ *  The memory, NULL on allocation failure.
+ */
+void *Arena_alloc(Arena_t *arena, size_t size);
+
+/*
+ * Arena_intern:
+ *  Get the arena's copy of a string, storing it if it isn't there yet.
+ *  Arena_internLen interns the first len characters of str.
+ *
+ * Returns:
+ *  The interned string, NULL on allocation failure.
+ */
+char *Arena_intern(Arena_t *arena, const char *str);
+
+char *Arena_internLen(Arena_t *arena, const char *str, size_t len);
+
+/*
+ * Arena_getUsed:
+ *  Bytes allocated from the arena so far.
+ */
+size_t Arena_getUsed(const Arena_t *arena);
+
+#endif
@@ -7,11 +7,21 @@ extern "C" {
 
 #include <stdarg.h>
 
+/*
+ * Nodes are kept in a red-black tree so lookups, inserts and removals stay
+ * O(log n) no matter what order keys arrive in. parent links let every walk
+ * be done iteratively.
+ */
 typedef struct _BTreeNode {
     void *data;
 
     struct _BTreeNode *left;
     struct _BTreeNode *right;
+    //once a node is removed during iteration, parent links it into the graveyard
+    struct _BTreeNode *parent;
+
+    char red;
+    char removed;
 } BTreeNode_t;
 
 typedef void (*BTreeNode_rmNodeData)(void *);
@@ -23,6 +33,10 @@ typedef struct {
     BTreeNode_t *head;
     int size;
 
+    //forEach calls in progress, and nodes removed meanwhile waiting to be destroyed
+    int iterating;
+    BTreeNode_t *graveyard;
+
     /*BTreeNode_getKey getNodeKey;*/
     BTreeNode_rmNodeData rmNodeData;
     BTreeNode_comparator nodeCompare;
@@ -35,7 +49,7 @@ typedef int (*BTreeNode_Operator)(void *, void *);
 
 extern void BTree_print(const BTree_t *tree, int (*print)(const char *, ...), const BTree_PrintData printData);
 
-extern void BTree_add(BTree_t *tree, BTreeNode_t *node);
+extern int BTree_add(BTree_t *tree, BTreeNode_t *node);
 
 extern BTreeNode_t *BTree_find(BTree_t *tree, const BTreeNode_t *key);
 
@@ -49,7 +63,7 @@ extern void *BTreeNode_getData(const BTreeNode_t *node);
 
 extern void BTreeNode_destroy(BTreeNode_t *node, const BTreeNode_rmNodeData rmData);
 
-extern int BTree_forEach(const BTree_t *tree, BTreeNode_Operator operation, void *data);
+extern int BTree_forEach(BTree_t *tree, BTreeNode_Operator operation, void *data);
 
 extern int BTree_getSize(const BTree_t *tree);
 
@@ -1,14 +1,21 @@
-//
-// Created by David on 1/14/16.
-//
-
-#ifndef MAGIC_MIRROR_CONFIGREADER_H
-#define MAGIC_MIRROR_CONFIGREADER_H
-
-extern int ConfigReader_readConfig(char *filePath, int (*apply)(void *, char *, char *), void *data);
-
-extern int ConfigReader_writeConfig(char *outputFile, char *origFile, char *setting, char *newVal);
-
-extern char *ConfigReader_escapePath(char *str);
-
-#endif //MAGIC_MIRROR_CONFIGREADER_H
+//
+// Created by David on 1/14/16.
+//
+
+#ifndef MAGIC_MIRROR_CONFIGREADER_H
+#define MAGIC_MIRROR_CONFIGREADER_H
+
+#include <stddef.h>
+
+//called with each property and value read, both '\0' terminated
+typedef int (*ConfigApply_f)(void *data, char *property, size_t propertyLen, char *value, size_t valueLen);
+
+extern int ConfigReader_readConfig(char *filePath, ConfigApply_f apply, void *data);
+
+extern int ConfigReader_writeConfig(char *outputFile, char *origFile, char *setting, char *newVal);
+
+extern int ConfigReader_writeSettings(char *outputFile, char *origFile, char **settings, char **newVals, size_t count);
+
+extern int ConfigReader_escapePathTo(char *str, char *buf, size_t bufSize);
+
+#endif //MAGIC_MIRROR_CONFIGREADER_H
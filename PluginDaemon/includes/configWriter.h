@@ -0,0 +1,33 @@
+#ifndef SMARTREFLECT_CONFIGWRITER_H
+#define SMARTREFLECT_CONFIGWRITER_H
+
+#include <sys/stat.h>
+
+/*
+ * Write-behind for config file settings.
+ *
+ * ConfigWriter_Set queues a change and returns without touching the file.
+ * Changes are gathered per file, with a later value for a setting replacing
+ * the earlier one, and written by a background thread once the oldest has
+ * waited CONFIG_WRITER_DELAY_MS. Without the thread, changes are written
+ * straight away.
+ *
+ * Files are replaced through ConfigReader_writeSettings, so they are never
+ * left half written.
+ */
+
+#define CONFIG_WRITER_DELAY_MS 500
+
+typedef void (*ConfigWritten_f)(const char *file, struct stat *st, void *data);
+
+extern int ConfigWriter_Init(void);
+
+extern int ConfigWriter_Set(char *outputFile, char *origFile, char *setting, char *value);
+
+extern int ConfigWriter_Flush(char *origFile);
+
+extern void ConfigWriter_TakeWritten(ConfigWritten_f written, void *data);
+
+extern void ConfigWriter_Cleanup(void);
+
+#endif //SMARTREFLECT_CONFIGWRITER_H
@@ -7,6 +7,8 @@ extern int Display_UnloadPlugin(Plugin_t *plugin);
 
 extern int Display_GetDisplaySize(void);
 
+extern unsigned int Display_GetCachedSize(int *width, int *height);
+
 extern int Display_Generate(int portNum, const char *comFolder, const char *cssFolder, const char *jsLibsFolder,
                             const char *output);
 
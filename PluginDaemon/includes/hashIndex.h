@@ -0,0 +1,75 @@
+#ifndef __HASH_INDEX_H__
+#define __HASH_INDEX_H__
+
+#include <stddef.h>
+
+/*
+ * A string keyed index of borrowed pointers.
+ *
+ * Unlike HashTable_t, the index does not own the values it stores; it only
+ * keeps a private copy of each key so lookups never depend on the lifetime
+ * of the caller's string. Lookups and removals do not allocate.
+ */
+typedef struct HashIndexEntry_s {
+    char *key;
+    size_t hash;
+    void *value;
+} HashIndexEntry_t;
+
+
+typedef struct HashIndex_s {
+    size_t count, size;
+    HashIndexEntry_t *entries;
+} HashIndex_t;
+
+
+/*
+ * HashIndex_init:
+ *  Create an index with room for at least size entries before
+ *  it needs to grow.
+ *
+ * Returns:
+ *  A new index, NULL on allocation failure.
+ */
+HashIndex_t *HashIndex_init(size_t size);
+
+/*
+ * HashIndex_destroy:
+ *  Free the index and its key copies. Values are not touched.
+ */
+void HashIndex_destroy(HashIndex_t *index);
+
+/*
+ * HashIndex_add:
+ *  Map key to value, replacing any value already stored for key.
+ *
+ * Returns:
+ *  0 on success, -1 if the index could not grow to fit the key.
+ */
+int HashIndex_add(HashIndex_t *index, const char *key, void *value);
+
+/*
+ * HashIndex_find:
+ *  Look up the value stored for key.
+ *
+ * Returns:
+ *  The stored value, NULL if key is not in the index.
+ */
+void *HashIndex_find(const HashIndex_t *index, const char *key);
+
+/*
+ * HashIndex_remove:
+ *  Remove key from the index.
+ *
+ * Returns:
+ *  The value that was stored for key, NULL if key was not found.
+ */
+void *HashIndex_remove(HashIndex_t *index, const char *key);
+
+/*
+ * HashIndex_getCount:
+ *  Number of keys currently in the index.
+ */
+size_t HashIndex_getCount(const HashIndex_t *index);
+
+#endif
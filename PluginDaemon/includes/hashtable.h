@@ -2,9 +2,12 @@
 #define __SYMBOL_TABLE_H__
 
 #include <stdbool.h>
+#include "arena.h"
 
 typedef struct HashData_s {
     char *key, *value;
+    //hash of key, set on creation
+    size_t hash;
 } HashData_t;
 
 
@@ -12,6 +15,9 @@ typedef struct HashTable_s {
     size_t count, size;
     HashData_t **entries;
 
+    //when set, symbols and their strings come from here and are
+    //released with the arena rather than one by one
+    Arena_t *arena;
 } HashTable_t;
 
 
@@ -30,6 +36,12 @@ typedef struct HashTable_s {
  */
 HashData_t *HashData_create(char *key, char *value);
 
+/*
+ * HashData_destroy:
+ *  Free a symbol along with its key and value.
+ */
+void HashData_destroy(HashData_t *data);
+
 
 /*
  * HashData_print:
@@ -44,10 +56,11 @@ void HashData_print(FILE *output, HashData_t *entry);
 
 /*
  * HashTable_init
- *  Initialize a symbol table instance.
+ *  Initialize a symbol table instance. The table grows on its
+ *  own as entries are added.
  *
  * Arguments:
- *  size: initial number of elements to allocate in symbol table.
+ *  size: number of entries the table should hold before it first grows.
  *
  * Returns:
  *  A pointer to a Symbol table instance. NULL if any error occured
@@ -55,11 +68,27 @@ void HashData_print(FILE *output, HashData_t *entry);
  */
 HashTable_t *HashTable_init(size_t size);
 
+/*
+ * HashTable_initArena
+ *  Initialize a symbol table whose symbols are allocated from an arena,
+ *  with their keys and values interned. Symbols for the table must be
+ *  made with HashTable_newEntry or HashTable_set. The arena must outlive
+ *  the table.
+ *
+ * Arguments:
+ *  size: number of entries the table should hold before it first grows.
+ *  arena: arena to allocate symbols from.
+ *
+ * Returns:
+ *  A pointer to a Symbol table instance. NULL if any error occured
+ *  in initialization.
+ */
+HashTable_t *HashTable_initArena(size_t size, Arena_t *arena);
+
 /*
  * HashTable_destroy:
- *  Free all memory allocated by a symbol table instance.
- *  Does not free key pointers nor pointers used in symbol
- *  data.
+ *  Free all memory allocated by a symbol table instance,
+ *  including its symbols unless they belong to an arena.
  *
  * Arguments:
  *  table: Symbol table to destroy
@@ -76,10 +105,12 @@ void HashTable_destroy(HashTable_t *table);
  *  key: Key to look up symbol with
  *  
  * Returns:
- *  A pointer to a location in the symbol table where the
- *  symbol should reside. Does not return the symbol itself.
- *  To get the symbol from this location, one just needs to
- *  dereference the return value, or use HashTable_find instead.
+ *  A pointer to the location in the symbol table holding the
+ *  symbol, NULL if key is not in the table. Does not return the
+ *  symbol itself. To get the symbol from this location, one just
+ *  needs to dereference the return value, or use HashTable_find
+ *  instead. The location is only valid until the table is next
+ *  added to or removed from.
  */
 HashData_t **HashTable_getEntry(HashTable_t *table, char *key);
 
@@ -93,10 +124,54 @@ HashData_t **HashTable_getEntry(HashTable_t *table, char *key);
  *
  * Returns:
  *  Location in Symbol Table in which the symbol was added to.
- *  NULL if no table or symbol arguments given.
+ *  NULL if no table or symbol arguments given, or the table
+ *  could not grow to fit it.
  */
 HashData_t **HashTable_add(HashTable_t *table, HashData_t *data);
 
+/*
+ * HashTable_newEntry:
+ *  Create a symbol for a table, from the table's arena if it has one.
+ *
+ * Returns:
+ *  The new symbol, NULL on allocation failure.
+ */
+HashData_t *HashTable_newEntry(HashTable_t *table, char *key, char *value);
+
+/*
+ * HashTable_set:
+ *  Set the value stored for key, adding a symbol if key isn't in the
+ *  table yet and otherwise replacing the value of the existing one.
+ *
+ * Returns:
+ *  Location in Symbol Table holding the symbol. NULL on allocation
+ *  failure.
+ */
+HashData_t **HashTable_set(HashTable_t *table, char *key, char *value);
+
+/*
+ * HashTable_remove:
+ *  Remove a symbol from a symbol table and free it.
+ *
+ * Arguments:
+ *  table: Symbol table to remove symbol from
+ *  key: Key of the symbol to remove
+ *
+ * Returns:
+ *  0 on success, -1 if key was not in the table.
+ */
+int HashTable_remove(HashTable_t *table, char *key);
+
+/*
+ * HashTable_resize:
+ *  Move all symbols into a table of at least size entries.
+ *
+ * Returns:
+ *  0 on success, -1 if size can't hold the current symbols
+ *  or allocation fails.
+ */
+int HashTable_resize(HashTable_t *table, size_t size);
+
 
 /*
  * HashTable_find:
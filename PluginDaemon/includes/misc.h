@@ -7,10 +7,20 @@
 
 
 #include <dirent.h>
+#include <time.h>
+#include <sys/types.h>
 
 //#define SYSLOG(logtype, fmt, ...) syslog((logtype), fmt, ##__VA_ARGS__)
 #define SYSLOG(logtype, fmt, ...) do {} while (0)
 
 extern int DirectoryAction(char *path, int (*forEach)(char *, struct dirent *, void *), void *data);
 
+extern double ElapsedMs(struct timespec *since);
+
+extern size_t HashBytes(const char *data, size_t len);
+
+extern int WriteAll(int fd, const char *data, size_t len);
+
+extern int WriteFileAtomic(const char *path, const char *data, size_t len, mode_t mode);
+
 #endif //MAGICMIRROR_MISC_H
@@ -2,11 +2,13 @@
 #define __PLUGIN_H__
 
 #include <unistd.h>
+#include <time.h>
 #include <libwebsockets.h>
 #include <uuid/uuid.h>
 #include "scheduler.h"
 #include "pluginSocket.h"
 #include "hashtable.h"
+#include "arena.h"
 #include "socketResponse.h"
 
 
@@ -26,6 +28,13 @@
 #define PLUGIN_CONF_OUTFILE "plugin.new.conf"
 #define PLUGIN_CONF_FILE "/" PLUGIN_CONF_FILENAME
 
+//css attributes saved from the frontend
+#define PLUGIN_SAVED_CSS_FILE "position.txt"
+//value the frontend takes as removing a css attribute
+#define PLUGIN_CSS_CLEAR "NULL"
+//css set through the API is sent to the display at most once per frame
+#define PLUGIN_CSS_FLUSH_MS 33
+
 
 #define PLUGIN_CONF_TAG_HTML "html-path"
 #define PLUGIN_CONF_TAG_JS "js-path:"
@@ -47,22 +56,65 @@
 #define PLUGIN_UUID_SHORT_LEN 32
 
 
+/*
+ * Values of a multi-valued setting (js-path:0, js-path:1, ...), in index order.
+ */
+typedef struct PluginConfList_s {
+    //key up to and including the ':' before the index, eg. "js-path:" or "[r]js-path:"
+    char *prefix;
+    size_t count, size;
+    //index each value was given in the config file, ascending
+    int *order;
+    //NULL terminated, borrowed from the config table entries
+    char **values;
+} PluginConfList_t;
+
+
 typedef struct PluginConf_s {
 
     //plugin config stored in hash table
     HashTable_t *table;
+    //holds the table's settings and the list prefixes
+    Arena_t *arena;
+
+    //multi-valued settings, indexed as they are added to the table
+    PluginConfList_t *lists;
+    size_t listCount;
 
     //Materialized Plugin Conf attributes
-    //eventually plan on deprecating the initialization
-    //of these so that pointers point to their hash
-    //table entry
-    //integer values will remain materialized
+    //known settings are parsed once into these fields (see the schema in
+    //pluginConf.c), only unknown keys and the settings as written in
+    //plugin.conf stay in the table. Strings live in the config arena.
+    char *html;
+    char *script;
+    char *scriptEscaped;
+    char *jsMain;
+    char *webgui;
 
     //update period length in seconds
     int periodLen;
 } PluginConf_t;
 
 
+/*
+ * Everything a display needs to start a plugin, queued as is on every
+ * load (see Plugin_LoadFrontend). Loads queue references to the buffer,
+ * so a rebuilt bundle never changes messages already queued.
+ */
+typedef struct PluginBundle_s {
+    //"load" then "innerdiv" message, each behind its own LWS padding
+    SharedWrite_t *buffer;
+    size_t loadLen, htmlOffset, htmlLen;
+    //mux channel the messages are framed for, 0 on the plugin's own socket
+    unsigned int channel;
+    //html file the innerdiv message was made from, if there is one
+    int hasHTML;
+    ino_t htmlIno;
+    off_t htmlSize;
+    struct timespec htmlMtime;
+} PluginBundle_t;
+
+
 typedef struct Plugin_s {
     //plugin name based on the plugin's directory name
     char *name;
@@ -81,19 +133,28 @@ typedef struct Plugin_s {
     //pid for bg script
     pid_t bgScriptPID;
 
-    //size of last frontend response message
+    //last complete frontend response message, handed over from the
+    //connection's per-session receive buffer once fully reassembled
     SocketResponse_t clientResponse;
-    SocketResponse_t externResponse;
 
     //socket instances
     struct lws *socketInstance;
+    //handle of the plugin's web protocol, doubles as its PluginMux channel
+    unsigned int channel;
     struct lws *externSocketInstance;
 
     //hash table for storing css data
     HashTable_t *cssAttr;
+    //css values are replaced at runtime, so their arena is compacted
+    //once it grows past cssCompactAt bytes
+    Arena_t *cssArena;
+    size_t cssCompactAt;
 
     PluginConf_t config;
 
+    //frontend bootstrap, built on first load after the config or css change
+    PluginBundle_t bundle;
+
     int writeable;
 } Plugin_t;
 
@@ -107,15 +168,30 @@ typedef enum {
     PLUGIN_FLAG_SCRIPT_BACKGROUND = (1 << 6),
     PLUGIN_FLAG_LOADED = (1 << 7),
     PLUGIN_FLAG_INBG = (1 << 8),
+    PLUGIN_FLAG_MUXED = (1 << 9),
+    //registered but not loaded, see Plugin_CreateStub
+    PLUGIN_FLAG_STUB = (1 << 10),
+    //css changed since it was last sent, see PluginCSS_queue
+    PLUGIN_FLAG_CSS_DIRTY = (1 << 11),
 } PluginFlags_e;
 
 extern int Plugin_Load(char *directory);
 
 extern Plugin_t *Plugin_Create(void);
 
+extern Plugin_t *Plugin_CreateStub(const char *path, const char *pluginName);
+
+extern void Plugin_MakeStub(Plugin_t *plugin);
+
+extern int Plugin_IsStub(Plugin_t *plugin);
+
+extern int Plugin_Materialize(Plugin_t *plugin);
+
+extern Plugin_t *Plugin_Parse(const char *path, const char *pluginName);
+
 extern Plugin_t *Plugin_Init(const char *path, const char *pluginName);
 
-extern void Plugin_Reload(Plugin_t *plugin);
+extern int Plugin_Reload(Plugin_t *plugin);
 
 extern char Plugin_Exists(Plugin_t *plugin);
 
@@ -141,6 +217,14 @@ extern char *Plugin_GetDaemonProtocol(Plugin_t *plugin);
 
 extern int Plugin_SendMsg(Plugin_t *plugin, char *command, char *data);
 
+extern int Plugin_SendRaw(Plugin_t *plugin, char *msg, size_t len);
+
+extern int Plugin_ClientAttach(Plugin_t *plugin, struct lws *wsi, int muxed);
+
+extern void Plugin_ClientDetach(Plugin_t *plugin);
+
+extern void Plugin_ClientReceive(Plugin_t *plugin, struct lws *wsi, SocketResponse_t *session);
+
 
 extern void Plugin_ClientFreeResponse(Plugin_t *plugin);
 
@@ -173,10 +257,16 @@ extern void Plugin_Enable(Plugin_t *plugin);
 
 extern void Plugin_Disable(Plugin_t *plugin);
 
-extern int Plugin_confApply(void *data, char *property, char *value);
+extern int Plugin_confApply(void *data, char *property, size_t propertyLen, char *value, size_t valueLen);
+
+extern int Plugin_initConfig(Plugin_t *plugin);
 
 extern int Plugin_loadConfig(Plugin_t *plugin);
 
+extern int PluginConf_Materialize(Plugin_t *plugin);
+
+extern void PluginConf_Free(Plugin_t *plugin);
+
 extern int Plugin_isFrontendLoaded(Plugin_t *plugin);
 
 extern void Plugin_UnloadFrontEnd(Plugin_t *plugin);
@@ -195,9 +285,9 @@ extern int PluginConf_setValue(Plugin_t *plugin, char *property, char *value);
 
 extern char *PluginConf_GetHTML(Plugin_t *plugin);
 
-extern char **PluginConf_GetCSS(Plugin_t *plugin, int *count);
+extern char *const *PluginConf_GetCSS(Plugin_t *plugin, int *count);
 
-extern char **PluginConf_GetJS(Plugin_t *plugin, int *count);
+extern char *const *PluginConf_GetJS(Plugin_t *plugin, int *count);
 
 extern char *PluginConf_GetEscapeScript(Plugin_t *plugin);
 
@@ -207,16 +297,24 @@ extern char *PluginConf_GetJSMain(Plugin_t *plugin);
 
 extern int PluginConf_GetScriptPeriod(Plugin_t *plugin);
 
-extern char **PluginConf_GetConfigValue(Plugin_t *plugin, char *property, int *count);
+extern char *const *PluginConf_GetConfigValue(Plugin_t *plugin, char *property, int *count);
+
+
+extern int PluginCSS_init(Plugin_t *plugin);
 
+extern void PluginCSS_free(Plugin_t *plugin);
 
 extern void PluginCSS_store(Plugin_t *plugin, char *cssValString);
 
+extern void PluginCSS_queue(Plugin_t *plugin, char *cssValString);
+
+extern int PluginCSS_flush(Plugin_t *plugin);
+
 extern void PluginCSS_dump(Plugin_t *plugin);
 
 extern void PluginCSS_load(Plugin_t *plugin);
 
-extern int PluginCSS_sendAll(Plugin_t *plugin);
+extern char *PluginCSS_serialize(Plugin_t *plugin);
 
 
 //extern int Plugin_SocketCallback(struct lws *wsi, websocket_callback_type reason, void *user,  void *in, size_t len);
@@ -224,10 +322,12 @@ extern int PluginCSS_sendAll(Plugin_t *plugin);
 //function ptr for operating on each node
 extern int PluginList_Init(void);
 
-extern void PluginList_Add(Plugin_t *plugin);
+extern int PluginList_Add(Plugin_t *plugin);
 
 extern Plugin_t *PluginList_Find(const char *pluginName);
 
+extern Plugin_t *PluginList_FindByUUID(const char *uuidShort);
+
 extern void PluginList_Delete(const char *pluginName);
 
 extern void PluginList_Free(void);
@@ -5,6 +5,10 @@
 #ifndef MAGICMIRROR_PLUGINCOMLIB_H
 #define MAGICMIRROR_PLUGINCOMLIB_H
 
+#include <stddef.h>
+
+extern size_t PluginComLib_escape(char *buf, const char *str);
+
 extern char *PluginComLib_makeMsg(char *command, char *data);
 
 #endif //MAGICMIRROR_PLUGINCOMLIB_H
@@ -9,6 +9,8 @@
 
 extern int PluginLoader_InitSocketConnection(Plugin_t *plugin);
 
+extern int PluginLoader_EnsureLoaded(Plugin_t *plugin);
+
 extern int PluginLoader_InitClient(Plugin_t *plugin);
 
 extern int PluginLoader_UnloadClient(Plugin_t *plugin);
@@ -17,6 +19,8 @@ extern int PluginLoader_RescheduleDisconnectedPlugin(Plugin_t *plugin);
 
 extern int PluginLoader_LoadPlugin(char *directory);
 
+extern int PluginLoader_LoadAll(char *directory);
+
 extern int PluginLoader_InstallPlugin(char *destDirectory, char *url);
 
 
@@ -0,0 +1,42 @@
+#ifndef SMARTREFLECT_PLUGINMANIFEST_H
+#define SMARTREFLECT_PLUGINMANIFEST_H
+
+#include <stdint.h>
+#include "plugin.h"
+
+//kept in the plugin directory, next to the plugin folders
+#define PLUGIN_MANIFEST_FILE ".plugins.manifest"
+
+/*
+ * Parsed plugins cached between boots.
+ *
+ * The manifest holds each plugin's config hash table exactly as it was laid out
+ * after parsing (absolute and escaped paths included), along with the flags set
+ * by its config. An entry is only used while the size and modification time of
+ * its plugin.conf still match. Saved css comes from the state store instead.
+ *
+ * Plugins that don't start on load are restored as stubs; their entries are
+ * carried over verbatim when the manifest is rewritten.
+ */
+
+typedef struct PluginStamp_s {
+    int64_t confSize, confSec, confNsec;
+} PluginStamp_t;
+
+typedef struct PluginManifest_s PluginManifest_t;
+
+
+extern int PluginManifest_Stamp(char *path, PluginStamp_t *stamp);
+
+extern PluginManifest_t *PluginManifest_Open(char *pluginDir);
+
+extern size_t PluginManifest_Count(PluginManifest_t *manifest);
+
+extern Plugin_t *PluginManifest_Restore(PluginManifest_t *manifest, char *path, char *name, PluginStamp_t *stamp);
+
+extern void PluginManifest_Close(PluginManifest_t *manifest);
+
+extern int PluginManifest_Save(char *pluginDir, PluginManifest_t *previous, Plugin_t **plugins, PluginStamp_t *stamps,
+                               size_t count);
+
+#endif //SMARTREFLECT_PLUGINMANIFEST_H
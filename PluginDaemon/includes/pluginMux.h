@@ -0,0 +1,36 @@
+#ifndef SMARTREFLECT_PLUGINMUX_H
+#define SMARTREFLECT_PLUGINMUX_H
+
+#include <libwebsockets.h>
+
+#define PLUGIN_MUX_PROTOCOL "PluginMux"
+//longest "<channel>\n" header, terminator included
+#define PLUGIN_MUX_HEADER_MAX 16
+
+/*
+ * One display connection carrying every plugin's frontend traffic.
+ *
+ * Each plugin is addressed by a channel number (its web protocol handle,
+ * sent to the display in the plugin's "load" command). Frames are:
+ *
+ *  "<channel>\n<message>"  plugin traffic, in either direction
+ *  "+<channel>"            browser attaches a plugin client to the channel
+ *  "-<channel>"            browser detaches it again
+ *
+ * Everything after the header is exactly what the plugin's own websocket
+ * would have carried.
+ */
+
+extern void PluginMux_SetEnabled(int enabled);
+
+extern int PluginMux_IsEnabled(void);
+
+extern int PluginMux_Init(void);
+
+extern char *PluginMux_GetProtocolName(void);
+
+extern int PluginMux_Header(char *buf, unsigned int channel);
+
+extern int PluginMux_Write(struct lws *wsi, unsigned int channel, char *msg, size_t len, unsigned int tag);
+
+#endif //SMARTREFLECT_PLUGINMUX_H
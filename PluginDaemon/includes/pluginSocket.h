@@ -6,6 +6,7 @@
 #define MAGICMIRROR_PLUGINSOCKET_H
 
 #include <libwebsockets.h>
+#include "protocolWrite.h"
 
 #define PLUGIN_RX_BUFFER_SIZE 0
 
@@ -18,6 +19,8 @@ extern void PluginSocket_FreeProtocolList(void);
 
 extern struct lws_protocols *PluginSocket_getProtocol(char *name);
 
+extern struct lws_protocols *PluginSocket_getProtocolByHandle(unsigned int handle);
+
 extern int PluginSocket_AddProtocol(struct lws_protocols *proto);
 
 extern void PluginSocket_RemoveProtocol(char *protocolName);
@@ -32,10 +35,18 @@ extern void PluginSocket_Cleanup(void);
 
 extern int PluginSocket_writeToSocket(struct lws *wsi_in, char *str, int str_size_in, char noHeader);
 
+extern int PluginSocket_writeTagged(struct lws *wsi_in, char *str, int str_size_in, char noHeader, unsigned int tag);
+
+extern int PluginSocket_writeShared(struct lws *wsi_in, SharedWrite_t *shared, size_t offset, size_t len);
+
 extern void PluginSocket_writeBuffers(struct lws *wsi);
 
 extern void PluginSocket_clearWriteBuffers(struct lws *wsi, char onlyDead);
 
+extern void PluginSocket_openWriteBuffers(struct lws *wsi);
+
+extern void PluginSocket_closeWriteBuffers(struct lws *wsi);
+
 extern char PluginSocket_ServeHtmlFile(char *htmlPath);
 
 extern char PluginSocket_SetComDir(char *comDir);
@@ -0,0 +1,33 @@
+#ifndef SMARTREFLECT_PLUGINSTATE_H
+#define SMARTREFLECT_PLUGINSTATE_H
+
+#include "plugin.h"
+
+//kept in the plugin directory, next to the plugin folders
+#define PLUGIN_STATE_FILE ".plugins.state"
+
+/*
+ * Runtime state of every plugin, kept in one file for the whole daemon:
+ * whether it was enabled or disabled through the API and its saved css.
+ *
+ * The file is a log of records keyed by plugin name, read once at startup.
+ * Changes are appended, each batch in a single write, and the log is
+ * rewritten with only the live records once it has grown mostly stale.
+ *
+ * The enabled state saved here wins over start-on-load in plugin.conf.
+ * Plugins not in the store yet have their position.txt imported once.
+ */
+
+extern int PluginState_Open(char *pluginDir);
+
+extern int PluginState_GetEnabled(char *name);
+
+extern int PluginState_SetEnabled(char *name, int enabled);
+
+extern int PluginState_LoadCSS(Plugin_t *plugin);
+
+extern int PluginState_SaveCSS(Plugin_t *plugin);
+
+extern void PluginState_Close(void);
+
+#endif //SMARTREFLECT_PLUGINSTATE_H
@@ -0,0 +1,30 @@
+#ifndef SMARTREFLECT_PLUGINWATCH_H
+#define SMARTREFLECT_PLUGINWATCH_H
+
+#include "plugin.h"
+
+/*
+ * Watches the plugin directory so plugins can be added, removed and
+ * reconfigured while the daemon runs:
+ *
+ *  -a new plugin folder (or one whose plugin.conf shows up later) is loaded
+ *  -a removed plugin folder removes the plugin
+ *  -an edited plugin.conf reloads the plugin
+ *
+ * Events are picked up by PluginWatch_Update from the main loop.
+ * PluginWatch_Rescan applies the same changes on demand, diffing the whole
+ * directory against the loaded plugins.
+ */
+
+//called with the name of each plugin that failed to load or reload
+typedef void (*PluginWatchFailed_f)(const char *name, void *data);
+
+extern int PluginWatch_Init(char *pluginDir);
+
+extern void PluginWatch_Update(void);
+
+extern int PluginWatch_Rescan(PluginWatchFailed_f failed, void *data);
+
+extern void PluginWatch_Cleanup(void);
+
+#endif //SMARTREFLECT_PLUGINWATCH_H
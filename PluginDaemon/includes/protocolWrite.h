@@ -9,10 +9,41 @@
 
 #define NUM_BUFFERED_WRITES 256
 
+/*
+ * Protocol ids are generational handles: the low bits index the slot
+ * (and write queue) the protocol occupies, the high bits count how many
+ * times that slot has been reused. A stale id left over from a removed
+ * protocol never matches the queue of the protocol that replaced it.
+ */
+#define PROTOCOL_HANDLE_SLOT_BITS 16
+#define PROTOCOL_HANDLE_SLOT_MASK ((1u << PROTOCOL_HANDLE_SLOT_BITS) - 1)
+#define PROTOCOL_HANDLE_INVALID 0
+
+#define PROTOCOL_HANDLE(slot, gen) \
+  ((((unsigned int)(gen)) << PROTOCOL_HANDLE_SLOT_BITS) | ((unsigned int)(slot) & PROTOCOL_HANDLE_SLOT_MASK))
+#define PROTOCOL_HANDLE_SLOT(handle) ((unsigned int)(handle) & PROTOCOL_HANDLE_SLOT_MASK)
+#define PROTOCOL_HANDLE_GEN(handle) ((unsigned int)(handle) >> PROTOCOL_HANDLE_SLOT_BITS)
+
+
+/*
+ * A buffer queued to any number of connections without being copied.
+ * Every message queued from it needs LWS_SEND_BUFFER_PRE_PADDING bytes of
+ * its own in front of it. Each queued write holds a reference, the buffer
+ * is free'd once the last one is released.
+ */
+typedef struct SharedWrite_s {
+    unsigned int refs;
+    size_t size;
+    unsigned char data[];
+} SharedWrite_t;
 
 typedef struct BufferedWrite_s {
     int descriptor;
+    //nonzero for messages a newer one with the same tag replaces
+    unsigned int tag;
     void *msg;
+    //set if msg points into a shared buffer rather than owning its memory
+    SharedWrite_t *shared;
     size_t len;
 } BufferedWrite_t;
 
@@ -21,23 +52,42 @@ typedef struct WriteQueue_s {
     size_t lastBuffered, lastWritten;
 } WriteQueue_t;
 
+//queue slot for one protocol, queue is NULL while nothing is connected
+typedef struct ProtocolQueue_s {
+    WriteQueue_t *queue;
+    unsigned int handle;
+    int connections;
+} ProtocolQueue_t;
+
 typedef struct ProtocolWrites_s {
-    WriteQueue_t *buffer;
+    ProtocolQueue_t *buffer;
     size_t bufferCount;
 } ProtocolWrites_t;
 
-extern void Protocol_addWriteToQueue(ProtocolWrites_t * protowrites, struct lws *socket, void *msg, size_t len);
+extern void Protocol_addWriteToQueue(ProtocolWrites_t * protowrites, struct lws *socket, void *msg, size_t len,
+                                    unsigned int tag);
+
+extern SharedWrite_t *Protocol_newShared(size_t size);
+
+extern void Protocol_releaseShared(SharedWrite_t *shared);
+
+extern void Protocol_addSharedToQueue(ProtocolWrites_t *protowrites, struct lws *socket, SharedWrite_t *shared,
+                                      size_t offset, size_t len, unsigned int tag);
 
 extern void Protocol_processQueue(struct lws *socket, ProtocolWrites_t *protowrites);
 
 extern int Protocol_setProtocolCount(ProtocolWrites_t *protowrites, size_t newCount);
 
-extern int Protocol_removeProtocol(ProtocolWrites_t *protowrites, unsigned int protocolID);
+extern int Protocol_removeProtocol(ProtocolWrites_t *protowrites, unsigned int handle);
+
+extern int Protocol_openQueue(struct lws *socket, ProtocolWrites_t *protowrites);
+
+extern void Protocol_closeQueue(struct lws *socket, ProtocolWrites_t *protowrites);
 
 extern void Protocol_clearQueue(struct lws *socket, ProtocolWrites_t *protowrites);
 
 extern void Protocol_destroyQueues(ProtocolWrites_t *protowrites);
 
-extern void Protocol_initQueue(ProtocolWrites_t *protowrites, unsigned int protocolID);
+extern void Protocol_initQueue(ProtocolWrites_t *protowrites, unsigned int handle);
 
 #endif //SMARTREFLECT_PROTOCOLWRITE_H
@@ -22,5 +22,9 @@ extern char *SocketResponse_get(SocketResponse_t *sockr);
 
 extern size_t SocketResponse_size(SocketResponse_t *sockr);
 
+extern void SocketResponse_take(SocketResponse_t *dest, SocketResponse_t *src);
+
+extern void SocketResponse_skip(SocketResponse_t *sockr, size_t count);
+
 
 #endif //MAGICMIRROR_SOCKETRESPONSE_H
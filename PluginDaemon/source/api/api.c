@@ -8,6 +8,7 @@
 #include <limits.h>
 #include <syslog.h>
 #include <libgen.h>
+#include <time.h>
 
 //#include "api.h"
 #include "plugin.h"
@@ -18,11 +19,19 @@
 #include "socketResponse.h"
 #include "misc.h"
 #include "pluginLoader.h"
+#include "pluginWatch.h"
+#include "pluginState.h"
 
 
 #define API_PROTO "STDIN"
 #define API_PROTO_LOCAL "STDIN_LOCAL"
 #define API_PLUGLIST_DELIM "\n"
+//properties a single getcss can answer without the frontend
+#define API_CSS_MAX_PROPS 32
+//mirrorsize values (un)subscribing a connection from display size changes
+#define API_SIZE_WATCH "watch"
+#define API_SIZE_UNWATCH "unwatch"
+#define API_SIZE_MAX_WATCHERS 16
 #define CLIENT_API_HEADER "[API]"
 
 //defined in main.c, read for time it takes to boot
@@ -40,14 +49,28 @@ static int _shutdown = 0;
 
 static int _reboot = 0;
 
-static SocketResponse_t inputResponse;
-
 static char *pluginsDirectory = NULL;
 
+//css set since the last flush, and when that was
+static int _cssQueued = 0;
+static struct timespec _cssFlushed;
+
+//API connections told about every display size change
+typedef struct SizeWatcher_s {
+    struct lws *wsi;
+    char *identifier;
+    //serial of the last display size the watcher was told about
+    unsigned int sizeSent;
+} SizeWatcher_t;
+
+static SizeWatcher_t _sizeWatchers[API_SIZE_MAX_WATCHERS];
+
 
 
 static void doAction(struct lws *wsi, char * identifier, APIAction_e action, Plugin_t *plugin, char *value);
 
+static int apiCallback(struct lws *wsi, websocket_callback_type reason, void *user, void *in, size_t len);
+
 APICommand_t allActions[API_ACTION_COUNT] = {
         [API_LIST_CMDS] = {"commands", NONE},
         /*
@@ -62,7 +85,7 @@ APICommand_t allActions[API_ACTION_COUNT] = {
          * Loads a plugin into the frontend and if applicable, enables
          * it in the main scheduler for providing display updates.
          */
-        [API_ENABLE] = {"enable", NEED_PLUGIN},
+        [API_ENABLE] = {"enable", NEED_PLUGIN | NEED_LOADED},
 
         /*
          * reload <pluginName>
@@ -71,7 +94,7 @@ APICommand_t allActions[API_ACTION_COUNT] = {
          * then reloads it back into the frontend and scheduler
          * with the newly loaded configuration setup.
          */
-        [API_RELOAD] = {"reload", NEED_PLUGIN},
+        [API_RELOAD] = {"reload", NEED_PLUGIN | NEED_LOADED},
 
         /*
          * plugins
@@ -95,9 +118,13 @@ APICommand_t allActions[API_ACTION_COUNT] = {
         [API_RM_PLUG] = {"rmplug",     NEED_PLUGIN},
 
         /*
-         * mirrorsize
+         * mirrorsize [watch|unwatch]
          * Returns the frontend display dimensions as a string
-         * formatted as 'widthxheight'.
+         * formatted as 'widthxheight'. The display pushes its size
+         * when it connects and when it is resized, so this is answered
+         * straight away once it has. With 'watch', the connection is
+         * also sent a mirrorsize response whenever the size changes,
+         * until it closes or sends 'unwatch'.
          */
         [API_MIR_SIZE] = {"mirrorsize", NONE},
 
@@ -112,7 +139,7 @@ APICommand_t allActions[API_ACTION_COUNT] = {
          * Set a CSS value for a plugin's frontend
          * display.
          */
-        [API_SET_CSS] = {"setcss", NEED_PLUGIN | NEED_VALUES},
+        [API_SET_CSS] = {"setcss", NEED_PLUGIN | NEED_VALUES | NEED_LOADED},
 
         /*
          * getcss <plugin> <attr1, attr2,....>
@@ -120,11 +147,14 @@ APICommand_t allActions[API_ACTION_COUNT] = {
          * If plugin is not loaded to frontend, nothing will
          * be returned. Multiple CSS properties can be queried
          * for and will be delimited with a newline character.
+         * When every property was set through setcss, the values
+         * they were set to are returned straight away, without
+         * asking the frontend, loaded or not.
          */
-        [API_GET_CSS] = {"getcss", NEED_PLUGIN | NEED_VALUES},
+        [API_GET_CSS] = {"getcss", NEED_PLUGIN | NEED_VALUES | NEED_LOADED},
 
 
-        [API_DUMP_CSS] = {"savecss", NEED_PLUGIN},
+        [API_DUMP_CSS] = {"savecss", NEED_PLUGIN | NEED_LOADED},
 
         /*
          * getstate <plugin>
@@ -141,7 +171,7 @@ APICommand_t allActions[API_ACTION_COUNT] = {
          * being the name of the function to execute, and 'args' property
          * being the arguments to provide to that function call.
          */
-        [API_JS_PLUG_CMD] = {"jscmd", NEED_PLUGIN | NEED_VALUES},
+        [API_JS_PLUG_CMD] = {"jscmd", NEED_PLUGIN | NEED_VALUES | NEED_LOADED},
 
         /*
          * display
@@ -154,7 +184,7 @@ APICommand_t allActions[API_ACTION_COUNT] = {
          * Returns a value in a plugins config file based
          * on the queried setting.
          */
-        [API_GET_CONFIG] = {"getopt", NEED_PLUGIN | NEED_VALUES},
+        [API_GET_CONFIG] = {"getopt", NEED_PLUGIN | NEED_VALUES | NEED_LOADED},
 
         /*
          * setcfg <plugin> <config_file_setting>=<new_value>
@@ -197,6 +227,89 @@ static int response(APIResponse_t *response, struct lws *wsi, char *identifier,
 }
 
 
+/*
+ * Fill a response with the size last pushed by the display.
+ * Returns -1 if the display hasn't pushed one.
+ */
+static int actionDisplaySize(APIResponse_t *response) {
+
+  int width = 0, height = 0;
+  if (!Display_GetCachedSize(&width, &height))
+    return -1;
+
+  char sizeString[32];
+  snprintf(sizeString, sizeof(sizeString), "%dx%d", width, height);
+  APIResponse_concat(response, sizeString, -1);
+  return 0;
+}
+
+static void unwatchSize(struct lws *wsi) {
+
+  for (int i = 0; i < API_SIZE_MAX_WATCHERS; i++) {
+    if (_sizeWatchers[i].wsi != wsi)
+      continue;
+
+    free(_sizeWatchers[i].identifier);
+    _sizeWatchers[i] = (SizeWatcher_t) {};
+  }
+}
+
+static int watchSize(struct lws *wsi, char *identifier) {
+
+  char *idToken = NULL;
+  if (identifier) {
+    idToken = strdup(identifier);
+    if (!idToken) {
+      SYSLOG(LOG_ERR, "watchSize: Error allocating ID token.");
+      return -1;
+    }
+  }
+
+  //a connection watching again only swaps its identifier
+  unwatchSize(wsi);
+  for (int i = 0; i < API_SIZE_MAX_WATCHERS; i++) {
+    if (_sizeWatchers[i].wsi)
+      continue;
+
+    //the watch request itself is answered with the current size
+    _sizeWatchers[i] = (SizeWatcher_t) {
+            .wsi = wsi,
+            .identifier = idToken,
+            .sizeSent = Display_GetCachedSize(NULL, NULL)
+    };
+    return 0;
+  }
+
+  free(idToken);
+  return -1;
+}
+
+/*
+ * Tell every watcher about a new display size.
+ */
+static void pushDisplaySize(void) {
+
+  unsigned int serial = Display_GetCachedSize(NULL, NULL);
+  if (!serial)
+    return;
+
+  for (int i = 0; i < API_SIZE_MAX_WATCHERS; i++) {
+    if (!_sizeWatchers[i].wsi || _sizeWatchers[i].sizeSent == serial)
+      continue;
+
+    _sizeWatchers[i].sizeSent = serial;
+
+    APIResponse_t *sizeResponse = APIResponse_new();
+    if (!sizeResponse)
+      return;
+
+    actionDisplaySize(sizeResponse);
+    response(sizeResponse, _sizeWatchers[i].wsi, _sizeWatchers[i].identifier, NULL, API_MIR_SIZE,
+             API_STATUS_SUCCESS);
+    APIResponse_free(sizeResponse);
+  }
+}
+
 /*
  * Sets an action to wait for a response from the daemon plugin communicator.
  */
@@ -260,12 +373,22 @@ static int actionPluginList(void *plugin, void *data) {
   return 0;
 }
 
+/*
+ * (PluginWatchFailed_f) callback function.
+ */
+static void actionRebootFailed(const char *name, void *data) {
+
+  APIResponse_t *response = (APIResponse_t *) data;
+  APIResponse_concat(response, API_PLUGLIST_DELIM, 1);
+  APIResponse_concat(response, (char *) name, -1);
+}
+
 static int actionPluginEnable(Plugin_t *plugin) {
 
   Plugin_Enable(plugin);
   Display_LoadPlugin(plugin);
-  //set plugin configuration to load on next boot
-  PluginConf_setValue(plugin, PLUGIN_CONF_START_ON_LOAD, PLUGIN_CONF_OPT_TRUE);
+  //remember to load the plugin on next boot
+  PluginState_SetEnabled(Plugin_GetName(plugin), 1);
   SYSLOG(LOG_INFO, "API: Enabled plugin");
   return 0;
 }
@@ -280,7 +403,7 @@ static int actionPluginDisable(void *plug, void *shutdown) {
   //if the mirror is shutting down, then the plugin isn't being disabled by the user
   //and is likely intended to startup again on next boot.
   if (!shutdown)
-    PluginConf_setValue(plugin, PLUGIN_CONF_START_ON_LOAD, PLUGIN_CONF_OPT_FALSE);
+    PluginState_SetEnabled(Plugin_GetName(plugin), 0);
   else
     PluginSocket_Update();
 
@@ -322,7 +445,7 @@ static int actionWritePluginSetting(APIResponse_t *response, Plugin_t *plugin, c
 static int actionGetPluginSetting(APIResponse_t *response, Plugin_t *plugin, char *setting) {
 
   int count = 0;
-  char **config = PluginConf_GetConfigValue(plugin, setting, &count);
+  char *const *config = PluginConf_GetConfigValue(plugin, setting, &count);
 
   APIResponse_concat(response, setting, -1);
   APIResponse_concat(response, ":", 1);
@@ -336,7 +459,54 @@ static int actionGetPluginSetting(APIResponse_t *response, Plugin_t *plugin, cha
     APIResponse_concat(response, "\n", 1);
   }
 
-  free(config);
+  return 0;
+}
+
+/*
+ * Answer getcss from the css the daemon set itself, in the same
+ * "attr=value\n" form the frontend replies with. Returns -1, leaving
+ * response untouched, if any property is unknown here or was cleared,
+ * in which case only the frontend has its computed value.
+ */
+static int actionGetPluginCSS(APIResponse_t *response, Plugin_t *plugin, char *properties) {
+
+  char attr[PATH_MAX];
+  HashData_t *found[API_CSS_MAX_PROPS];
+  size_t count = 0;
+
+  char *pos = properties;
+  while (*pos != '\0') {
+    char *end = strchr(pos, ',');
+    size_t len = end ? (size_t) (end - pos) : strlen(pos);
+
+    //empty properties are skipped, as the frontend does
+    if (len) {
+      if (len >= sizeof(attr) || count == API_CSS_MAX_PROPS)
+        return -1;
+
+      memcpy(attr, pos, len);
+      attr[len] = '\0';
+
+      found[count] = HashTable_find(plugin->cssAttr, attr);
+      if (!found[count] || !strcmp(found[count]->value, PLUGIN_CSS_CLEAR))
+        return -1;
+      count++;
+    }
+
+    pos += len + (end != NULL);
+  }
+
+  if (!count)
+    return -1;
+
+  size_t i = 0;
+  for (i = 0; i < count; i++) {
+    APIResponse_concat(response, found[i]->key, -1);
+    APIResponse_concat(response, "=", 1);
+    APIResponse_concat(response, found[i]->value, -1);
+    APIResponse_concat(response, "\n", 1);
+  }
+
   return 0;
 }
 
@@ -372,6 +542,12 @@ static void doAction(struct lws *wsi, char * identifier, APIAction_e action, Plu
   if (status != API_STATUS_SUCCESS)
     goto _response;
 
+  if (allActions[action].flag & NEED_LOADED && PluginLoader_EnsureLoaded(plugin)) {
+    status = API_STATUS_FAIL;
+    APIResponse_concat(immResponse, "Failed to load plugin.", -1);
+    goto _response;
+  }
+
   switch (action) {
     case API_NO_ACTION:
       status = API_STATUS_FAIL;
@@ -394,17 +570,13 @@ static void doAction(struct lws *wsi, char * identifier, APIAction_e action, Plu
       if (actionPluginEnable(plugin))
         status = API_STATUS_FAIL;
       break;
-    case API_RELOAD: {
-      //reload plugin and reload plugin
-      //syslog(LOG_INFO, "Reloaded plugin");
-      int status = Plugin_isEnabled(plugin);
-      //only disable and re-enable plugin on the frontend
-      //if it was previously running
-      if (status) actionPluginDisable(plugin, NULL);
-      Plugin_Reload(plugin);
-      if (status) actionPluginEnable(plugin);
-
-    }
+    case API_RELOAD:
+      if (API_ReloadPlugin(plugin)) {
+        //a plugin that failed to reload has been removed
+        status = API_STATUS_FAIL;
+        APIResponse_concat(immResponse, "Failed to reload plugin, it has been removed.", -1);
+        plugin = NULL;
+      }
       break;
     case API_PLUGINS:
       //list plugins to fifo file
@@ -416,52 +588,85 @@ static void doAction(struct lws *wsi, char * identifier, APIAction_e action, Plu
       APIResponse_concat(immResponse, Plugin_GetDirectory(plugin), -1);
       SYSLOG(LOG_INFO, "Got plugin directory");
       break;
-    case API_RM_PLUG: {
-      //if plugin is currently running, unload it first
-      if (Plugin_isEnabled(plugin))
-        actionPluginDisable(plugin, NULL);
-
+    case API_RM_PLUG:
       //set plugin name as payload since the name
       //will not be available after removing the plugin.
       APIResponse_concat(immResponse, Plugin_GetName(plugin), -1);
-      //then delete it
-      PluginList_Delete(Plugin_GetName(plugin));
+      API_RemovePlugin(plugin);
       plugin = NULL;
-      SYSLOG(LOG_INFO, "Unloaded plugin");
-    }
       break;
     case API_MIR_SIZE: {
-      if (Display_GetDisplaySize())
+      if (value && !strcmp(value, API_SIZE_UNWATCH)) {
+        unwatchSize(wsi);
+        break;
+      }
+
+      if (value && !strcmp(value, API_SIZE_WATCH)) {
+        //only API connections say when they close
+        const struct lws_protocols *proto = lws_get_protocol(wsi);
+        if (!proto || proto->callback != apiCallback || watchSize(wsi, identifier)) {
+          status = API_STATUS_FAIL;
+          APIResponse_concat(immResponse, "Failed to watch display size.", -1);
+          break;
+        }
+      }
+
+      if (!actionDisplaySize(immResponse))
+        break;
+
+      //displays that don't push their size are still asked for it
+      if (Display_GetDisplaySize()) {
         status = API_STATUS_FAIL;
+        APIResponse_concat(immResponse, "No display connected.", -1);
+        break;
+      }
 
       status = waitForDaemonResponse(immResponse, identifier, action, plugin, wsi);
     }
       break;
 
     case API_REBOOT: {
-      _reboot = 1;
+      //only apply what changed in the plugin directory, keeping the socket server,
+      //the display and working plugins running. A plugin that fails to load is
+      //dropped; everything is restarted only if the directory can't be read.
+      APIResponse_t *failed = APIResponse_new();
+      unsigned int waitSeconds = 0;
+      if (PluginWatch_Rescan(failed ? actionRebootFailed : NULL, failed)) {
+        _reboot = 1;
+        _shutdown = 1;
+        waitSeconds = MainProgram_BootSeconds;
+      }
 
-      char numString[PATH_MAX];
-      sprintf(numString, "%d", MainProgram_BootSeconds);
+      char numString[32];
+      sprintf(numString, "%u", waitSeconds);
       SYSLOG(LOG_INFO, "API Reboot String: %s", numString);
-      //return number of seconds to the web gui to reboot on
+      //return number of seconds to the web gui to reboot on,
+      //followed by a line for each plugin that failed to load
       APIResponse_concat(immResponse, numString, -1);
+      if (failed && failed->payload)
+        APIResponse_concat(immResponse, failed->payload, -1);
+      APIResponse_free(failed);
     }
+      break;
     case API_STOP:
       _shutdown = 1;
-      if (!API_Reboot())
-        APIResponse_concat(immResponse, "Shutting down daemon...", -1);
+      APIResponse_concat(immResponse, "Shutting down daemon...", -1);
       SYSLOG(LOG_INFO, "Stopped mirror");
       break;
     case API_SET_CSS:
       SYSLOG(LOG_INFO, "Set plugin CSS");
-      Plugin_SendMsg(plugin, "setcss", value);
-      PluginCSS_store(plugin, value);
+      //sent with the next flush in API_Update, along with any other changes by then
+      PluginCSS_queue(plugin, value);
+      _cssQueued = 1;
       break;
     case API_GET_CSS:
-      //modify the css of the specified plugin and regenerate index
-      //modify this css file with the values
-      SYSLOG(LOG_INFO, "Modified plugin css");
+      SYSLOG(LOG_INFO, "Get plugin css");
+      //css set through the api is known here, anything else takes the frontend
+      if (!actionGetPluginCSS(immResponse, plugin, value))
+        break;
+
+      //the display has to see any css still queued before it's asked for it
+      PluginCSS_flush(plugin);
       Plugin_SendMsg(plugin, "getcss", value);
       status = waitForPluginResponse(immResponse, identifier, action, plugin, wsi);
       break;
@@ -629,11 +834,16 @@ static void parseInput(char *input, size_t inputLen, struct lws *wsi) {
 /*
  * This callback handler is for handling external applications -> this daemon information. This daemon will
  * then forward messages to the proper frontend interface.
+ *
+ * Each connection reassembles its own input in its per-session data (user), so
+ * any number of API clients can send fragmented commands at the same time.
  */
 static int apiCallback(struct lws *wsi, websocket_callback_type reason, void *user, void *in, size_t len) {
   struct lws_protocols *proto = NULL;
   if (wsi) proto = (struct lws_protocols *) lws_get_protocol(wsi);
 
+  SocketResponse_t *inputResponse = (SocketResponse_t *) user;
+
   switch (reason) {
     case LWS_CALLBACK_SERVER_WRITEABLE: {
       PluginSocket_writeBuffers(wsi);
@@ -642,32 +852,36 @@ static int apiCallback(struct lws *wsi, websocket_callback_type reason, void *us
 
     case LWS_CALLBACK_ESTABLISHED:
       SYSLOG(LOG_INFO, "InputReader connection established established[%s]", proto->name);
+      PluginSocket_openWriteBuffers(wsi);
       lws_callback_on_writable(wsi);
       break;
 
     case LWS_CALLBACK_RECEIVE: {
 
-      if (!len)
+      if (!len || !inputResponse)
         return 0;
 
-      SocketResponse_build(&inputResponse, wsi, (char *) in, len);
-      if (SocketResponse_done(&inputResponse)) {
+      SocketResponse_build(inputResponse, wsi, (char *) in, len);
+      if (SocketResponse_done(inputResponse)) {
 
-        SYSLOG(LOG_INFO, "Command->%s", SocketResponse_get(&inputResponse));
+        SYSLOG(LOG_INFO, "Command->%s", SocketResponse_get(inputResponse));
         //wait for full message before parsing input
         if (proto) {
-          parseInput(SocketResponse_get(&inputResponse),
-                     SocketResponse_size(&inputResponse), wsi);
+          parseInput(SocketResponse_get(inputResponse),
+                     SocketResponse_size(inputResponse), wsi);
 
         }
-        SocketResponse_free(&inputResponse);
+        SocketResponse_free(inputResponse);
       }
     }
       break;
 
     case LWS_CALLBACK_CLOSED:
       SYSLOG(LOG_INFO, "InputReader disconnect[%s]", proto->name);
-      SocketResponse_free(&inputResponse);
+      if (inputResponse)
+        SocketResponse_free(inputResponse);
+      unwatchSize(wsi);
+      PluginSocket_closeWriteBuffers(wsi);
       return -1;
 
     default:
@@ -681,6 +895,52 @@ static int apiCallback(struct lws *wsi, websocket_callback_type reason, void *us
  * public facing functions
  */
 
+/*
+ * Re-read a plugin's config file. A plugin running on the frontend is
+ * unloaded first and loaded back once its new config is in place.
+ *
+ * A plugin that fails to reload is removed, returning -1.
+ */
+int API_ReloadPlugin(Plugin_t *plugin) {
+
+  //reload plugin and reload plugin
+  //syslog(LOG_INFO, "Reloaded plugin");
+  int status = Plugin_isEnabled(plugin);
+  //only disable and re-enable plugin on the frontend
+  //if it was previously running
+  if (status) actionPluginDisable(plugin, NULL);
+  if (Plugin_Reload(plugin)) {
+    SYSLOG(LOG_ERR, "API_ReloadPlugin: Error reloading %s, removing it", Plugin_GetName(plugin));
+    API_RemovePlugin(plugin);
+    return -1;
+  }
+  if (status) actionPluginEnable(plugin);
+  return 0;
+}
+
+/*
+ * Completely remove a plugin from the daemon, leaving its files alone.
+ */
+void API_RemovePlugin(Plugin_t *plugin) {
+
+  //if plugin is currently running, unload it first
+  if (Plugin_isEnabled(plugin))
+    actionPluginDisable(plugin, NULL);
+
+  //pending requests must not outlive the plugin
+  APIPending_removePlugin(plugin);
+
+  //a stub never registered its protocols
+  if (!Plugin_IsStub(plugin)) {
+    PluginSocket_RemoveProtocol(Plugin_GetWebProtocol(plugin));
+    PluginSocket_RemoveProtocol(Plugin_GetDaemonProtocol(plugin));
+  }
+
+  //then delete it
+  PluginList_Delete(Plugin_GetName(plugin));
+  SYSLOG(LOG_INFO, "Unloaded plugin");
+}
+
 
 void API_ShutdownPlugins() {
 
@@ -700,8 +960,6 @@ void API_ShutdownPlugins() {
     API_Update();
     PluginSocket_Update();
   }
-
-  SocketResponse_free(&inputResponse);
 }
 
 static void makeApiContext(char *protocol) {
@@ -711,6 +969,7 @@ static void makeApiContext(char *protocol) {
   proto.name = protocol;
   proto.callback = &apiCallback;
   proto.rx_buffer_size = PLUGIN_RX_BUFFER_SIZE;
+  proto.per_session_data_size = sizeof(SocketResponse_t);
   PluginSocket_AddProtocol(&proto);
 }
 
@@ -721,18 +980,31 @@ void API_Init(char *pluginDir) {
 
   makeApiContext(API_PROTO);
   makeApiContext(API_PROTO_LOCAL);
-  SocketResponse_free(&inputResponse);
   APIPending_init();
 
   _shutdown = 0;
   _reboot = 0;
 }
 
+static int flushPluginCSS(void *plugin, void *data) {
+
+  PluginCSS_flush((Plugin_t *) plugin);
+  return 0;
+}
+
 //API Update loop for processing pending actions
 //Pending actions will block other api calls
 void API_Update(void) {
 
   APIPending_update();
+  pushDisplaySize();
+
+  //a plugin dragged around sets its css far more often than the display redraws
+  if (_cssQueued && ElapsedMs(&_cssFlushed) >= PLUGIN_CSS_FLUSH_MS) {
+    _cssQueued = 0;
+    PluginList_ForEach(flushPluginCSS, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &_cssFlushed);
+  }
 }
 
 
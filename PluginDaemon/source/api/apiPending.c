@@ -96,6 +96,18 @@ void APIPending_freeSlot(int slot) {
   SYSLOG(LOG_INFO, "APIPending: Clearing processed response");
 }
 
+/*
+ * Drop every pending action waiting on a plugin that is about to be removed.
+ */
+void APIPending_removePlugin(Plugin_t *plugin) {
+
+  int i = 0;
+  for (i = 0; i < MAX_PENDING_ACTIONS; i++) {
+    if (pendingActions[i].action != API_NO_ACTION && pendingActions[i].plugin == plugin)
+      APIPending_freeSlot(i);
+  }
+}
+
 void APIPending_update(void) {
 
   do {
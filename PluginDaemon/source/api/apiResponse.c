@@ -2,6 +2,8 @@
 #include <syslog.h>
 #include <libwebsockets.h>
 #include "apiResponse.h"
+#include "plugin.h"
+#include "pluginMux.h"
 #include "misc.h"
 
 #define API_RETURN_FMT "%s:%s:%s:%s:%s"
@@ -107,6 +109,14 @@ int APIResponse_send(APIResponse_t *response, struct lws *wsi, char *identifier,
 
   SYSLOG(LOG_INFO, "API Response: %s", resPtr);
 
+  //calls made by a plugin client over the shared mux connection are answered on its channel
+  Plugin_t *target = plugin ? PluginList_Find(plugin) : NULL;
+  if (target && target->flags & PLUGIN_FLAG_MUXED && target->socketInstance == wsi) {
+    int status = PluginMux_Write(wsi, target->channel, resPtr, strlen(resPtr), 0);
+    free(responseStr);
+    return status;
+  }
+
   //responseStr is created with LWS header, set 'noHeader' flag and responseStr will be free'd after
   //it is sent
   return PluginSocket_writeToSocket(wsi, responseStr, -1, 1);
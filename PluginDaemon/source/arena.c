@@ -0,0 +1,200 @@
+/*=======================================================
+arena.c
+
+Bump allocator over a list of blocks. Allocations come
+from the newest block until it runs out, then a new block
+is added; anything larger than a block gets a block of its
+own. Interned strings are tracked in a linear probing set
+that doubles once it is three quarters full.
+=======================================================*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include "arena.h"
+#include "misc.h"
+
+#define ARENA_ALIGN sizeof(void *)
+#define ARENA_ROUND(size) (((size) + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1))
+
+#define ARENA_MIN_STRINGS 16
+
+//grow once count reaches 3/4 of the set
+#define ARENA_STRINGS_FULL(count, size) ((count) * 4 >= (size) * 3)
+
+
+struct ArenaBlock_s {
+    ArenaBlock_t *next;
+    size_t size, used;
+    //block memory follows
+};
+
+#define BLOCK_HEADER ARENA_ROUND(sizeof(ArenaBlock_t))
+#define BLOCK_DATA(block) ((char *) (block) + BLOCK_HEADER)
+
+
+static ArenaBlock_t *newBlock(size_t size) {
+
+  ArenaBlock_t *block = calloc(1, BLOCK_HEADER + size);
+  if (!block) {
+    SYSLOG(LOG_ERR, "Arena: Error allocating %zu byte block", size);
+    return NULL;
+  }
+
+  block->size = size;
+  return block;
+}
+
+static ArenaString_t *findString(ArenaString_t *strings, size_t size, const char *str, size_t len, size_t hash) {
+
+  size_t mask = size - 1;
+  size_t pos = hash & mask;
+
+  while (strings[pos].str) {
+    ArenaString_t *entry = &strings[pos];
+    if (entry->hash == hash && !strncmp(entry->str, str, len) && entry->str[len] == '\0')
+      return entry;
+
+    pos = (pos + 1) & mask;
+  }
+
+  return &strings[pos];
+}
+
+static int growStrings(Arena_t *arena) {
+
+  size_t newSize = arena->stringSize ? arena->stringSize << 1 : ARENA_MIN_STRINGS;
+  ArenaString_t *strings = calloc(newSize, sizeof(ArenaString_t));
+  if (!strings) {
+    SYSLOG(LOG_ERR, "Arena: Error allocating %zu interned strings", newSize);
+    return -1;
+  }
+
+  size_t i = 0;
+  for (i = 0; i < arena->stringSize; i++) {
+    ArenaString_t *entry = &arena->strings[i];
+    if (entry->str)
+      *findString(strings, newSize, entry->str, strlen(entry->str), entry->hash) = *entry;
+  }
+
+  free(arena->strings);
+  arena->strings = strings;
+  arena->stringSize = newSize;
+  return 0;
+}
+
+
+Arena_t *Arena_init(size_t blockSize) {
+
+  blockSize = ARENA_ROUND(blockSize);
+  size_t arenaSize = ARENA_ROUND(sizeof(Arena_t));
+  if (blockSize < arenaSize)
+    blockSize = arenaSize;
+
+  ArenaBlock_t *block = newBlock(blockSize);
+  if (!block)
+    return NULL;
+
+  Arena_t *arena = (Arena_t *) BLOCK_DATA(block);
+  block->used = arenaSize;
+
+  arena->blocks = block;
+  arena->blockSize = blockSize;
+  return arena;
+}
+
+void Arena_destroy(Arena_t *arena) {
+
+  if (!arena)
+    return;
+
+  free(arena->strings);
+
+  //the arena itself lives in the last block in the list
+  ArenaBlock_t *block = arena->blocks;
+  while (block) {
+    ArenaBlock_t *next = block->next;
+    free(block);
+    block = next;
+  }
+}
+
+void *Arena_alloc(Arena_t *arena, size_t size) {
+
+  if (!arena)
+    return NULL;
+
+  size = ARENA_ROUND(size);
+  ArenaBlock_t *block = arena->blocks;
+
+  if (block->size - block->used < size) {
+    //oversized requests get their own block behind the current one,
+    //so what is left of the current block isn't wasted
+    if (size > arena->blockSize / 2) {
+      ArenaBlock_t *own = newBlock(size);
+      if (!own)
+        return NULL;
+
+      own->used = size;
+      own->next = block->next;
+      block->next = own;
+      arena->used += size;
+      return BLOCK_DATA(own);
+    }
+
+    block = newBlock(arena->blockSize);
+    if (!block)
+      return NULL;
+
+    block->next = arena->blocks;
+    arena->blocks = block;
+  }
+
+  void *mem = BLOCK_DATA(block) + block->used;
+  block->used += size;
+  arena->used += size;
+  return mem;
+}
+
+char *Arena_internLen(Arena_t *arena, const char *str, size_t len) {
+
+  if (!arena || !str)
+    return NULL;
+
+  if (ARENA_STRINGS_FULL(arena->stringCount + 1, arena->stringSize) && growStrings(arena))
+    return NULL;
+
+  size_t hash = HashBytes(str, len);
+  ArenaString_t *entry = findString(arena->strings, arena->stringSize, str, len, hash);
+  if (entry->str)
+    return entry->str;
+
+  char *copy = Arena_alloc(arena, len + 1);
+  if (!copy)
+    return NULL;
+
+  memcpy(copy, str, len);
+  copy[len] = '\0';
+
+  entry->hash = hash;
+  entry->str = copy;
+  arena->stringCount++;
+  return copy;
+}
+
+char *Arena_intern(Arena_t *arena, const char *str) {
+
+  if (!str)
+    return NULL;
+
+  return Arena_internLen(arena, str, strlen(str));
+}
+
+size_t Arena_getUsed(const Arena_t *arena) {
+
+  if (!arena)
+    return 0;
+
+  return arena->used;
+}
@@ -1,7 +1,14 @@
 /*=======================================================
 btree.c
 
-A binary tree implmentation
+An ordered binary tree implementation, balanced as a
+red-black tree. All walks are iterative.
+
+BTree_forEach visits a snapshot of the tree taken when
+it starts, so the operation may add or remove nodes
+(even the one it was handed) while iterating. Nodes
+removed mid-iteration are unlinked immediately but
+only destroyed once the last forEach returns.
 =======================================================*/
 
 #include <stdio.h>
@@ -22,127 +29,319 @@ void msgAssert(char condition, const char *msg) {
 /*=======================================================
 Private Code.
 =======================================================*/
-static BTreeNode_t *_btree_find(BTreeNode_t **tn, const BTreeNode_comparator nodeCompare, const BTreeNode_t *key) {
+#define IS_RED(node) ((node) != NULL && (node)->red)
+#define IS_BLACK(node) (!IS_RED(node))
 
-  int comparison = 0;
-  BTreeNode_t *result = NULL;
 
-  /*hit end of tree, nothing found*/
-  if (!*tn)
-    return NULL;
-
-  comparison = nodeCompare(*tn, key);
-  if (comparison > 0)
-    result = _btree_find(&(*tn)->left, nodeCompare, key);
-  else if (comparison < 0)
-    result = _btree_find(&(*tn)->right, nodeCompare, key);
-  else
-    result = (*tn);
+static BTreeNode_t *_btree_minimum(BTreeNode_t *node) {
 
-  return result;
-}
+  while (node && node->left)
+    node = node->left;
 
+  return node;
+}
 
-static void _btree_insert(BTreeNode_t **tn, const BTreeNode_comparator nodeCompare, BTreeNode_t *newNode) {
+//in-order successor of a node
+static BTreeNode_t *_btree_next(BTreeNode_t *node) {
 
-  int comparison = 0;
+  if (node->right)
+    return _btree_minimum(node->right);
 
-  if (!*tn) {
-    *tn = newNode;
-    return;
+  BTreeNode_t *parent = node->parent;
+  while (parent && node == parent->right) {
+    node = parent;
+    parent = parent->parent;
   }
 
-  comparison = nodeCompare(*tn, newNode);
-  if (comparison > 0)
-    _btree_insert(&(*tn)->left, nodeCompare, newNode);
-  else if (comparison < 0)
-    _btree_insert(&(*tn)->right, nodeCompare, newNode);
+  return parent;
+}
+
+static BTreeNode_t *_btree_find(BTreeNode_t *tn, const BTreeNode_comparator nodeCompare, const BTreeNode_t *key) {
 
-  return;
+  while (tn) {
+    int comparison = nodeCompare(tn, key);
+    if (comparison > 0)
+      tn = tn->left;
+    else if (comparison < 0)
+      tn = tn->right;
+    else
+      return tn;
+  }
+
+  /*hit end of tree, nothing found*/
+  return NULL;
 }
 
-static void _btree_print(BTreeNode_t *start, int (*print)(const char *, ...), const BTree_PrintData printData) {
 
-  if (!start) return;
+static void _btree_rotateLeft(BTree_t *tree, BTreeNode_t *node) {
 
-  _btree_print(start->left, print, printData);
+  BTreeNode_t *pivot = node->right;
 
-  print("\t%d\t", (size_t) start->data);
-  printData(start->data, print);
-  print("\n");
+  node->right = pivot->left;
+  if (pivot->left)
+    pivot->left->parent = node;
 
-  _btree_print(start->right, print, printData);
+  pivot->parent = node->parent;
+  if (!node->parent)
+    tree->head = pivot;
+  else if (node == node->parent->left)
+    node->parent->left = pivot;
+  else
+    node->parent->right = pivot;
+
+  pivot->left = node;
+  node->parent = pivot;
 }
 
+static void _btree_rotateRight(BTree_t *tree, BTreeNode_t *node) {
 
-static int _btree_forEach(BTreeNode_t *start, BTreeNode_Operator op, void *data) {
+  BTreeNode_t *pivot = node->left;
 
-  if (!start) return 0;
+  node->left = pivot->right;
+  if (pivot->right)
+    pivot->right->parent = node;
 
-  int lstatus = _btree_forEach(start->left, op, data);
-  if (lstatus) return lstatus;
+  pivot->parent = node->parent;
+  if (!node->parent)
+    tree->head = pivot;
+  else if (node == node->parent->right)
+    node->parent->right = pivot;
+  else
+    node->parent->left = pivot;
 
-  int opstatus = op(BTreeNode_getData(start), data);
-  if (opstatus) return opstatus;
+  pivot->right = node;
+  node->parent = pivot;
+}
 
-  int rstatus = _btree_forEach(start->right, op, data);
-  if (rstatus) return rstatus;
 
-  return 0;
+static void _btree_insertFixup(BTree_t *tree, BTreeNode_t *node) {
+
+  while (IS_RED(node->parent)) {
+    BTreeNode_t *parent = node->parent;
+    BTreeNode_t *grandparent = parent->parent;
+
+    if (parent == grandparent->left) {
+      BTreeNode_t *uncle = grandparent->right;
+
+      if (IS_RED(uncle)) {
+        parent->red = 0;
+        uncle->red = 0;
+        grandparent->red = 1;
+        node = grandparent;
+        continue;
+      }
+
+      if (node == parent->right) {
+        node = parent;
+        _btree_rotateLeft(tree, node);
+        parent = node->parent;
+      }
+
+      parent->red = 0;
+      grandparent->red = 1;
+      _btree_rotateRight(tree, grandparent);
+    } else {
+      BTreeNode_t *uncle = grandparent->left;
+
+      if (IS_RED(uncle)) {
+        parent->red = 0;
+        uncle->red = 0;
+        grandparent->red = 1;
+        node = grandparent;
+        continue;
+      }
+
+      if (node == parent->left) {
+        node = parent;
+        _btree_rotateRight(tree, node);
+        parent = node->parent;
+      }
+
+      parent->red = 0;
+      grandparent->red = 1;
+      _btree_rotateLeft(tree, grandparent);
+    }
+  }
+
+  tree->head->red = 0;
 }
 
+/*
+ * Returns 0 if the node was inserted, -1 if a node with
+ * an equal key is already in the tree.
+ */
+static int _btree_insert(BTree_t *tree, BTreeNode_t *newNode) {
 
-static void _btree_destroy(BTreeNode_t *start, const BTreeNode_rmNodeData rmData) {
+  BTreeNode_t *parent = NULL, *cur = tree->head;
+  int comparison = 0;
 
-  BTreeNode_t *left, *right;
-  if (!start) return;
-  /*need to copy these since we are deleting the node*/
-  left = start->left;
-  right = start->right;
+  while (cur) {
+    parent = cur;
+    comparison = tree->nodeCompare(cur, newNode);
+    if (comparison > 0)
+      cur = cur->left;
+    else if (comparison < 0)
+      cur = cur->right;
+    else
+      return -1;
+  }
 
-  _btree_destroy(left, rmData);
+  newNode->parent = parent;
+  newNode->left = NULL;
+  newNode->right = NULL;
+  newNode->red = 1;
+  newNode->removed = 0;
 
-  BTreeNode_destroy(start, rmData);
+  if (!parent)
+    tree->head = newNode;
+  else if (comparison > 0)
+    parent->left = newNode;
+  else
+    parent->right = newNode;
 
-  _btree_destroy(right, rmData);
+  _btree_insertFixup(tree, newNode);
+  return 0;
 }
 
-static BTreeNode_t *_btree_remove(BTreeNode_t **tree, const BTreeNode_rmNodeData rmData,
-                                  const BTreeNode_comparator nodeCompare, const BTreeNode_t *key) {
 
-  if (!*tree) return *tree;
+//replace the subtree rooted at old with the one rooted at replacement
+static void _btree_transplant(BTree_t *tree, BTreeNode_t *old, BTreeNode_t *replacement) {
 
-  int comparison = 0;
+  if (!old->parent)
+    tree->head = replacement;
+  else if (old == old->parent->left)
+    old->parent->left = replacement;
+  else
+    old->parent->right = replacement;
 
-  comparison = nodeCompare(*tree, key);
-  if (comparison > 0)
-    (*tree)->left = _btree_remove(&(*tree)->left, rmData, nodeCompare, key);
-  else if (comparison < 0)
-    (*tree)->right = _btree_remove(&(*tree)->right, rmData, nodeCompare, key);
-  else {
-
-    if ((*tree)->left == NULL) {
-      BTreeNode_t *temp = (*tree)->right;
-      BTreeNode_destroy(*tree, rmData);
-      return temp;
-    }
-    else if ((*tree)->right == NULL) {
+  if (replacement)
+    replacement->parent = old->parent;
+}
 
-      BTreeNode_t *temp = (*tree)->left;
-      BTreeNode_destroy(*tree, rmData);
-      return temp;
+//node may be NULL, so its parent is passed along separately
+static void _btree_removeFixup(BTree_t *tree, BTreeNode_t *node, BTreeNode_t *parent) {
+
+  while (node != tree->head && IS_BLACK(node)) {
+
+    if (node == parent->left) {
+      BTreeNode_t *sibling = parent->right;
+
+      if (IS_RED(sibling)) {
+        sibling->red = 0;
+        parent->red = 1;
+        _btree_rotateLeft(tree, parent);
+        sibling = parent->right;
+      }
+
+      if (IS_BLACK(sibling->left) && IS_BLACK(sibling->right)) {
+        sibling->red = 1;
+        node = parent;
+        parent = node->parent;
+        continue;
+      }
+
+      if (IS_BLACK(sibling->right)) {
+        sibling->left->red = 0;
+        sibling->red = 1;
+        _btree_rotateRight(tree, sibling);
+        sibling = parent->right;
+      }
+
+      sibling->red = parent->red;
+      parent->red = 0;
+      sibling->right->red = 0;
+      _btree_rotateLeft(tree, parent);
+      node = tree->head;
+    } else {
+      BTreeNode_t *sibling = parent->left;
+
+      if (IS_RED(sibling)) {
+        sibling->red = 0;
+        parent->red = 1;
+        _btree_rotateRight(tree, parent);
+        sibling = parent->left;
+      }
+
+      if (IS_BLACK(sibling->left) && IS_BLACK(sibling->right)) {
+        sibling->red = 1;
+        node = parent;
+        parent = node->parent;
+        continue;
+      }
+
+      if (IS_BLACK(sibling->left)) {
+        sibling->right->red = 0;
+        sibling->red = 1;
+        _btree_rotateLeft(tree, sibling);
+        sibling = parent->left;
+      }
+
+      sibling->red = parent->red;
+      parent->red = 0;
+      sibling->left->red = 0;
+      _btree_rotateRight(tree, parent);
+      node = tree->head;
     }
-    //otherwise, node has two children
-    BTreeNode_t *successor = (*tree)->right;
-    while (successor->left != NULL) {
-      successor = successor->left;
+  }
+
+  if (node)
+    node->red = 0;
+}
+
+/*
+ * Unlink a node from the tree. Nodes are moved rather than having their
+ * data swapped, so a node always keeps the data it was created with.
+ */
+static void _btree_unlink(BTree_t *tree, BTreeNode_t *node) {
+
+  BTreeNode_t *child = NULL, *childParent = NULL;
+  char removedRed = node->red;
+
+  if (!node->left) {
+    child = node->right;
+    childParent = node->parent;
+    _btree_transplant(tree, node, node->right);
+  } else if (!node->right) {
+    child = node->left;
+    childParent = node->parent;
+    _btree_transplant(tree, node, node->left);
+  } else {
+    //node has two children, its successor takes its place
+    BTreeNode_t *successor = _btree_minimum(node->right);
+    removedRed = successor->red;
+    child = successor->right;
+
+    if (successor->parent == node) {
+      childParent = successor;
+    } else {
+      childParent = successor->parent;
+      _btree_transplant(tree, successor, successor->right);
+      successor->right = node->right;
+      successor->right->parent = successor;
     }
 
-    (*tree)->data = successor->data;
-    (*tree)->right = _btree_remove(&(*tree)->right, rmData, nodeCompare, key);
+    _btree_transplant(tree, node, successor);
+    successor->left = node->left;
+    successor->left->parent = successor;
+    successor->red = node->red;
   }
 
-  return *tree;
+  if (!removedRed)
+    _btree_removeFixup(tree, child, childParent);
+
+  node->left = NULL;
+  node->right = NULL;
+  node->parent = NULL;
+}
+
+//destroy nodes removed while a forEach was in progress
+static void _btree_buryRemoved(BTree_t *tree) {
+
+  while (tree->graveyard) {
+    BTreeNode_t *node = tree->graveyard;
+    tree->graveyard = node->parent;
+    BTreeNode_destroy(node, tree->rmNodeData);
+  }
 }
 
 /*=======================================================
@@ -168,6 +367,7 @@ void BTreeNode_destroy(BTreeNode_t *node, const BTreeNode_rmNodeData rmData) {
   node->data = NULL;
   node->left = NULL;
   node->right = NULL;
+  node->parent = NULL;
   free(node);
 }
 
@@ -196,7 +396,33 @@ void BTree_destroy(BTree_t *tree) {
 
   if (!tree) return;
 
-  _btree_destroy(tree->head, tree->rmNodeData);
+  //take nodes apart bottom up without recursing
+  BTreeNode_t *node = tree->head;
+  while (node) {
+    if (node->left) {
+      node = node->left;
+      continue;
+    }
+    if (node->right) {
+      node = node->right;
+      continue;
+    }
+
+    BTreeNode_t *parent = node->parent;
+    if (parent) {
+      if (parent->left == node)
+        parent->left = NULL;
+      else
+        parent->right = NULL;
+    }
+
+    BTreeNode_destroy(node, tree->rmNodeData);
+    node = parent;
+  }
+
+  tree->head = NULL;
+  _btree_buryRemoved(tree);
+
   tree->size = 0;
   tree->nodeCompare = NULL;
   tree->rmNodeData = NULL;
@@ -205,19 +431,27 @@ void BTree_destroy(BTree_t *tree) {
 }
 
 
-void BTree_add(BTree_t *tree, BTreeNode_t *node) {
+int BTree_add(BTree_t *tree, BTreeNode_t *node) {
+
+  if (!tree || !node)
+    return -1;
 
-  if (tree && node) {
-    _btree_insert(&tree->head, tree->nodeCompare, node);
-    tree->size++;
+  if (_btree_insert(tree, node)) {
+    //key already exists, the caller keeps ownership of the data
+    SYSLOG(LOG_ERR, "BTree_add: duplicate key, node not added");
+    free(node);
+    return -1;
   }
+
+  tree->size++;
+  return 0;
 }
 
 
 BTreeNode_t *BTree_find(BTree_t *tree, const BTreeNode_t *key) {
 
   if (tree && key)
-    return _btree_find(&tree->head, tree->nodeCompare, key);
+    return _btree_find(tree->head, tree->nodeCompare, key);
 
   return NULL;
 }
@@ -225,17 +459,58 @@ BTreeNode_t *BTree_find(BTree_t *tree, const BTreeNode_t *key) {
 void BTree_print(const BTree_t *tree, int (*print)(const char *, ...), const BTree_PrintData printData) {
   /*if no print functions are specified, no point in visiting
     each node to not print anything*/
-  if (tree && print && printData)
-    _btree_print(tree->head, print, printData);
+  if (!tree || !print || !printData)
+    return;
+
+  BTreeNode_t *node = _btree_minimum(tree->head);
+  for (; node; node = _btree_next(node)) {
+    print("\t%d\t", (size_t) node->data);
+    printData(node->data, print);
+    print("\n");
+  }
 }
 
-int BTree_forEach(const BTree_t *tree, BTreeNode_Operator operation, void *data) {
+/*
+ * Apply operation to every node's data in order, stopping early if it
+ * returns non-zero. The nodes visited are the ones in the tree when the
+ * call starts; nodes removed along the way are skipped, nodes added along
+ * the way are not visited.
+ */
+int BTree_forEach(BTree_t *tree, BTreeNode_Operator operation, void *data) {
+
+  if (!tree || !operation)
+    return -1;
+
+  if (!tree->size)
+    return 0;
 
-  if (tree && operation) {
-    return _btree_forEach(tree->head, operation, data);
+  BTreeNode_t **snapshot = malloc(sizeof(BTreeNode_t *) * tree->size);
+  if (!snapshot) {
+    SYSLOG(LOG_ERR, "BTree_forEach: Error allocating iteration snapshot");
+    return -1;
   }
 
-  return -1;
+  int count = 0;
+  BTreeNode_t *node = _btree_minimum(tree->head);
+  for (; node && count < tree->size; node = _btree_next(node))
+    snapshot[count++] = node;
+
+  tree->iterating++;
+
+  int status = 0;
+  for (int i = 0; i < count && !status; i++) {
+    if (snapshot[i]->removed)
+      continue;
+
+    status = operation(BTreeNode_getData(snapshot[i]), data);
+  }
+
+  tree->iterating--;
+  if (!tree->iterating)
+    _btree_buryRemoved(tree);
+
+  free(snapshot);
+  return status;
 }
 
 
@@ -246,5 +521,23 @@ int BTree_getSize(const BTree_t *tree) {
 
 void BTree_rmNode(BTree_t *tree, const BTreeNode_t *key) {
 
-  tree->head = _btree_remove(&tree->head, tree->rmNodeData, tree->nodeCompare, key);
-}
\ No newline at end of file
+  if (!tree || !key)
+    return;
+
+  BTreeNode_t *node = _btree_find(tree->head, tree->nodeCompare, key);
+  if (!node)
+    return;
+
+  _btree_unlink(tree, node);
+  tree->size--;
+
+  //a forEach may still hold this node, keep it around until iteration ends
+  if (tree->iterating) {
+    node->removed = 1;
+    node->parent = tree->graveyard;
+    tree->graveyard = node;
+    return;
+  }
+
+  BTreeNode_destroy(node, tree->rmNodeData);
+}
@@ -1,304 +1,386 @@
-//
-// Created by David on 1/14/16.
-//
-#include <stdio.h>
-#include <stdlib.h>
-#include <sys/stat.h>
-#include <sys/syslog.h>
-#include <string.h>
-#include <limits.h>
-#include <fcntl.h>
-#include <unistd.h>
-
-#include "configReader.h"
-#include "misc.h"
-
-
-#define PLUGIN_CONF_PROPERTY_LEN 256
-#define PLUGIN_CONF_COMMENT '#'
-#define PLUGIN_CONF_ASSIGN '='
-
-
-static char *skipLeadingWhiteSpace(char *inputLine) {
-
-  while (*inputLine == ' ' || *inputLine == '\t')
-    inputLine++;
-
-  return inputLine;
-}
-
-static char *trimTrailingWhiteSpace(char *inputLine) {
-
-  char *end = inputLine + strlen(inputLine);
-
-  while (*end == '\0' || *end == '\r' || *end == '\n' || *end == '\t')
-    *end-- = '\0';
-
-  return inputLine;
-}
-
-static char *getProperty(char *inputLine, char *output) {
-
-  while (*inputLine != PLUGIN_CONF_ASSIGN && *inputLine != '\0') {
-    //skip any spaces or tabs within the property name
-    if (*inputLine == ' ' || *inputLine == '\t')
-      inputLine++;
-      //and copy the rest
-    else
-      *output++ = *inputLine++;
-  }
-  *output = '\0';
-  return inputLine;
-}
-
-static char *getValue(char *inputLine, char *output) {
-
-  //skip any spaces immediately after the = sign
-  while (*inputLine == ' ' || *inputLine == '\t')
-    inputLine++;
-
-  while (*inputLine != '\n' && *inputLine != '\0') {
-    //ignore optional quotes
-    if (*inputLine == '\"')
-      inputLine++;
-
-    *output++ = *inputLine++;
-  }
-  *output = '\0';
-
-  return inputLine;
-}
-
-/*
-Read plugin config file
-
-Config file follows the layout of:
-  propertyName=valueToAssign
-
-with lines having '#' as the first character being ignored as comments.
-
- Inputs: Filepath, function pointer for applyConfig, pointer to data for the config
- pass in void *data into apply if apply exists
- */
-
-int ConfigReader_readConfig(char *filePath, int (*apply)(void *, char *, char *), void *data) {
-
-  if (!data) {
-    SYSLOG(LOG_ERR, "Config Reader: No data intiailized...");
-    return -1;
-  }
-  if (!filePath) {
-    SYSLOG(LOG_ERR, "Config Reader: No filepath initalized...");
-    return -1;
-  }
-
-  //open config file for reading
-  FILE *confStream = fopen(filePath, "r");
-  if (!confStream) {
-    SYSLOG(LOG_ERR, "Config Reader: Config file is missing %s", filePath);
-    return -1;
-  }
-
-  size_t lineCount = 0;
-  char lineBuf[PLUGIN_CONF_PROPERTY_LEN + PATH_MAX];
-  char property[PLUGIN_CONF_PROPERTY_LEN], value[PATH_MAX];
-
-  while (!feof(confStream)) {
-    lineCount++;
-
-    //read next line in the config file
-    memset(lineBuf, 0, sizeof(lineBuf));
-    char *line = fgets(lineBuf, sizeof(lineBuf), confStream);
-    if (!line)
-      break;
-
-
-    //strip trailing white space
-    line = trimTrailingWhiteSpace(line);
-    //line is empty, skip it
-    if (strlen(line) < 1)
-      continue;
-
-    //strip leading white space
-    line = skipLeadingWhiteSpace(line);
-    memmove(lineBuf, line, strlen(line));
-    line = lineBuf;
-
-    //skip line if commented out
-    if (*line == PLUGIN_CONF_COMMENT)
-      continue;
-
-    //otherwise grab the setting
-    line = getProperty(line, property);
-
-    //make sure we aren't at the end of the line
-    if (*line == '\0')
-      continue;
-
-    //skip equal sign
-    line++;
-
-    //grab value now
-    line = getValue(line, value);
-
-    //set plugin property
-    if (apply) apply(data, property, value);
-  }
-
-  //close config file
-  fclose(confStream);
-  return 0;
-}
-
-//insert a new value for a setting into an existing config file
-//or append a new setting that does not exist to the file
-int ConfigReader_writeConfig(char *outputFile, char *origFile, char *setting, char *newVal) {
-
-  if (!origFile || !outputFile) {
-    SYSLOG(LOG_ERR, "Config Reader: No filepath initalized...");
-    return -1;
-  }
-
-  //open config file for reading
-  FILE *confStream = fopen(origFile, "r");
-  if (!confStream) {
-    SYSLOG(LOG_ERR, "Config Reader: Config file is missing %s", origFile);
-    return -1;
-  }
-
-  FILE *saveStream = fopen(outputFile, "w");
-  if (!saveStream) {
-    SYSLOG(LOG_ERR, "ConfigReader: Output config file missing %s", outputFile);
-    fclose(confStream);
-    return -1;
-  }
-
-  size_t lineCount = 0;
-  char lineBuf[PLUGIN_CONF_PROPERTY_LEN + PATH_MAX];
-  char property[PLUGIN_CONF_PROPERTY_LEN], value[PATH_MAX];
-
-  int foundProperty = 0;
-
-  //read input stream
-  //write to output stream
-  while (!feof(confStream)) {
-    lineCount++;
-
-    //read next line in the config file
-    memset(lineBuf, 0, sizeof(lineBuf));
-    char *line = fgets(lineBuf, sizeof(lineBuf), confStream);
-    if (!line) break;
-
-
-    //strip trailing white space
-    line = trimTrailingWhiteSpace(line);
-
-    //line is empty, skip it
-    if (strlen(lineBuf) < 1) {
-      //preserve whitespace in the output file
-      fprintf(saveStream, "\n");
-      continue;
-    }
-
-    //strip leading white space
-    line = skipLeadingWhiteSpace(line);
-    memmove(lineBuf, line, strlen(line));
-    line = lineBuf;
-
-    //skip line if commented out
-    if (*line == PLUGIN_CONF_COMMENT) {
-      //preserve comments in the output stream
-      fprintf(saveStream, "%s\n", line);
-      continue;
-    }
-
-    //otherwise grab the setting
-    line = getProperty(line, property);
-
-    //write out the <property> = part
-    //check if we have found the value we wish to change
-    if (!foundProperty && !strncmp(property, setting, strlen(setting))) {
-      foundProperty = 1;
-
-      //remove blank settings in the config file
-      if (strlen(newVal) < 1)
-        continue;
-
-      fprintf(saveStream, "%s=", property);
-      fprintf(saveStream, "%s\n", newVal);
-      continue;
-    }
-
-    //otherwise, write out the old value, since we are leaving it unchanged
-    //make sure we aren't at the end of the line
-    if (*line == '\0') continue;
-
-    fprintf(saveStream, "%s=", property);
-
-    //skip equal sign
-    line++;
-
-    //grab value now
-    line = getValue(line, value);
-    fprintf(saveStream, "%s\n", value);
-  }
-
-  //if we haven't found the property yet in the config file, its likely a new setting
-  //so we can append it to the end of the file
-  if (!foundProperty && strlen(newVal) > 0)
-    fprintf(saveStream, "%s=%s\n", setting, newVal);
-
-  //close config file
-  fclose(confStream);
-  fclose(saveStream);
-
-
-  //rename second file to original file
-  if (!unlink(origFile))
-    rename(outputFile, origFile);
-
-
-  return 0;
-}
-
-
-char *ConfigReader_escapePath(char *str) {
-
-  if (!str) {
-    SYSLOG(LOG_ERR, "ConfigReader_escapePath: null string passed in");
-    return NULL;
-  }
-
-  SYSLOG(LOG_INFO, "ConfigReader_escapePath: path to escape: %s", str);
-  int size = strlen(str);
-  int spaces = 0;
-
-  //count number of spaces
-  char *start = str;
-  while (start != NULL) {
-    start = strchr(start, ' ');
-    if (start != NULL) {
-      spaces++;
-      start++;
-    }
-  }
-  size += spaces;
-  SYSLOG(LOG_INFO, "ConfigReader_escapePath: number of spaces to escape: %d", spaces);
-  char *newStr = calloc(size + 1, sizeof(char));
-  if (!newStr) {
-    SYSLOG(LOG_ERR, "ConfigReader_escapePath: error allocating space for escape path");
-    return NULL;
-  }
-
-  char *dest = newStr;
-  while (*str != '\0' && *str != '\n') {
-    if (*str == ' ') {
-      *dest++ = '\\';
-    }
-    *dest++ = *str++;
-  }
-  *dest = '\0';
-
-  SYSLOG(LOG_INFO, "ConfigReader_escapePath: new escaped string: %s", newStr);
-  return newStr;
-}
+//
+// Created by David on 1/14/16.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <sys/syslog.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "configReader.h"
+#include "misc.h"
+
+
+#define PLUGIN_CONF_PROPERTY_LEN 256
+#define PLUGIN_CONF_COMMENT '#'
+#define PLUGIN_CONF_ASSIGN '='
+
+
+static char *skipLeadingWhiteSpace(char *inputLine) {
+
+  while (*inputLine == ' ' || *inputLine == '\t')
+    inputLine++;
+
+  return inputLine;
+}
+
+static char *trimTrailingWhiteSpace(char *inputLine) {
+
+  char *end = inputLine + strlen(inputLine);
+
+  while (end > inputLine && (end[-1] == '\r' || end[-1] == '\n' || end[-1] == '\t'))
+    *--end = '\0';
+
+  return inputLine;
+}
+
+static char *getProperty(char *inputLine, char *output) {
+
+  while (*inputLine != PLUGIN_CONF_ASSIGN && *inputLine != '\0') {
+    //skip any spaces or tabs within the property name
+    if (*inputLine == ' ' || *inputLine == '\t')
+      inputLine++;
+      //and copy the rest
+    else
+      *output++ = *inputLine++;
+  }
+  *output = '\0';
+  return inputLine;
+}
+
+static char *getValue(char *inputLine, char *output) {
+
+  //skip any spaces immediately after the = sign
+  while (*inputLine == ' ' || *inputLine == '\t')
+    inputLine++;
+
+  while (*inputLine != '\n' && *inputLine != '\0') {
+    //ignore optional quotes
+    if (*inputLine == '\"')
+      inputLine++;
+
+    *output++ = *inputLine++;
+  }
+  *output = '\0';
+
+  return inputLine;
+}
+
+/*
+ * Map a config file privately and writable, so lines can be cut up in
+ * place without touching the file. There is always at least one zero byte
+ * after the contents: the mapping is rounded up past the file's end, and
+ * when the file ends on a page boundary the extra page is anonymous.
+ */
+static char *mapConfig(char *filePath, size_t *size, size_t *mapSize) {
+
+  int fd = open(filePath, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    SYSLOG(LOG_ERR, "Config Reader: Config file is missing %s", filePath);
+    return NULL;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st)) {
+    close(fd);
+    return NULL;
+  }
+
+  size_t pageSize = (size_t) sysconf(_SC_PAGESIZE);
+  *size = (size_t) st.st_size;
+  *mapSize = (*size / pageSize + 1) * pageSize;
+
+  char *map = mmap(NULL, *mapSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (map == MAP_FAILED) {
+    close(fd);
+    return NULL;
+  }
+
+  if (*size && mmap(map, *size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+    SYSLOG(LOG_ERR, "Config Reader: Error mapping %s", filePath);
+    munmap(map, *mapSize);
+    close(fd);
+    return NULL;
+  }
+
+  close(fd);
+  return map;
+}
+
+/*
+ * Split one line, [line, eol), into its property and value in place and
+ * apply them. Spaces and tabs inside the property name and quotes in the
+ * value are dropped by moving the rest of the text down.
+ */
+static void parseLine(char *line, char *eol, ConfigApply_f apply, void *data) {
+
+  //strip trailing white space
+  while (eol > line && (eol[-1] == '\r' || eol[-1] == '\t' || eol[-1] == '\0'))
+    eol--;
+
+  //strip leading white space
+  while (line < eol && (*line == ' ' || *line == '\t'))
+    line++;
+
+  //skip empty lines and comments
+  if (line == eol || *line == PLUGIN_CONF_COMMENT)
+    return;
+
+  char *property = line, *out = line;
+  for (; line < eol && *line != PLUGIN_CONF_ASSIGN; line++) {
+    //skip any spaces or tabs within the property name
+    if (*line != ' ' && *line != '\t')
+      *out++ = *line;
+  }
+
+  //make sure we aren't at the end of the line
+  if (line == eol)
+    return;
+
+  //out is at most at the '=', which is now free
+  size_t propertyLen = (size_t) (out - property);
+  *out = '\0';
+
+  //skip the equal sign and any spaces immediately after it
+  line++;
+  while (line < eol && (*line == ' ' || *line == '\t'))
+    line++;
+
+  char *value = line;
+  out = line;
+  for (; line < eol; line++) {
+    //ignore optional quotes
+    if (*line != '\"')
+      *out++ = *line;
+  }
+
+  //out is at most at the end of the line, a newline or the zero past the file
+  *out = '\0';
+
+  //set plugin property
+  if (apply)
+    apply(data, property, propertyLen, value, (size_t) (out - value));
+}
+
+/*
+Read plugin config file
+
+Config file follows the layout of:
+  propertyName=valueToAssign
+
+with lines having '#' as the first character being ignored as comments.
+
+ Inputs: Filepath, function pointer for applyConfig, pointer to data for the config
+ pass in void *data into apply if apply exists
+
+ The property and value passed to apply point into the mapped file and are
+ only valid during the call. Both are '\0' terminated, their lengths are
+ passed along so apply doesn't need to measure them.
+ */
+
+int ConfigReader_readConfig(char *filePath, ConfigApply_f apply, void *data) {
+
+  if (!data) {
+    SYSLOG(LOG_ERR, "Config Reader: No data intiailized...");
+    return -1;
+  }
+  if (!filePath) {
+    SYSLOG(LOG_ERR, "Config Reader: No filepath initalized...");
+    return -1;
+  }
+
+  size_t size = 0, mapSize = 0;
+  char *map = mapConfig(filePath, &size, &mapSize);
+  if (!map)
+    return -1;
+
+  char *pos = map, *end = map + size;
+  while (pos < end) {
+    char *eol = memchr(pos, '\n', (size_t) (end - pos));
+    if (!eol)
+      eol = end;
+
+    parseLine(pos, eol, apply, data);
+    pos = eol + 1;
+  }
+
+  munmap(map, mapSize);
+  return 0;
+}
+
+
+/*
+ * Insert new values for settings into an existing config file, or append
+ * settings that don't exist yet to the end of it. An empty value removes
+ * its setting. The file is rewritten into outputFile in one pass, synced,
+ * then renamed over origFile, so origFile is always complete on disk.
+ */
+int ConfigReader_writeSettings(char *outputFile, char *origFile, char **settings, char **newVals, size_t count) {
+
+  if (!origFile || !outputFile) {
+    SYSLOG(LOG_ERR, "Config Reader: No filepath initalized...");
+    return -1;
+  }
+
+  //open config file for reading
+  FILE *confStream = fopen(origFile, "r");
+  if (!confStream) {
+    SYSLOG(LOG_ERR, "Config Reader: Config file is missing %s", origFile);
+    return -1;
+  }
+
+  FILE *saveStream = fopen(outputFile, "w");
+  if (!saveStream) {
+    SYSLOG(LOG_ERR, "ConfigReader: Output config file missing %s", outputFile);
+    fclose(confStream);
+    return -1;
+  }
+
+  size_t lineCount = 0;
+  char lineBuf[PLUGIN_CONF_PROPERTY_LEN + PATH_MAX];
+  char property[PLUGIN_CONF_PROPERTY_LEN], value[PATH_MAX];
+
+  //each setting only replaces the first line defining it
+  char foundProperty[count ? count : 1];
+  memset(foundProperty, 0, sizeof(foundProperty));
+
+  //read input stream
+  //write to output stream
+  while (!feof(confStream)) {
+    lineCount++;
+
+    //read next line in the config file
+    memset(lineBuf, 0, sizeof(lineBuf));
+    char *line = fgets(lineBuf, sizeof(lineBuf), confStream);
+    if (!line) break;
+
+
+    //strip trailing white space
+    line = trimTrailingWhiteSpace(line);
+
+    //line is empty, skip it
+    if (strlen(lineBuf) < 1) {
+      //preserve whitespace in the output file
+      fprintf(saveStream, "\n");
+      continue;
+    }
+
+    //strip leading white space
+    line = skipLeadingWhiteSpace(line);
+    memmove(lineBuf, line, strlen(line));
+    line = lineBuf;
+
+    //skip line if commented out
+    if (*line == PLUGIN_CONF_COMMENT) {
+      //preserve comments in the output stream
+      fprintf(saveStream, "%s\n", line);
+      continue;
+    }
+
+    //otherwise grab the setting
+    line = getProperty(line, property);
+
+    //write out the <property> = part
+    //check if we have found a value we wish to change
+    size_t i = 0;
+    for (i = 0; i < count; i++) {
+      if (!foundProperty[i] && !strcmp(property, settings[i]))
+        break;
+    }
+
+    if (i < count) {
+      foundProperty[i] = 1;
+
+      //remove blank settings in the config file
+      if (strlen(newVals[i]) < 1)
+        continue;
+
+      fprintf(saveStream, "%s=", property);
+      fprintf(saveStream, "%s\n", newVals[i]);
+      continue;
+    }
+
+    //otherwise, write out the old value, since we are leaving it unchanged
+    //make sure we aren't at the end of the line
+    if (*line == '\0') continue;
+
+    fprintf(saveStream, "%s=", property);
+
+    //skip equal sign
+    line++;
+
+    //grab value now
+    line = getValue(line, value);
+    fprintf(saveStream, "%s\n", value);
+  }
+
+  //settings not found in the config file are likely new
+  //so they can be appended to the end of the file
+  size_t i = 0;
+  for (i = 0; i < count; i++) {
+    if (!foundProperty[i] && strlen(newVals[i]) > 0)
+      fprintf(saveStream, "%s=%s\n", settings[i], newVals[i]);
+  }
+
+  //close config file
+  fclose(confStream);
+
+  //the new file has to be complete on disk before it replaces the old one
+  int status = fflush(saveStream) || ferror(saveStream) || fsync(fileno(saveStream));
+  if (fclose(saveStream) || status) {
+    SYSLOG(LOG_ERR, "ConfigReader: Error writing %s", outputFile);
+    unlink(outputFile);
+    return -1;
+  }
+
+  //rename second file over the original file
+  if (rename(outputFile, origFile)) {
+    SYSLOG(LOG_ERR, "ConfigReader: Error replacing %s", origFile);
+    unlink(outputFile);
+    return -1;
+  }
+
+  return 0;
+}
+
+//insert a new value for a setting into an existing config file
+//or append a new setting that does not exist to the file
+int ConfigReader_writeConfig(char *outputFile, char *origFile, char *setting, char *newVal) {
+
+  return ConfigReader_writeSettings(outputFile, origFile, &setting, &newVal, 1);
+}
+
+
+/*
+ * Escape the spaces in a path into buf, which holds bufSize characters.
+ * Returns -1 if the escaped path doesn't fit.
+ */
+int ConfigReader_escapePathTo(char *str, char *buf, size_t bufSize) {
+
+  if (!str || !bufSize) {
+    SYSLOG(LOG_ERR, "ConfigReader_escapePathTo: null string passed in");
+    return -1;
+  }
+
+  SYSLOG(LOG_INFO, "ConfigReader_escapePathTo: path to escape: %s", str);
+  char *dest = buf, *end = buf + bufSize - 1;
+  while (*str != '\0' && *str != '\n') {
+    if (*str == ' ') {
+      if (dest == end)
+        return -1;
+      *dest++ = '\\';
+    }
+
+    if (dest == end)
+      return -1;
+    *dest++ = *str++;
+  }
+  *dest = '\0';
+
+  SYSLOG(LOG_INFO, "ConfigReader_escapePathTo: new escaped string: %s", buf);
+  return 0;
+}
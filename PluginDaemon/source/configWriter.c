@@ -0,0 +1,376 @@
+/*=======================================================
+configWriter.c
+
+Pending changes are kept per file until the writer thread
+picks them up. Writing is serialized by _writeLock, which
+is taken before the changes are detached from the pending
+list, so files are always written in the order their
+changes were made.
+
+Every file written is remembered along with its stat
+afterwards until ConfigWriter_TakeWritten collects it; the
+record is made under the same lock as the rename, so once
+an event for the new file can be seen, so can the record.
+=======================================================*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "configWriter.h"
+#include "configReader.h"
+#include "misc.h"
+
+
+typedef struct PendingFile_s {
+    char *path, *tmpPath;
+    size_t count, size;
+    char **settings, **values;
+} PendingFile_t;
+
+typedef struct WrittenFile_s {
+    char *path;
+    struct stat st;
+} WrittenFile_t;
+
+
+//guards the pending list
+static pthread_mutex_t _lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t _wake;
+//serializes writes, guards the written list
+static pthread_mutex_t _writeLock = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_t _thread;
+static int _running = 0, _stop = 0;
+//when the oldest pending change was made
+static struct timespec _firstPending;
+
+static PendingFile_t *_pending = NULL;
+static size_t _pendingCount = 0, _pendingSize = 0;
+
+static WrittenFile_t *_written = NULL;
+static size_t _writtenCount = 0, _writtenSize = 0;
+
+
+static void freePending(PendingFile_t *file) {
+
+  size_t i = 0;
+  for (i = 0; i < file->count; i++) {
+    free(file->settings[i]);
+    free(file->values[i]);
+  }
+
+  free(file->settings);
+  free(file->values);
+  free(file->path);
+  free(file->tmpPath);
+}
+
+static PendingFile_t *findPending(const char *path) {
+
+  size_t i = 0;
+  for (i = 0; i < _pendingCount; i++) {
+    if (!strcmp(_pending[i].path, path))
+      return &_pending[i];
+  }
+
+  return NULL;
+}
+
+static PendingFile_t *addPending(char *path, char *tmpPath) {
+
+  if (_pendingCount == _pendingSize) {
+    size_t newSize = _pendingSize ? _pendingSize * 2 : 4;
+    PendingFile_t *pending = realloc(_pending, newSize * sizeof(PendingFile_t));
+    if (!pending)
+      return NULL;
+
+    _pending = pending;
+    _pendingSize = newSize;
+  }
+
+  PendingFile_t *file = &_pending[_pendingCount];
+  memset(file, 0, sizeof(PendingFile_t));
+  file->path = strdup(path);
+  file->tmpPath = strdup(tmpPath);
+  if (!file->path || !file->tmpPath) {
+    freePending(file);
+    return NULL;
+  }
+
+  _pendingCount++;
+  return file;
+}
+
+//a setting changed again before being written only keeps its latest value
+static int setPending(PendingFile_t *file, char *setting, char *value) {
+
+  char *newValue = strdup(value);
+  if (!newValue)
+    return -1;
+
+  size_t i = 0;
+  for (i = 0; i < file->count; i++) {
+    if (!strcmp(file->settings[i], setting)) {
+      free(file->values[i]);
+      file->values[i] = newValue;
+      return 0;
+    }
+  }
+
+  if (file->count == file->size) {
+    size_t newSize = file->size ? file->size * 2 : 4;
+    char **settings = realloc(file->settings, newSize * sizeof(char *));
+    if (settings)
+      file->settings = settings;
+
+    char **values = settings ? realloc(file->values, newSize * sizeof(char *)) : NULL;
+    if (!values) {
+      free(newValue);
+      return -1;
+    }
+
+    file->values = values;
+    file->size = newSize;
+  }
+
+  file->settings[file->count] = strdup(setting);
+  if (!file->settings[file->count]) {
+    free(newValue);
+    return -1;
+  }
+
+  file->values[file->count++] = newValue;
+  return 0;
+}
+
+//with _writeLock held
+static void noteWritten(const char *path) {
+
+  struct stat st;
+  if (stat(path, &st))
+    return;
+
+  size_t i = 0;
+  for (i = 0; i < _writtenCount; i++) {
+    if (!strcmp(_written[i].path, path)) {
+      _written[i].st = st;
+      return;
+    }
+  }
+
+  if (_writtenCount == _writtenSize) {
+    size_t newSize = _writtenSize ? _writtenSize * 2 : 4;
+    WrittenFile_t *written = realloc(_written, newSize * sizeof(WrittenFile_t));
+    if (!written)
+      return;
+
+    _written = written;
+    _writtenSize = newSize;
+  }
+
+  _written[_writtenCount].path = strdup(path);
+  if (!_written[_writtenCount].path)
+    return;
+
+  _written[_writtenCount++].st = st;
+}
+
+/*
+ * Write the pending changes for origFile, or for every file if NULL.
+ */
+static int flushPending(const char *origFile) {
+
+  pthread_mutex_lock(&_writeLock);
+  pthread_mutex_lock(&_lock);
+
+  PendingFile_t *files = NULL, single;
+  size_t count = 0;
+  if (!origFile) {
+    files = _pending;
+    count = _pendingCount;
+    _pending = NULL;
+    _pendingCount = _pendingSize = 0;
+  }
+  else {
+    PendingFile_t *file = findPending(origFile);
+    if (file) {
+      single = *file;
+      *file = _pending[--_pendingCount];
+      files = &single;
+      count = 1;
+    }
+  }
+
+  pthread_mutex_unlock(&_lock);
+
+  int status = 0;
+  size_t i = 0;
+  for (i = 0; i < count; i++) {
+    PendingFile_t *file = &files[i];
+    SYSLOG(LOG_INFO, "ConfigWriter: writing %zu settings to %s", file->count, file->path);
+
+    if (ConfigReader_writeSettings(file->tmpPath, file->path, file->settings, file->values, file->count))
+      status = -1;
+    else
+      noteWritten(file->path);
+
+    freePending(file);
+  }
+
+  pthread_mutex_unlock(&_writeLock);
+
+  if (files != &single)
+    free(files);
+
+  return status;
+}
+
+static void *writerThread(void *arg) {
+
+  pthread_mutex_lock(&_lock);
+  while (!_stop) {
+    if (!_pendingCount) {
+      pthread_cond_wait(&_wake, &_lock);
+      continue;
+    }
+
+    //give further changes a chance to join the same write
+    struct timespec due = _firstPending;
+    due.tv_sec += CONFIG_WRITER_DELAY_MS / 1000;
+    due.tv_nsec += (CONFIG_WRITER_DELAY_MS % 1000) * 1000000L;
+    if (due.tv_nsec >= 1000000000L) {
+      due.tv_sec++;
+      due.tv_nsec -= 1000000000L;
+    }
+
+    if (pthread_cond_timedwait(&_wake, &_lock, &due) != ETIMEDOUT)
+      continue;
+
+    pthread_mutex_unlock(&_lock);
+    flushPending(NULL);
+    pthread_mutex_lock(&_lock);
+  }
+  pthread_mutex_unlock(&_lock);
+
+  return NULL;
+}
+
+
+/*
+ * Start the writer thread. Until it is started, or if it can't be,
+ * changes are written as they are made.
+ */
+int ConfigWriter_Init(void) {
+
+  if (_running)
+    return 0;
+
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&_wake, &attr);
+  pthread_condattr_destroy(&attr);
+
+  _stop = 0;
+  if (pthread_create(&_thread, NULL, writerThread, NULL)) {
+    SYSLOG(LOG_ERR, "ConfigWriter: Error starting writer thread, writing changes immediately");
+    pthread_cond_destroy(&_wake);
+    return -1;
+  }
+
+  _running = 1;
+  return 0;
+}
+
+/*
+ * Queue a new value for a setting in origFile, an empty value removes it.
+ * outputFile is the temporary the new version is written to.
+ */
+int ConfigWriter_Set(char *outputFile, char *origFile, char *setting, char *value) {
+
+  if (!outputFile || !origFile || !setting || !value)
+    return -1;
+
+  pthread_mutex_lock(&_lock);
+
+  int wasIdle = !_pendingCount;
+  PendingFile_t *file = findPending(origFile);
+  if (!file)
+    file = addPending(origFile, outputFile);
+
+  int status = file ? setPending(file, setting, value) : -1;
+  if (status)
+    SYSLOG(LOG_ERR, "ConfigWriter: Error queueing %s for %s", setting, origFile);
+  else if (_running) {
+    //the delay counts from the oldest change still waiting
+    if (wasIdle)
+      clock_gettime(CLOCK_MONOTONIC, &_firstPending);
+    pthread_cond_signal(&_wake);
+  }
+
+  int running = _running;
+  pthread_mutex_unlock(&_lock);
+
+  if (!status && !running)
+    return flushPending(origFile);
+
+  return status;
+}
+
+/*
+ * Write any changes waiting for origFile now, or for every file if NULL.
+ * Also waits out a write of the file already in progress, so the file
+ * can be read back up to date afterwards.
+ */
+int ConfigWriter_Flush(char *origFile) {
+
+  return flushPending(origFile);
+}
+
+/*
+ * Hand every file written since the last call to written, along with
+ * its stat right after the write.
+ */
+void ConfigWriter_TakeWritten(ConfigWritten_f written, void *data) {
+
+  pthread_mutex_lock(&_writeLock);
+
+  size_t i = 0;
+  for (i = 0; i < _writtenCount; i++) {
+    if (written)
+      written(_written[i].path, &_written[i].st, data);
+    free(_written[i].path);
+  }
+  _writtenCount = 0;
+
+  pthread_mutex_unlock(&_writeLock);
+}
+
+/*
+ * Stop the writer thread, writing out everything still pending.
+ */
+void ConfigWriter_Cleanup(void) {
+
+  if (_running) {
+    pthread_mutex_lock(&_lock);
+    _stop = 1;
+    pthread_cond_signal(&_wake);
+    pthread_mutex_unlock(&_lock);
+
+    pthread_join(_thread, NULL);
+    pthread_cond_destroy(&_wake);
+    _running = 0;
+  }
+
+  flushPending(NULL);
+  ConfigWriter_TakeWritten(NULL, NULL);
+
+  free(_written);
+  _written = NULL;
+  _writtenSize = 0;
+}
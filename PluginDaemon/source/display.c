@@ -5,6 +5,8 @@
 ====================================================================*/
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
@@ -17,13 +19,20 @@
 #include "plugin.h"
 #include "pluginSocket.h"
 #include "display.h"
+#include "pluginMux.h"
 #include "socketResponse.h"
 
 #define SIZE_CMD "{\"cmd\":\"getsize\"}"
+//pushed by the display on connect and whenever it is resized
+#define SIZE_MSG "size:"
 #define RELOAD_CMD "{\"cmd\":\"reload\",\"data\":%d}"
 
 #define READABLE
 
+//first line of index.html, hash of the rest of the page
+#define INDEX_HASH_FMT "<!-- index %016" PRIx64 " -->\n"
+#define INDEX_HASH_LEN (sizeof("<!-- index  -->\n") - 1 + 16)
+
 
 #define INCLUDE_JS_START "<script src=\""
 #define INCLUDE_JS_END "\"></script>"
@@ -43,7 +52,7 @@
   "var %sCom = new PluginClient(\"%s\", \"%s\");"
 
 #define INIT_FRONTEND_PROTO \
-  "var displayStuff = new Display(\"%s\", \"%s\");"
+  "var displayStuff = new Display(\"%s\", \"%s\", \"%s\");"
 
 
 #define PLUGIN_CLIENT_JS "plugin-client.js"
@@ -55,17 +64,25 @@
  * load and remove plugins
  */
 
+//last complete reply from the display, for pending api requests.
+//Messages are reassembled in each connection's session data first.
 static SocketResponse_t displayResponse;
 
 static int _displayConnected = 0;
 static int _loadedPlugins = 0;
 
+//last size pushed by the display, 0x0 until it reports one
+static int _displayWidth = 0, _displayHeight = 0;
+//bumped whenever the pushed size changes
+static unsigned int _displaySizeSerial = 0;
+
 static struct lws *displaySocketInstance = NULL;
 
 static int _displayCallback(struct lws *wsi, enum lws_callback_reasons reason, void *user, void *in, size_t len);
 
 struct lws_protocols mirrorStart = {
-        .name=PLUGIN_SERVER_PROTOCOL, .callback=_displayCallback
+        .name=PLUGIN_SERVER_PROTOCOL, .callback=_displayCallback,
+        .per_session_data_size=sizeof(SocketResponse_t)
 };
 
 const char *indexHeader =
@@ -77,6 +94,14 @@ const char *indexFooter =
         "</body>"
                 "</html>";
 
+//index.html is built in memory, then written out in one go
+typedef struct IndexBuffer_s {
+    char *data;
+    size_t len, size;
+    //set once an append fails, the page is then left alone
+    int error;
+} IndexBuffer_t;
+
 
 static char *includeJSString(char *path, char *file) {
 
@@ -99,24 +124,47 @@ static char *includeJSString(char *path, char *file) {
 }
 
 
-static int doWrite(int fd, const char *buf, size_t len) {
+static int doWrite(IndexBuffer_t *index, const char *buf, size_t len) {
+
+  size_t needed = index->len + len + strlen("\n");
+  if (needed > index->size) {
+    size_t size = index->size ? index->size : 4096;
+    while (size < needed)
+      size *= 2;
 
-  write(fd, buf, len);
+    char *temp = realloc(index->data, size);
+    if (!temp) {
+      SYSLOG(LOG_ERR, "doWrite: Error growing index to %zu bytes", size);
+      index->error = 1;
+      return -1;
+    }
+    index->data = temp;
+    index->size = size;
+  }
+
+  memcpy(index->data + index->len, buf, len);
+  index->len += len;
 #ifdef READABLE
-  write(fd, "\n", strlen("\n"));
+  index->data[index->len++] = '\n';
 #endif
 
   return 0;
 }
 
-static int loadJSLib(char *filepath, struct dirent *dirInfo, void *data) {
+//d_type saves a stat per file, where the filesystem fills it in
+static int isDirectory(char *filepath, struct dirent *dirInfo) {
 
+  if (dirInfo && dirInfo->d_type != DT_UNKNOWN)
+    return dirInfo->d_type == DT_DIR;
 
   struct stat st;
-  lstat(filepath, &st);
+  return !lstat(filepath, &st) && S_ISDIR(st.st_mode);
+}
+
+static int loadJSLib(char *filepath, struct dirent *dirInfo, void *data) {
 
   //ignore directories
-  if (S_ISDIR(st.st_mode)) return 0;
+  if (isDirectory(filepath, dirInfo)) return 0;
 
   //check file extension to make sure we are loading javascript files
   char *dot = strrchr(filepath, '.');
@@ -130,7 +178,7 @@ static int loadJSLib(char *filepath, struct dirent *dirInfo, void *data) {
   if (strncmp(dot, "js", strlen(dot)))
     return 0;
 
-  int fd = *(int *) data;
+  IndexBuffer_t *index = (IndexBuffer_t *) data;
 
   size_t len = strlen(INCLUDE_JS_START) + strlen(INCLUDE_JS_END) +
                strlen(filepath) + 1;
@@ -138,19 +186,13 @@ static int loadJSLib(char *filepath, struct dirent *dirInfo, void *data) {
   memset(buf, 0, sizeof(buf));
 
   snprintf(buf, len, INCLUDE_JS_START"%s"INCLUDE_JS_END, filepath);
-  doWrite(fd, buf, strlen(buf));
-
-  return 0;
+  return doWrite(index, buf, strlen(buf));
 }
 
 static int loadCSSLib(char *filepath, struct dirent *dirInfo, void *data) {
 
-
-  struct stat st;
-  lstat(filepath, &st);
-
   //ignore directories
-  if (S_ISDIR(st.st_mode)) return 0;
+  if (isDirectory(filepath, dirInfo)) return 0;
 
   //check file extension to make sure we are loading javascript files
   char *dot = strrchr(filepath, '.');
@@ -164,7 +206,7 @@ static int loadCSSLib(char *filepath, struct dirent *dirInfo, void *data) {
   if (strncmp(dot, "css", strlen(dot)))
     return 0;
 
-  int fd = *(int *) data;
+  IndexBuffer_t *index = (IndexBuffer_t *) data;
 
   size_t len = strlen(INCLUDE_CSS_START) + strlen(INCLUDE_CSS_END) +
                strlen(filepath) + 1;
@@ -172,14 +214,41 @@ static int loadCSSLib(char *filepath, struct dirent *dirInfo, void *data) {
   memset(buf, 0, sizeof(buf));
 
   snprintf(buf, len, INCLUDE_CSS_START"%s"INCLUDE_CSS_END, filepath);
-  doWrite(fd, buf, strlen(buf));
+  return doWrite(index, buf, strlen(buf));
+}
 
-  return 0;
+/*
+ * Remember the size pushed by the display, formatted as 'size:widthxheight'.
+ */
+static void cacheDisplaySize(char *msg) {
+
+  int width = 0, height = 0;
+  if (sscanf(msg + strlen(SIZE_MSG), "%dx%d", &width, &height) != 2 || width <= 0 || height <= 0) {
+    SYSLOG(LOG_ERR, "cacheDisplaySize: Invalid size message %s", msg);
+    return;
+  }
+
+  if (width == _displayWidth && height == _displayHeight)
+    return;
+
+  _displayWidth = width;
+  _displayHeight = height;
+  _displaySizeSerial++;
+  //0 is kept for 'no size known'
+  if (!_displaySizeSerial) _displaySizeSerial++;
+  SYSLOG(LOG_INFO, "Display size: %dx%d", width, height);
+}
+
+static void clearDisplaySize(void) {
+
+  _displayWidth = 0;
+  _displayHeight = 0;
 }
 
 void Display_Cleanup(void) {
 
   Display_ClearDisplayResponse();
+  clearDisplaySize();
   _displayConnected = 0;
   displaySocketInstance = NULL;
 }
@@ -201,32 +270,56 @@ static int _displayCallback(struct lws *wsi, enum lws_callback_reasons reason, v
 
     case LWS_CALLBACK_ESTABLISHED:
 
+      PluginSocket_openWriteBuffers(wsi);
       //_displayConnected = 1;
       displaySocketInstance = wsi;
       lws_callback_on_writable(displaySocketInstance);
       break;
 
-    case LWS_CALLBACK_RECEIVE:
+    case LWS_CALLBACK_RECEIVE: {
+
+      if (!user)
+        return 0;
 
-      SocketResponse_build(&displayResponse, wsi, (char *) in, len);
-      if (SocketResponse_done(&displayResponse)) {
-        char *socketResponse = SocketResponse_get(&displayResponse);
-        size_t socketSize = SocketResponse_size(&displayResponse);
+      SocketResponse_t *session = (SocketResponse_t *) user;
+      SocketResponse_build(session, wsi, (char *) in, len);
+      if (SocketResponse_done(session)) {
+        char *socketResponse = SocketResponse_get(session);
+        size_t socketSize = SocketResponse_size(session);
 
         if (!strncmp(socketResponse, "ready", socketSize)) {
           _displayConnected = 1;
           SYSLOG(LOG_INFO, "_displayCallback: Successfully connected to browser.");
+          SocketResponse_free(session);
           return 0;
-        } else {
+        } else if (!strncmp(socketResponse, "unloaded", socketSize) ||
+                   !strncmp(socketResponse, "loaded", socketSize)) {
           _loadedPlugins -= (!strncmp(socketResponse, "unloaded", socketSize));
           _loadedPlugins += (!strncmp(socketResponse, "loaded", socketSize));
           SYSLOG(LOG_INFO, "Display Callback: Number of plugins loaded: %d", _loadedPlugins);
+          SocketResponse_free(session);
+        } else if (!strncmp(socketResponse, SIZE_MSG, strlen(SIZE_MSG))) {
+          cacheDisplaySize(socketResponse);
+          SocketResponse_free(session);
+        } else {
+          //any other reply is an answer to a display query
+          SocketResponse_take(&displayResponse, session);
         }
       }
+    }
       break;
 
     case LWS_CALLBACK_CLOSED:
+      if (user)
+        SocketResponse_free((SocketResponse_t *) user);
+      PluginSocket_closeWriteBuffers(wsi);
+
+      //only the tracked display connection going away disconnects the display
+      if (wsi != displaySocketInstance)
+        break;
+
       Display_ClearDisplayResponse();
+      clearDisplaySize();
       PluginSocket_clearWriteBuffers(displaySocketInstance, 0);
       displaySocketInstance = NULL;
       _displayConnected = 0;
@@ -285,7 +378,11 @@ int Display_LoadPlugin(Plugin_t *plugin) {
   SYSLOG(LOG_INFO, "Display_LoadPlugin: Sending plugin %s to browser.", name);
   //the protocol for a given plugin between the daemon and the browser is just the plugins name
   char data[1024];
-  snprintf(data, 1024, "\"pDiv\":\"%s\"", name);
+  //a channel tells the display to route the plugin over the shared mux connection
+  if (PluginMux_IsEnabled())
+    snprintf(data, 1024, "\"pDiv\":\"%s\",\"ch\":%u", name, plugin->channel);
+  else
+    snprintf(data, 1024, "\"pDiv\":\"%s\"", name);
 
   if (Display_BootstrapSocket("load", protocol, data) < 0) {
     SYSLOG(LOG_ERR, "Display_LoadPlugin: Error sending plugin to browser: %s", name);
@@ -326,6 +423,21 @@ int Display_GetDisplaySize(void) {
   return 0;
 }
 
+/*
+ * Get the size last pushed by the connected display.
+ * Returns a serial number that changes along with the size,
+ * or 0 if no size is known.
+ */
+unsigned int Display_GetCachedSize(int *width, int *height) {
+
+  if (!Display_IsDisplayConnected() || !_displayWidth || !_displayHeight)
+    return 0;
+
+  if (width) *width = _displayWidth;
+  if (height) *height = _displayHeight;
+  return _displaySizeSerial;
+}
+
 int Display_Reload(int waitSeconds) {
 
   if (!Display_IsDisplayConnected()) {
@@ -340,73 +452,112 @@ int Display_Reload(int waitSeconds) {
   return 0;
 }
 
+/*
+ * Returns true if the index at path starts with the given hash line.
+ */
+static int indexMatches(const char *path, const char *hashLine) {
+
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return 0;
+
+  char existing[INDEX_HASH_LEN];
+  ssize_t got = read(fd, existing, INDEX_HASH_LEN);
+  close(fd);
+
+  return got == (ssize_t) INDEX_HASH_LEN && !memcmp(existing, hashLine, INDEX_HASH_LEN);
+}
+
+/*
+ * Build index.html, which includes the global css, the communication
+ * scripts and any extra js libraries. The first line holds a hash of the
+ * rest of the page; while the port, folders and their files stay the
+ * same the page does too, and the file is left untouched. Its modification
+ * time then doesn't change across reboots, so the display can keep
+ * its cached copy.
+ */
 int Display_Generate(int portNum, const char *comFolder, const char *cssFolder, const char *jsLibsFolder,
                      const char *output) {
-  //delete old index
-  unlink(output);
 
   PluginSocket_AddProtocol(&mirrorStart);
 
-  //open html file to write to
-  int fd = open(output, O_RDWR | O_CREAT, S_IRUSR | S_IRGRP | S_IROTH);
-  if (fd < 0) {
-    SYSLOG(LOG_ERR, "Display_Generate: Error opening file: %s", output);
-    return -1;
-  }
-
-  //write html header
-  doWrite(fd, indexHeader, strlen(indexHeader));
+  int status = -1;
+  IndexBuffer_t index = {};
+  //room for the hash line, filled in once the page is built
+  index.len = INDEX_HASH_LEN;
+  doWrite(&index, indexHeader, strlen(indexHeader));
 
   //include all global css files
-  DirectoryAction((char *) cssFolder, loadCSSLib, &fd);
+  DirectoryAction((char *) cssFolder, loadCSSLib, &index);
 
   //include the required plugin-client files
   char *comsJs = includeJSString((char *) comFolder, PLUGIN_CLIENT_JS);
   if (comsJs) {
-    doWrite(fd, comsJs, strlen(comsJs));
+    doWrite(&index, comsJs, strlen(comsJs));
     free(comsJs);
   }
 
 
   char *displayJs = includeJSString((char *) comFolder, DISPLAY_JS);
   if (displayJs) {
-    doWrite(fd, displayJs, strlen(displayJs));
+    doWrite(&index, displayJs, strlen(displayJs));
     free(displayJs);
   }
 
 
   //include any extra javascript libraries
-  DirectoryAction((char *) jsLibsFolder, loadJSLib, &fd);
+  DirectoryAction((char *) jsLibsFolder, loadJSLib, &index);
 
   //write communications initialization
-  doWrite(fd, WINDOW_ONLOAD_START, strlen(WINDOW_ONLOAD_START));
+  doWrite(&index, WINDOW_ONLOAD_START, strlen(WINDOW_ONLOAD_START));
   //doWrite(fd, INIT_FRONTEND_PROTO(), strlen(INIT_FRONTEND_PROTO()));
 
   char portStr[32];
   snprintf(portStr, sizeof(portStr) - 1, "%d", portNum);
 
+  char *muxProtocol = PluginMux_GetProtocolName();
   size_t dispBufLen = strlen(INIT_FRONTEND_PROTO) + strlen(PLUGIN_SERVER_PROTOCOL) +
-                      strlen(portStr) + 1;
+                      strlen(portStr) + strlen(muxProtocol) + 1;
 
   char *dispBuf = calloc(dispBufLen, sizeof(char));
   if (!dispBuf) {
     SYSLOG(LOG_ERR, "Display_Generate: Error generating frontend protocol string.");
-    close(fd);
-    return -1;
+    goto _cleanup;
   }
-  snprintf(dispBuf, dispBufLen - 1, INIT_FRONTEND_PROTO, PLUGIN_SERVER_PROTOCOL, portStr);
-  doWrite(fd, dispBuf, strlen(dispBuf));
+  snprintf(dispBuf, dispBufLen - 1, INIT_FRONTEND_PROTO, PLUGIN_SERVER_PROTOCOL, portStr, muxProtocol);
+  doWrite(&index, dispBuf, strlen(dispBuf));
   free(dispBuf);
 
 
-  doWrite(fd, WINDOW_ONLOAD_END, strlen(WINDOW_ONLOAD_END));
+  doWrite(&index, WINDOW_ONLOAD_END, strlen(WINDOW_ONLOAD_END));
 
   //write out html footer
-  doWrite(fd, indexFooter, strlen(indexFooter));
+  doWrite(&index, indexFooter, strlen(indexFooter));
+  if (index.error)
+    goto _cleanup;
 
-  //close html file
-  close(fd);
-  return 0;
+  //hash everything after the hash line itself
+  uint64_t hash = HashBytes(index.data + INDEX_HASH_LEN, index.len - INDEX_HASH_LEN);
+
+  char hashLine[INDEX_HASH_LEN + 1];
+  snprintf(hashLine, sizeof(hashLine), INDEX_HASH_FMT, hash);
+  memcpy(index.data, hashLine, INDEX_HASH_LEN);
+
+  if (indexMatches(output, hashLine)) {
+    SYSLOG(LOG_INFO, "Display_Generate: %s is up to date", output);
+    status = 0;
+    goto _cleanup;
+  }
+
+  //replaced whole, so the display never loads a half written page;
+  //the index is created read only
+  status = WriteFileAtomic(output, index.data, index.len, S_IRUSR | S_IRGRP | S_IROTH);
+  if (status)
+    SYSLOG(LOG_ERR, "Display_Generate: Error writing file: %s", output);
+
+  _cleanup:
+  free(index.data);
+  return status;
 }
 
 /*
@@ -0,0 +1,206 @@
+/*=======================================================
+hashIndex.c
+
+Open addressing (linear probing) index from strings to
+borrowed pointers. Capacity is always a power of two and
+the table doubles once it is three quarters full. Removal
+shifts the following run of entries back, so no tombstones
+are ever left behind to lengthen later probes.
+=======================================================*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include "hashIndex.h"
+#include "misc.h"
+
+#define HASHINDEX_MIN_SIZE 8
+
+//grow once count reaches 3/4 of the table
+#define HASHINDEX_FULL(count, size) ((count) * 4 >= (size) * 3)
+
+
+static size_t roundSize(size_t size) {
+
+  size_t rounded = HASHINDEX_MIN_SIZE;
+  while (rounded < size)
+    rounded <<= 1;
+
+  return rounded;
+}
+
+//find the slot holding key, or the empty slot that ends its probe run
+static HashIndexEntry_t *findSlot(const HashIndex_t *index, const char *key, size_t hash) {
+
+  size_t mask = index->size - 1;
+  size_t pos = hash & mask;
+
+  while (index->entries[pos].key) {
+    HashIndexEntry_t *entry = &index->entries[pos];
+    if (entry->hash == hash && !strcmp(entry->key, key))
+      return entry;
+
+    pos = (pos + 1) & mask;
+  }
+
+  return &index->entries[pos];
+}
+
+static int resize(HashIndex_t *index, size_t newSize) {
+
+  HashIndexEntry_t *newEntries = calloc(newSize, sizeof(HashIndexEntry_t));
+  if (!newEntries) {
+    SYSLOG(LOG_ERR, "HashIndex_resize: Error allocating %zu entries", newSize);
+    return -1;
+  }
+
+  HashIndexEntry_t *oldEntries = index->entries;
+  size_t oldSize = index->size;
+
+  index->entries = newEntries;
+  index->size = newSize;
+
+  //key copies move over as is, only their slots change
+  size_t i = 0;
+  for (i = 0; i < oldSize; i++) {
+    if (!oldEntries[i].key)
+      continue;
+
+    HashIndexEntry_t *slot = findSlot(index, oldEntries[i].key, oldEntries[i].hash);
+    *slot = oldEntries[i];
+  }
+
+  free(oldEntries);
+  return 0;
+}
+
+
+HashIndex_t *HashIndex_init(size_t size) {
+
+  HashIndex_t *index = calloc(1, sizeof(HashIndex_t));
+  if (!index) {
+    SYSLOG(LOG_ERR, "HashIndex_init: Error allocating index");
+    return NULL;
+  }
+
+  //leave enough headroom that size entries fit without growing
+  index->size = roundSize(size + size / 3 + 1);
+  index->entries = calloc(index->size, sizeof(HashIndexEntry_t));
+  if (!index->entries) {
+    SYSLOG(LOG_ERR, "HashIndex_init: Error allocating index entries");
+    free(index);
+    return NULL;
+  }
+
+  return index;
+}
+
+void HashIndex_destroy(HashIndex_t *index) {
+
+  if (!index)
+    return;
+
+  if (index->entries) {
+    size_t i = 0;
+    for (i = 0; i < index->size; i++) {
+      if (index->entries[i].key)
+        free(index->entries[i].key);
+    }
+
+    free(index->entries);
+  }
+
+  memset(index, 0, sizeof(HashIndex_t));
+  free(index);
+}
+
+int HashIndex_add(HashIndex_t *index, const char *key, void *value) {
+
+  if (!index || !key)
+    return -1;
+
+  size_t hash = HashBytes(key, strlen(key));
+  HashIndexEntry_t *slot = findSlot(index, key, hash);
+
+  //key already indexed, just point it somewhere else
+  if (slot->key) {
+    slot->value = value;
+    return 0;
+  }
+
+  if (HASHINDEX_FULL(index->count + 1, index->size)) {
+    if (resize(index, index->size << 1))
+      return -1;
+
+    slot = findSlot(index, key, hash);
+  }
+
+  char *keyCopy = malloc(strlen(key) + 1);
+  if (!keyCopy) {
+    SYSLOG(LOG_ERR, "HashIndex_add: Error allocating key: %s", key);
+    return -1;
+  }
+  strcpy(keyCopy, key);
+
+  slot->key = keyCopy;
+  slot->hash = hash;
+  slot->value = value;
+  index->count++;
+  return 0;
+}
+
+void *HashIndex_find(const HashIndex_t *index, const char *key) {
+
+  if (!index || !key || !index->count)
+    return NULL;
+
+  HashIndexEntry_t *slot = findSlot(index, key, HashBytes(key, strlen(key)));
+  if (!slot->key)
+    return NULL;
+
+  return slot->value;
+}
+
+void *HashIndex_remove(HashIndex_t *index, const char *key) {
+
+  if (!index || !key || !index->count)
+    return NULL;
+
+  HashIndexEntry_t *slot = findSlot(index, key, HashBytes(key, strlen(key)));
+  if (!slot->key)
+    return NULL;
+
+  void *value = slot->value;
+  free(slot->key);
+
+  //backward shift: pull later members of the probe run into the hole
+  //as long as doing so doesn't move them in front of their home slot
+  size_t mask = index->size - 1;
+  size_t hole = (size_t) (slot - index->entries);
+  size_t pos = (hole + 1) & mask;
+
+  while (index->entries[pos].key) {
+    size_t home = index->entries[pos].hash & mask;
+
+    //distance from home to the current position vs home to the hole
+    if (((pos - home) & mask) >= ((pos - hole) & mask)) {
+      index->entries[hole] = index->entries[pos];
+      hole = pos;
+    }
+
+    pos = (pos + 1) & mask;
+  }
+
+  memset(&index->entries[hole], 0, sizeof(HashIndexEntry_t));
+  index->count--;
+  return value;
+}
+
+size_t HashIndex_getCount(const HashIndex_t *index) {
+
+  if (!index)
+    return 0;
+
+  return index->count;
+}
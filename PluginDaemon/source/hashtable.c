@@ -1,23 +1,47 @@
+/*=======================================================
+hashtable.c
+
+Open addressing table of owned key/value strings, using
+robin hood probing: an insert takes the slot of any entry
+that sits closer to its home slot than the new one would,
+which keeps probe runs short and lets a lookup stop as soon
+as it passes where its key would have been placed.
+
+Capacity is always a power of two and the table doubles
+once it is three quarters full, so an insert never fails
+for lack of room. Each entry caches its full hash, which
+makes growing a rehash-free move and skips most string
+compares. Removal shifts the following run back, leaving
+no tombstones behind.
+
+A table can draw its symbols from an arena instead of the
+heap; replaced and removed symbols then simply stay in the
+arena until it is released.
+=======================================================*/
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <math.h>
 #include <syslog.h>
 #include "hashtable.h"
 #include "misc.h"
 
-//number of probes to perform
-#define LOOKUP_ATTEMPTS 5
+#define HASHTABLE_MIN_SIZE 8
+
+//grow once count reaches 3/4 of the table
+#define HASHTABLE_FULL(count, size) ((count) * 4 >= (size) * 3)
+
+//how far an entry at pos sits from its home slot
+#define PROBE_DIST(entry, pos, mask) (((pos) - ((entry)->hash & (mask))) & (mask))
 
-//how large to grow the table each time it is
-//automatically resized. As a percentage of its
-//current size.
-#define GROWTH_RATE 0.21f
 
+static size_t roundSize(size_t size) {
 
-static size_t growSize(size_t oldSize) {
+  size_t rounded = HASHTABLE_MIN_SIZE;
+  while (rounded < size)
+    rounded <<= 1;
 
-  return oldSize + (size_t) floor(oldSize * GROWTH_RATE);
+  return rounded;
 }
 
 
@@ -37,10 +61,11 @@ HashData_t *HashData_create(char *key, char *data) {
     return NULL;
   }
   strcpy(entry->key, key);
+  entry->hash = HashBytes(key, strlen(key));
 
   //copy the value
   entry->value = calloc(1, strlen(data) + 1);
-  if (!entry->key) {
+  if (!entry->value) {
     SYSLOG(LOG_ERR, "HashData_create: Failed to allocate data for: %s: %s", key, data);
     free(entry->key);
     free(entry);
@@ -74,123 +99,126 @@ void HashData_print(FILE *output, HashData_t *entry) {
 }
 
 
-//djb2 algorithm
-//http://www.cse.yorku.ca/~oz/hash.html
-size_t hash1(char *key, size_t num, size_t last) {
-
-  size_t hashVal = 5381 + last;
-  int c;
+HashData_t **HashTable_getEntry(HashTable_t *table, char *key) {
 
-  while ((c = *key++) != '\0')
-    hashVal = ((hashVal << 5) + hashVal) ^ c; /* hash * 33 + c */
+  if (!table || !key || !table->count)
+    return NULL;
 
+  size_t hash = HashBytes(key, strlen(key));
+  size_t mask = table->size - 1;
+  size_t pos = hash & mask, dist = 0;
 
-  return hashVal % num;
-}
+  HashData_t *entry = NULL;
+  while ((entry = table->entries[pos])) {
+    if (entry->hash == hash && !strcmp(key, entry->key))
+      return &table->entries[pos];
 
-size_t hash2(char *key, size_t num, int attempt1) {
+    //key would have displaced this entry, so it isn't any further along
+    if (PROBE_DIST(entry, pos, mask) < dist)
+      break;
 
-  size_t hashVal = 0;
-  while (*key != '\0') {
-    hashVal = ((hashVal << 4) + *key) % num;
-    key++;
+    pos = (pos + 1) & mask;
+    dist++;
   }
 
-  return (attempt1 - hashVal) % num;
+  return NULL;
 }
 
+//insert an entry whose key isn't in the table yet, returns where it landed
+static HashData_t **placeEntry(HashTable_t *table, HashData_t *data) {
 
-HashData_t **HashTable_getEntry(HashTable_t *table, char *key) {
+  size_t mask = table->size - 1;
+  size_t pos = data->hash & mask, dist = 0;
+  HashData_t **placed = NULL;
 
-  if (!table || !key)
-    return NULL;
+  while (table->entries[pos]) {
+    HashData_t *entry = table->entries[pos];
+    size_t entryDist = PROBE_DIST(entry, pos, mask);
 
-  size_t pos = hash1(key, table->size, 0);
+    //take the slot from an entry closer to home, then carry it along instead
+    if (entryDist < dist) {
+      table->entries[pos] = data;
+      if (!placed)
+        placed = &table->entries[pos];
 
-  HashData_t **curPos = &table->entries[pos];
-  if (!curPos) {
-    SYSLOG(LOG_ERR, "HashTable_getEntry: No table entries allocated?");
-    //no table entries allocated?
-    return NULL;
-  }
-  //if first attempt and nothing exists, return the free position
-  if (!*curPos) {
-    return curPos;
-  }
-
-  //otherwise, check that we've got the right one
-  int attempt = 0;
-
-  do {
-    HashData_t *entry = *curPos;
-
-    if (!strcmp(key, entry->key))
-      return curPos;
+      data = entry;
+      dist = entryDist;
+    }
 
+    pos = (pos + 1) & mask;
+    dist++;
+  }
 
-    pos = hash1(key, table->size, pos + (attempt << 1));
-    curPos = &table->entries[pos];
-  } while (*curPos != NULL && attempt++ < LOOKUP_ATTEMPTS);
+  table->entries[pos] = data;
+  return placed ? placed : &table->entries[pos];
+}
 
-  if (attempt >= LOOKUP_ATTEMPTS)
-    return NULL;
+//only symbols that don't belong to an arena are freed on their own
+static void releaseEntry(HashTable_t *table, HashData_t *data) {
 
-  return curPos;
+  if (!table->arena)
+    HashData_destroy(data);
 }
 
+int HashTable_resize(HashTable_t *table, size_t size) {
 
-int HashTable_copy(HashTable_t *dest, HashTable_t *src) {
-
-  //make sure the dest table is at least as large as the source
-  if (dest->size < src->size)
+  size = roundSize(size);
+  if (size <= table->count)
     return -1;
 
-  //rehash all entries and copy them over
-  size_t e = 0;
-  for (e = 0; e < src->size; e++) {
-
-    //skip null entries
-    if (src->entries[e] == NULL)
-      continue;
+  HashData_t **newEntries = calloc(size, sizeof(HashData_t *));
+  if (!newEntries) {
+    SYSLOG(LOG_ERR, "HashTable_resize: Error allocating %zu entries", size);
+    return -1;
+  }
 
-    //have a valid entry
-    HashData_t **pos = HashTable_getEntry(dest, src->entries[e]->key);
-    if (!pos) {
-      return -1;
-    }
+  HashData_t **oldEntries = table->entries;
+  size_t oldSize = table->size;
 
-    if (*pos == NULL)
-      *pos = src->entries[e];
-    else {
-      return -1;
-    }
+  table->entries = newEntries;
+  table->size = size;
 
+  //hashes are cached, so entries only need new slots
+  size_t i = 0;
+  for (i = 0; i < oldSize; i++) {
+    if (oldEntries[i])
+      placeEntry(table, oldEntries[i]);
   }
 
+  free(oldEntries);
   return 0;
 }
 
-HashTable_t *HashTable_init(size_t size) {
+HashTable_t *HashTable_initArena(size_t size, Arena_t *arena) {
 
   if (size <= 0)
     return NULL;
 
-  HashTable_t *table = calloc(1, sizeof(HashTable_t));
+  HashTable_t *table = arena ? Arena_alloc(arena, sizeof(HashTable_t)) : calloc(1, sizeof(HashTable_t));
   if (!table) {
     SYSLOG(LOG_ERR, "HashTable_init: Error allocating symbol table\n");
     return NULL;
   }
-  table->size = size;
-  table->entries = calloc(size, sizeof(HashData_t * ));
+  table->arena = arena;
+
+  //leave enough headroom that size entries fit without growing
+  table->size = roundSize(size + size / 3 + 1);
+  table->entries = calloc(table->size, sizeof(HashData_t *));
   if (!table->entries) {
     SYSLOG(LOG_ERR, "HashTable_init: Error allocating symtable entries\n");
-    free(table);
+    if (!arena)
+      free(table);
     return NULL;
   }
 
   return table;
 }
 
+HashTable_t *HashTable_init(size_t size) {
+
+  return HashTable_initArena(size, NULL);
+}
+
 void HashTable_destroy(HashTable_t *table) {
 
   if (!table)
@@ -206,46 +234,16 @@ void HashTable_destroy(HashTable_t *table) {
         continue;
 
       HashData_t *curIndex = table->entries[i];
-      HashData_destroy(curIndex);
+      releaseEntry(table, curIndex);
     }
 
     free(table->entries);
   }
 
+  int inArena = table->arena != NULL;
   memset(table, 0, sizeof(HashTable_t));
-  free(table);
-}
-
-
-int HashTable_resize(HashTable_t *table, size_t size) {
-
-  HashTable_t *newTable = NULL;
-  int status = 0;
-  do {
-    newTable = HashTable_init(size);
-    if (!newTable) {
-      SYSLOG(LOG_ERR, "HashTable_resize: Error initializing new table for resize");
-      return -1;
-    }
-
-    status = HashTable_copy(newTable, table);
-
-    //error copying data, resize the table 
-    if (status) {
-      size = growSize(size);
-      free(newTable);
-    }
-  } while (status);
-
-  //then free old table, and assign new table
-  free(table->entries);
-
-  //make original table point to new table stuff
-  table->entries = newTable->entries;
-  table->size = newTable->size;
-  free(newTable);
-  //and done
-  return 0;
+  if (!inArena)
+    free(table);
 }
 
 void HashTable_print(FILE *output, HashTable_t *table) {
@@ -272,32 +270,75 @@ void HashTable_print(FILE *output, HashTable_t *table) {
 
 HashData_t **HashTable_add(HashTable_t *table, HashData_t *data) {
 
-  if (!table || !table->entries)
+  if (!table || !table->entries || !data)
     return NULL;
 
-  //if we somehow managed to fill the table, make it grow
-  if (table->count >= table->size)
-    HashTable_resize(table, growSize(table->size));
+  HashData_t **position = HashTable_getEntry(table, data->key);
+  if (position) {
+    //entry already exists, overwrite
+    releaseEntry(table, *position);
+    (*position) = data;
+    return position;
+  }
 
+  if (HASHTABLE_FULL(table->count + 1, table->size) && HashTable_resize(table, table->size << 1)) {
+    SYSLOG(LOG_ERR, "HashTable_add: Error growing table for: %s", data->key);
+    return NULL;
+  }
 
-  HashData_t **position = HashTable_getEntry(table, data->key);
+  table->count++;
+  return placeEntry(table, data);
+}
 
-  if (!position) {
-    HashTable_resize(table, growSize(table->size));
-    //try adding the data again
-    return HashTable_add(table, data);;
+HashData_t *HashTable_newEntry(HashTable_t *table, char *key, char *value) {
+
+  if (!table || !key || !value)
+    return NULL;
+
+  if (!table->arena)
+    return HashData_create(key, value);
 
+  HashData_t *entry = Arena_alloc(table->arena, sizeof(HashData_t));
+  if (!entry)
+    return NULL;
+
+  entry->key = Arena_intern(table->arena, key);
+  entry->value = Arena_intern(table->arena, value);
+  if (!entry->key || !entry->value) {
+    SYSLOG(LOG_ERR, "HashTable_newEntry: Failed to allocate %s: %s", key, value);
+    return NULL;
   }
-  if (!*position) {
-    (*position) = data;
-    table->count++;
-  } else {
-    //SYSLOG(LOG_ERR, "HashTable_add: Error adding new entry");
-    //entry already exists, overwrite
-    HashData_destroy(*position);
-    (*position) = data;
+
+  entry->hash = HashBytes(key, strlen(key));
+  return entry;
+}
+
+HashData_t **HashTable_set(HashTable_t *table, char *key, char *value) {
+
+  if (!table || !key || !value)
+    return NULL;
+
+  HashData_t **position = HashTable_getEntry(table, key);
+  if (position) {
+    HashData_t *entry = *position;
+    char *newValue = table->arena ? Arena_intern(table->arena, value) : strdup(value);
+    if (!newValue)
+      return NULL;
+
+    if (!table->arena)
+      free(entry->value);
+    entry->value = newValue;
+    return position;
   }
 
+  HashData_t *entry = HashTable_newEntry(table, key, value);
+  if (!entry)
+    return NULL;
+
+  position = HashTable_add(table, entry);
+  if (!position)
+    releaseEntry(table, entry);
+
   return position;
 }
 
@@ -305,11 +346,34 @@ HashData_t *HashTable_find(HashTable_t *table, char *key) {
 
   HashData_t **position = HashTable_getEntry(table, key);
 
-  if (!position || !*position) {
+  if (!position) {
     return NULL;
   }
 
   return *position;
 }
 
+int HashTable_remove(HashTable_t *table, char *key) {
+
+  HashData_t **position = HashTable_getEntry(table, key);
+  if (!position)
+    return -1;
+
+  releaseEntry(table, *position);
 
+  //backward shift: pull the rest of the run back a slot until
+  //reaching an empty slot or an entry already in its home slot
+  size_t mask = table->size - 1;
+  size_t hole = (size_t) (position - table->entries);
+  size_t pos = (hole + 1) & mask;
+
+  while (table->entries[pos] && PROBE_DIST(table->entries[pos], pos, mask)) {
+    table->entries[hole] = table->entries[pos];
+    hole = pos;
+    pos = (pos + 1) & mask;
+  }
+
+  table->entries[hole] = NULL;
+  table->count--;
+  return 0;
+}
@@ -17,6 +17,10 @@
 #include "display.h"
 #include "api.h"
 #include "pluginLoader.h"
+#include "pluginMux.h"
+#include "pluginWatch.h"
+#include "configWriter.h"
+#include "pluginState.h"
 
 //one second in nanoseconds
 #define SECOND 1000000000
@@ -39,7 +43,8 @@
  "\t\t-D: Runs the magic mirror application as a background process\n" \
  "\t\t-d: defines the webfolder where plugins are located\n" \
  "\t\t-p: Set what port to use for the server. Default is 5000\n" \
- "\t\t-s: Set number of cycles per second to run the server at. Default is 100.\n"
+ "\t\t-s: Set number of cycles per second to run the server at. Default is 100.\n" \
+ "\t\t-S: Give each plugin its own websocket instead of sharing one display connection.\n"
 
 /*
  * Time in seconds it took the system to load all the plugins
@@ -107,16 +112,6 @@ static void mainDaemon() {
 }
 
 
-/*
- * [scanDirectory] callback function.
- * Initialize a plugin from a folder.
- */
-static int initPlugin(char *filepath, struct dirent *dirInfo, void *data) {
-
-  SYSLOG(LOG_INFO, "initPlugin: filepath: %s", filepath);
-  return PluginLoader_LoadPlugin(filepath);
-}
-
 static int _initPluginFrontendCom(void *plug, void *data) {
 
   return PluginLoader_InitClient((Plugin_t *)plug);
@@ -161,15 +156,28 @@ static int initializeDaemon(char *localDir, char *pluginDir, int portNum) {
     return -1;
   }
 
+  //saved plugin state is needed as plugins are loaded
+  PluginState_Open(pluginDir);
+
   //initialize all the plugins in the plugin directory
-  if (DirectoryAction(pluginDir, &initPlugin, NULL)) {
+  if (PluginLoader_LoadAll(pluginDir)) {
     SYSLOG(LOG_ERR, "Main: Error initializing plugins.");
     return -1;
   }
 
+  //pick up plugins added, removed or edited from here on
+  PluginWatch_Init(pluginDir);
+
+  struct timespec phase;
+  clock_gettime(CLOCK_MONOTONIC, &phase);
+
+  PluginMux_Init();
   Display_Generate(portNum, COMS_DIR, CSS_DIR, JSLIBS_DIR, INDEX_FILE);
   API_Init(pluginDir);
 
+  double displayMs = ElapsedMs(&phase);
+  clock_gettime(CLOCK_MONOTONIC, &phase);
+
   SYSLOG(LOG_INFO, "Main: creating socket");
   //initialize the websocket interface
   if (PluginSocket_Start(portNum)) {
@@ -177,6 +185,7 @@ static int initializeDaemon(char *localDir, char *pluginDir, int portNum) {
     return -1;
   }
 
+  syslog(LOG_INFO, "Boot phases: display %.1fms, socket %.1fms", displayMs, ElapsedMs(&phase));
   return 0;
 }
 
@@ -204,6 +213,9 @@ static int daemonProcess(unsigned int sleep) {
     //update any api pending actions
     API_Update();
 
+    //apply any changes made to the plugin directory
+    PluginWatch_Update();
+
     //keep polling to see if the daemon has a connection to the browser
     curWebStatus = Display_IsDisplayConnected();
     if (curWebStatus != oldWebStatus) {
@@ -255,7 +267,7 @@ int main(int argc, char *argv[]) {
   char *runDir = NULL;
   unsigned int sleepDivisor = DEFAULT_SLEEP_DIV;
 
-  while ((c = getopt(argc, argv, "hDp:j:d:s:")) != -1) {
+  while ((c = getopt(argc, argv, "hDSp:j:d:s:")) != -1) {
     switch (c) {
       case 'h':
         printHelp();
@@ -271,6 +283,9 @@ int main(int argc, char *argv[]) {
       case 'd':
         runDir = optarg;
         break;
+      case 'S':
+        PluginMux_SetEnabled(0);
+        break;
       case 's':
         sleepDivisor = strtol(optarg, NULL, 10);
       default:
@@ -291,8 +306,12 @@ int main(int argc, char *argv[]) {
 
   int prgmStatus = 0;
   char *runDirectory = realpath(runDir, NULL);
+
+  //plugin.conf changes are written behind the main loop
+  ConfigWriter_Init();
   do {
-    unsigned int startTime = time(NULL);
+    struct timespec startTime;
+    clock_gettime(CLOCK_MONOTONIC, &startTime);
 
     //initialize the daemon and all the plugins
     if (initializeDaemon(runDirectory, filepath, port)) {
@@ -300,21 +319,27 @@ int main(int argc, char *argv[]) {
       return EXIT_SUCCESS;
     }
 
-    MainProgram_BootSeconds = (time(NULL) - startTime) + 1;
-    SYSLOG(LOG_INFO, "Boot Time: %d", MainProgram_BootSeconds);
+    //round up to whole seconds, the display only needs to wait out the boot itself
+    double bootMs = ElapsedMs(&startTime);
+    MainProgram_BootSeconds = (unsigned int) (bootMs / 1000) + 1;
+    syslog(LOG_INFO, "Boot Time: %.1fms", bootMs);
 
     prgmStatus = daemonProcess(sleepDivisor);
 
     //clean up...
     API_ShutdownPlugins();
+    ConfigWriter_Flush(NULL);
 
+    PluginWatch_Cleanup();
     PluginSocket_Cleanup();
     Display_Cleanup();
     PluginList_Free();
+    PluginState_Close();
 
   } while (API_Reboot());
 
   SYSLOG(LOG_INFO, "Main: hard shutdown");
+  ConfigWriter_Cleanup();
   free(runDirectory);
   closelog();
 
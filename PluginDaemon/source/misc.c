@@ -9,8 +9,12 @@
 #include <string.h>
 #include <dirent.h>
 #include <syslog.h>
+#include <errno.h>
+#include <limits.h>
 #include "misc.h"
 
+#define ATOMIC_TMP_SUFFIX ".tmp"
+
 
 /*
   Applies an operation to each file or folder found in a directory specified
@@ -56,3 +60,82 @@ int DirectoryAction(char *path, int (*forEach)(char *, struct dirent *, void *d)
   return 0;
 }
 
+
+/*
+  Milliseconds of monotonic time passed since a clock_gettime(CLOCK_MONOTONIC) reading.
+*/
+double ElapsedMs(struct timespec *since) {
+
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  return (now.tv_sec - since->tv_sec) * 1000.0 + (now.tv_nsec - since->tv_nsec) / 1000000.0;
+}
+
+/*
+  Hash len bytes of data, shared by the hash tables, the string arena and
+  the generated index.
+
+  djb2 algorithm (xor variant)
+  http://www.cse.yorku.ca/~oz/hash.html
+*/
+size_t HashBytes(const char *data, size_t len) {
+
+  size_t hashVal = 5381;
+  size_t i = 0;
+
+  for (i = 0; i < len; i++)
+    hashVal = ((hashVal << 5) + hashVal) ^ (unsigned char) data[i]; /* hash * 33 ^ c */
+
+  return hashVal;
+}
+
+/*
+  Write all len bytes of data to fd, retrying short and interrupted writes.
+*/
+int WriteAll(int fd, const char *data, size_t len) {
+
+  while (len) {
+    ssize_t wrote = write(fd, data, len);
+    if (wrote < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+
+    data += wrote;
+    len -= wrote;
+  }
+
+  return 0;
+}
+
+/*
+  Replace the file at path with len bytes of data. The data is written and
+  synced to path.tmp first, then renamed over path, so readers, and the file
+  left behind by a power loss, only ever hold the old or the complete new
+  contents. The temp file is removed if anything fails.
+*/
+int WriteFileAtomic(const char *path, const char *data, size_t len, mode_t mode) {
+
+  char tmpPath[PATH_MAX + sizeof(ATOMIC_TMP_SUFFIX)];
+  snprintf(tmpPath, sizeof(tmpPath), "%s" ATOMIC_TMP_SUFFIX, path);
+
+  //a leftover temp file may be read only
+  unlink(tmpPath);
+
+  int fd = open(tmpPath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, mode);
+  if (fd < 0) {
+    SYSLOG(LOG_ERR, "WriteFileAtomic: Error opening %s", tmpPath);
+    return -1;
+  }
+
+  int status = WriteAll(fd, data, len) || fsync(fd);
+  if (close(fd) || status || rename(tmpPath, path)) {
+    SYSLOG(LOG_ERR, "WriteFileAtomic: Error writing %s", path);
+    unlink(tmpPath);
+    return -1;
+  }
+
+  return 0;
+}
@@ -67,6 +67,29 @@ static char *escapeCharacter(char input) {
   return (char *) &JSON_Escape[7];
 }
 
+/*
+ * Copy str into buf, escaping any characters that would throw off json
+ * parsing. buf needs room for twice the length of str, plus the terminator.
+ * Returns the length written.
+ */
+size_t PluginComLib_escape(char *buf, const char *str) {
+
+  char *pos = buf;
+  for (; *str != '\0'; str++) {
+    char *escaped = escapeCharacter(*str);
+    if (*escaped == '\0') {
+      *pos++ = *str;
+      continue;
+    }
+
+    while (*escaped != '\0')
+      *pos++ = *escaped++;
+  }
+
+  *pos = '\0';
+  return pos - buf;
+}
+
 char *PluginComLib_makeMsg(char *command, char *data) {
   //make sure a command is given
   if (!command) return NULL;
@@ -74,7 +97,9 @@ char *PluginComLib_makeMsg(char *command, char *data) {
   size_t bufLen =  strlen(COMMAND_START) + strlen(command) + strlen(COMMAND_END) + strlen(DATA_START) +
                   +strlen(DATA_END);
 
+  //room for every character escaped, and the terminator
   if (data) bufLen += strlen(data) * 2;
+  bufLen++;
 
 
   char *buffer = calloc(bufLen + LWS_SEND_BUFFER_PRE_PADDING, sizeof(char));
@@ -87,27 +112,8 @@ char *PluginComLib_makeMsg(char *command, char *data) {
 
   pos += snprintf(pos, bufLen, "%s%s%s%s", COMMAND_START, command, COMMAND_END, DATA_START);
 
-  if (data != NULL) {
-    size_t byte = 0;
-    //as we are writing data out, escape and special characters that would
-    //throw off json parsing.
-    do {
-      char letter = data[byte];
-      if (letter == '\0') break;
-
-      char *escaped = escapeCharacter(letter);
-      if (*escaped == '\0') {
-        *pos++ = letter;
-      } else {
-        char *n = escaped;
-        while (*n != '\0') {
-          *pos++ = *n++;
-        }
-      }
-
-    } while (byte++ < strlen(data) - 1);
-    *pos = '\0';
-  }
+  if (data != NULL)
+    pos += PluginComLib_escape(pos, data);
 
   memcpy(pos, DATA_END, strlen(DATA_END));
   return buffer;
@@ -5,21 +5,29 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 #include <unistd.h>
 #include <syslog.h>
 #include <libwebsockets.h>
 
 #include "protocolWrite.h"
 #include "pluginSocket.h"
+#include "hashIndex.h"
 #include "misc.h"
 
 #define INDEX_PATH "/"
+//how long the display may use web files before asking if they changed
+#define INDEX_CACHE_SECONDS 1
 #define GUI_PATH "/gui"
 
 
 #define SOCKET_TIMEOUT 50
 #define BASE_PROTO_POOL 2
 
+//empty slots handed to libwebsockets with the protocol list, so plugins
+//can be added while the server runs without moving the list
+#define SPARE_PROTO_SLOTS 16
+
 
 /*
  * Main context for the socket server
@@ -32,10 +40,25 @@ static int portNumber = -1;
 /*
  * Dynamically allocated list of protocols.
  * Grows as more protocols are added.
+ *
+ * Removed protocols leave a tombstone in their slot rather than shifting
+ * the list down; the slot is pushed onto _freeSlots and handed to the next
+ * protocol added. Each reuse bumps the slot's generation so the new
+ * protocol gets a different handle (see PROTOCOL_HANDLE).
+ *
+ * _protocolIndex maps protocol names to slot + 1 so 0 (NULL) can mean
+ * "not found".
+ *
+ * libwebsockets keeps a pointer to the list, so once the server is started
+ * the list never moves; new protocols can only take free slots.
  */
 static int _protocolCount = 0;
 static int _lastProtocol = 0;
 struct lws_protocols *_protocols = NULL;
+static unsigned int *_protocolGen = NULL;
+static int *_freeSlots = NULL;
+static int _freeSlotCount = 0;
+static HashIndex_t *_protocolIndex = NULL;
 static ProtocolWrites_t protocolWriteQueues = {0, 0};
 /*
  * protocol list must end with a protocol
@@ -67,20 +90,18 @@ static const struct lws_protocol_vhost_options extra_mimetypes = {
         "application/font-woff"
 };
 
+//index.html is only rewritten when it changes (see Display_Generate), so the
+//display keeps its copies and revalidates them, getting a 304 for unchanged files
 static const struct lws_http_mount indexMount = {
-        NULL,
-        INDEX_PATH,
-        "./",
-        "index.html",
-        NULL,
-        &extra_mimetypes,
-        0,
-        0,
-        0,
-        0,
-        0,
-        LWSMPRO_FILE,
-        1
+        .mountpoint = INDEX_PATH,
+        .origin = "./",
+        .def = "index.html",
+        .extra_mimetypes = &extra_mimetypes,
+        .cache_max_age = INDEX_CACHE_SECONDS,
+        .cache_reusable = 1,
+        .cache_revalidate = 1,
+        .origin_protocol = LWSMPRO_FILE,
+        .mountpoint_len = 1
 };
 
 
@@ -102,11 +123,52 @@ static char *allocStr(char *input) {
  * Protocol List
  ===========================================================================================*/
 
+/*
+ * Callback given to removed protocol slots. libwebsockets stops walking the
+ * protocol list at the first NULL callback, so a tombstone still needs one;
+ * it refuses any connection that would try to use it.
+ */
+static int deadProtocolCallback(struct lws *wsi, enum lws_callback_reasons reason,
+                                void *user, void *in, size_t len) {
+
+  if (reason == LWS_CALLBACK_FILTER_PROTOCOL_CONNECTION)
+    return -1;
+
+  return 0;
+}
+
+/*
+ * Turn a slot into a tombstone and queue it for reuse.
+ */
+static void makeTombstone(int slot) {
+
+  struct lws_protocols *proto = &_protocols[slot];
+  proto->name = "";
+  proto->callback = deadProtocolCallback;
+  proto->user = NULL;
+  proto->per_session_data_size = 0;
+  proto->rx_buffer_size = 0;
+  proto->id = PROTOCOL_HANDLE_INVALID;
+
+  _freeSlots[_freeSlotCount++] = slot;
+}
+
 /*
  * Clears all memory used by the protocol list
  */
 void PluginSocket_FreeProtocolList(void) {
 
+  if (_protocolIndex)
+    HashIndex_destroy(_protocolIndex);
+  _protocolIndex = NULL;
+
+  free(_freeSlots);
+  _freeSlots = NULL;
+  _freeSlotCount = 0;
+
+  free(_protocolGen);
+  _protocolGen = NULL;
+
   if (!_protocols) return;
 
   free(_protocols);
@@ -117,7 +179,7 @@ void PluginSocket_FreeProtocolList(void) {
 
 static void printProtocols(void) {
 
-  for (int i = 0; i < _protocolCount; i++) {
+  for (int i = 0; i < _lastProtocol; i++) {
     SYSLOG(LOG_INFO, "Protocol: %s", _protocols[i].name);
   }
 }
@@ -127,15 +189,97 @@ static void printProtocols(void) {
  */
 struct lws_protocols *PluginSocket_getProtocol(char *name) {
 
-  int i = 0;
-  for (i = 0; i < _protocolCount; i++) {
-    const char *target = _protocols[i].name;
+  if (!name || !_protocolIndex)
+    return NULL;
 
-    if (!strncmp(name, target, strlen(target)))
-      return &_protocols[i];
+  intptr_t slot = (intptr_t) HashIndex_find(_protocolIndex, name);
+  if (!slot)
+    return NULL;
+
+  return &_protocols[slot - 1];
+}
+
+/*
+ * Returns a protocol instance via its handle (lws_protocols.id), or NULL
+ * if the handle is stale.
+ */
+struct lws_protocols *PluginSocket_getProtocolByHandle(unsigned int handle) {
+
+  unsigned int slot = PROTOCOL_HANDLE_SLOT(handle);
+  if (handle == PROTOCOL_HANDLE_INVALID || slot >= (unsigned int) _lastProtocol)
+    return NULL;
+
+  if (_protocols[slot].id != handle)
+    return NULL;
+
+  return &_protocols[slot];
+}
+
+/*
+ * Grow the protocol list, and everything sized with it, to hold
+ * at least one more entry.
+ */
+static int growProtocolList(void) {
+
+  int newCount = _protocolCount ? _protocolCount * 2 : BASE_PROTO_POOL;
+  if (newCount > (int) PROTOCOL_HANDLE_SLOT_MASK) {
+    SYSLOG(LOG_ERR, "PluginSocket_MakeProtocol: Protocol list full: count: %d", _protocolCount);
+    return -1;
   }
 
-  return NULL;
+  struct lws_protocols *protos = realloc(_protocols, sizeof(struct lws_protocols) * newCount);
+  if (!protos) {
+    SYSLOG(LOG_ERR, "PluginSocket_MakeProtocol: Error reallocating protocol list: count: %d", newCount);
+    return -1;
+  }
+  _protocols = protos;
+
+  unsigned int *gens = realloc(_protocolGen, sizeof(unsigned int) * newCount);
+  if (!gens) {
+    SYSLOG(LOG_ERR, "PluginSocket_MakeProtocol: Error reallocating generations: count: %d", newCount);
+    return -1;
+  }
+  //generations start at 1 so no handle is ever PROTOCOL_HANDLE_INVALID
+  for (int i = _protocolCount; i < newCount; i++)
+    gens[i] = 1;
+  _protocolGen = gens;
+
+  int *slots = realloc(_freeSlots, sizeof(int) * newCount);
+  if (!slots) {
+    SYSLOG(LOG_ERR, "PluginSocket_MakeProtocol: Error reallocating free slots: count: %d", newCount);
+    return -1;
+  }
+  _freeSlots = slots;
+
+  _protocolCount = newCount;
+  SYSLOG(LOG_INFO, "Addprotocol: resized pool %d", _protocolCount);
+  return 0;
+}
+
+/*
+ * Copy proto into a slot and give it a fresh handle and write queue.
+ */
+static int fillProtocolSlot(int slot, struct lws_protocols *proto) {
+
+  _protocols[slot].name = proto->name;
+  _protocols[slot].callback = proto->callback;
+  _protocols[slot].user = proto->user;
+  _protocols[slot].rx_buffer_size = proto->rx_buffer_size;
+  _protocols[slot].per_session_data_size = proto->per_session_data_size;
+  _protocols[slot].id = PROTOCOL_HANDLE(slot, _protocolGen[slot]);
+
+  if (Protocol_setProtocolCount(&protocolWriteQueues, slot))
+    return -1;
+  Protocol_initQueue(&protocolWriteQueues, _protocols[slot].id);
+
+  //the list terminator has no name and is never looked up
+  if (!proto->name)
+    return 0;
+
+  if (!_protocolIndex && !(_protocolIndex = HashIndex_init(BASE_PROTO_POOL)))
+    return -1;
+
+  return HashIndex_add(_protocolIndex, proto->name, (void *) (intptr_t) (slot + 1));
 }
 
 /*
@@ -161,26 +305,18 @@ struct lws_protocols *PluginSocket_getProtocol(char *name) {
  */
 int PluginSocket_AddProtocol(struct lws_protocols *proto) {
 
-  if (_lastProtocol >= _protocolCount) {
-
-    int start = 0;
-    if (!_protocolCount) {
-      _protocolCount = BASE_PROTO_POOL;
-      //start++;
-    }
-
+  //reuse the slot of a removed protocol before growing the list
+  if (proto->callback && _freeSlotCount > 0)
+    return fillProtocolSlot(_freeSlots[--_freeSlotCount], proto);
 
-    int newCount = _protocolCount + 1;
-    struct lws_protocols *protos = realloc(_protocols, sizeof(struct lws_protocols) * newCount);
-    if (!protos) {
-      SYSLOG(LOG_ERR, "PluginSocket_MakeProtocol: Error reallocating protocol list: count: %d", newCount);
-      return -1;
-    }
-    _protocols = protos;
-    _protocolCount = newCount;
-    SYSLOG(LOG_INFO, "Addprotocol: resized pool %d", _protocolCount);
+  if (_context) {
+    SYSLOG(LOG_ERR, "PluginSocket_AddProtocol: No free protocol slots left for %s", proto->name);
+    return -1;
   }
 
+  if (_lastProtocol >= _protocolCount && growProtocolList())
+    return -1;
+
   //replace the null entry if we are adding onto the list after the context has been
   //created.
   int addEnd = 0;
@@ -189,17 +325,9 @@ int PluginSocket_AddProtocol(struct lws_protocols *proto) {
     _lastProtocol--;
   }
 
-
   //replace the old _arrayTerminate protocol with an actual protocol
-  _protocols[_lastProtocol].name = proto->name;
-  _protocols[_lastProtocol].callback = proto->callback;
-  _protocols[_lastProtocol].user = proto->user;
-  _protocols[_lastProtocol].rx_buffer_size = proto->rx_buffer_size;
-  _protocols[_lastProtocol].per_session_data_size = proto->per_session_data_size;
-  _protocols[_lastProtocol].id = _lastProtocol;
-
-  Protocol_setProtocolCount(&protocolWriteQueues, _lastProtocol);
-  Protocol_initQueue(&protocolWriteQueues, _lastProtocol);
+  if (fillProtocolSlot(_lastProtocol, proto))
+    return -1;
 
   _lastProtocol++;
 
@@ -212,28 +340,27 @@ int PluginSocket_AddProtocol(struct lws_protocols *proto) {
 
 /*
  * Remove a protocol from the list.
+ *
+ * The slot is left in place as a tombstone and queued for reuse, so the
+ * position and handle of every other protocol is unaffected.
  */
 void PluginSocket_RemoveProtocol(char *protocolName) {
 
-  int pos = -1;
-  for (int i = 0; i < _lastProtocol; i++) {
-    //once we've found the protocol to replace, mark its position, then continue
-    if (pos == -1 && !strcmp(_protocols[i].name, protocolName)) {
-      pos = i;
-      Protocol_removeProtocol(&protocolWriteQueues, _protocols[i].id);
-      continue;
-    } else if (pos > -1) {
-
-      //i should be ahead of pos now, so we can shift the rest of the protocol
-      //list overtop of the protocol we are removing
-      memcpy(&_protocols[pos++], &_protocols[i], sizeof(struct lws_protocols));
-      //make sure the id's point to the correct protocol buffer
-      _protocols[pos - 1].id = _protocols[i].id;
-    }
-  }
+  if (!protocolName || !_protocolIndex)
+    return;
+
+  intptr_t slot = (intptr_t) HashIndex_remove(_protocolIndex, protocolName);
+  if (!slot)
+    return;
+  slot--;
+
+  Protocol_removeProtocol(&protocolWriteQueues, _protocols[slot].id);
+
+  _protocolGen[slot]++;
+  if (PROTOCOL_HANDLE(0, _protocolGen[slot]) == PROTOCOL_HANDLE_INVALID)
+    _protocolGen[slot] = 1;
 
-  //update _lastProtocol count
-  _lastProtocol -= (pos > -1);
+  makeTombstone((int) slot);
 }
 
 /*
@@ -254,6 +381,15 @@ void PluginSocket_Update(void) {
  */
 int PluginSocket_writeToSocket(struct lws *wsi_in, char *str, int str_size_in, char noHeader) {
 
+  return PluginSocket_writeTagged(wsi_in, str, str_size_in, noHeader, 0);
+}
+
+/*
+ * Write to a target socket, replacing any message with the same
+ * tag still waiting to be written (see Protocol_addWriteToQueue).
+ */
+int PluginSocket_writeTagged(struct lws *wsi_in, char *str, int str_size_in, char noHeader, unsigned int tag) {
+
   if (str == NULL || wsi_in == NULL || !str_size_in)
     return -1;
 
@@ -282,7 +418,20 @@ int PluginSocket_writeToSocket(struct lws *wsi_in, char *str, int str_size_in, c
     out = str;
 
   //add this message to the write buffer
-  Protocol_addWriteToQueue(&protocolWriteQueues, wsi_in, out, len);
+  Protocol_addWriteToQueue(&protocolWriteQueues, wsi_in, out, len, tag);
+  return 0;
+}
+
+/*
+ * Queue len bytes of a shared buffer for a socket without copying them,
+ * see Protocol_addSharedToQueue.
+ */
+int PluginSocket_writeShared(struct lws *wsi_in, SharedWrite_t *shared, size_t offset, size_t len) {
+
+  if (!shared || !wsi_in || !len)
+    return -1;
+
+  Protocol_addSharedToQueue(&protocolWriteQueues, wsi_in, shared, offset, len, 0);
   return 0;
 }
 
@@ -295,6 +444,24 @@ void PluginSocket_writeBuffers(struct lws *wsi) {
   Protocol_processQueue(wsi, &protocolWriteQueues);
 }
 
+/*
+ * Must be called when a connection is established on any protocol, so the
+ * protocol's write queue exists while something can be written to.
+ */
+void PluginSocket_openWriteBuffers(struct lws *wsi) {
+
+  Protocol_openQueue(wsi, &protocolWriteQueues);
+}
+
+/*
+ * Must be called when a connection closes, pairs with
+ * PluginSocket_openWriteBuffers.
+ */
+void PluginSocket_closeWriteBuffers(struct lws *wsi) {
+
+  Protocol_closeQueue(wsi, &protocolWriteQueues);
+}
+
 void PluginSocket_clearWriteBuffers(struct lws *wsi, char onlyDead) {
 
   struct lws_protocols *proto = (struct lws_protocols *) lws_get_protocol(wsi);
@@ -317,6 +484,16 @@ void PluginSocket_clearWriteBuffers(struct lws *wsi, char onlyDead) {
 static struct lws_context *_makeContext(int port) {
 
   portNumber = port;
+
+  //reserve room for plugins added at runtime ahead of the terminator
+  int spare = 0;
+  for (spare = 0; spare < SPARE_PROTO_SLOTS; spare++) {
+    if (_lastProtocol >= _protocolCount && growProtocolList())
+      break;
+
+    makeTombstone(_lastProtocol++);
+  }
+
   PluginSocket_AddProtocol(&listTerminator);
   printProtocols();
 
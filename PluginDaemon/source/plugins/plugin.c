@@ -21,11 +21,15 @@
 #include "misc.h"
 #include "api.h"
 #include "display.h"
+#include "pluginMux.h"
+#include "pluginState.h"
 
 #define CSS_HASH_INIT_SIZE 73
+#define CSS_ARENA_BLOCK 1024
+//don't bother compacting the css arena before it reaches this size
+#define CSS_ARENA_COMPACT_MIN (16 * 1024)
 
 
-#define PLUGIN_SAVED_CSS_FILE "position.txt"
 #define PLUGIN_SAVED_CSS_LOCATION "%s/"PLUGIN_SAVED_CSS_FILE
 
 #define PLUGIN_CLIENT_LOADED_MSG "PluginClient Loaded"
@@ -54,33 +58,20 @@ static size_t sstrlen(char *string) {
 
 
 
-//helper function for instantiating a plugin object
-Plugin_t *Plugin_Create(void) {
-
-  Plugin_t *newPlugin = calloc(sizeof(Plugin_t), 1);
-  if (!newPlugin) {
-    SYSLOG(LOG_ERR, "Plugin Init: Error allocating memory...");
-    return NULL;
-  }
+static void plugin_freeSettings(Plugin_t *plugin);
 
-  //allocate hash table for plugin css attributes
-  newPlugin->cssAttr = HashTable_init(CSS_HASH_INIT_SIZE);
-  if (!newPlugin->cssAttr) {
-    SYSLOG(LOG_ERR, "Plugin Init: Error allocating hash table for plugin css");
-    HashTable_destroy(newPlugin->config.table);
-    free(newPlugin);
-    return NULL;
-  }
+static void _pluginFreeBundle(Plugin_t *plugin);
 
+static void generateUUID(Plugin_t *plugin) {
 
   //generate uuid for it
   uuid_t id;
   uuid_generate(id);
-  uuid_unparse(id, newPlugin->uuid);
+  uuid_unparse(id, plugin->uuid);
 
   //get short version of uuid (no dashes)
-  char *s = newPlugin->uuid, *d = newPlugin->uuidShort;
-  size_t shortLen = sizeof(newPlugin->uuidShort) - 1;
+  char *s = plugin->uuid, *d = plugin->uuidShort;
+  size_t shortLen = sizeof(plugin->uuidShort) - 1;
   while (*s != '\0' && shortLen > 0) {
     if (*s == '-') {
       s++;
@@ -90,6 +81,25 @@ Plugin_t *Plugin_Create(void) {
     shortLen--;
   }
   *d = '\0';
+}
+
+//helper function for instantiating a plugin object
+Plugin_t *Plugin_Create(void) {
+
+  Plugin_t *newPlugin = calloc(sizeof(Plugin_t), 1);
+  if (!newPlugin) {
+    SYSLOG(LOG_ERR, "Plugin Init: Error allocating memory...");
+    return NULL;
+  }
+
+  //allocate hash table for plugin css attributes
+  if (PluginCSS_init(newPlugin)) {
+    SYSLOG(LOG_ERR, "Plugin Init: Error allocating hash table for plugin css");
+    free(newPlugin);
+    return NULL;
+  }
+
+  generateUUID(newPlugin);
 
   newPlugin->bgScriptPID = -1;
   newPlugin->socketInstance = NULL;
@@ -99,6 +109,156 @@ Plugin_t *Plugin_Create(void) {
   return newPlugin;
 }
 
+/*
+ * Create a registered but unloaded plugin. A stub only knows its name,
+ * directory and uuid; it has no config, css or protocols until
+ * Plugin_Materialize loads it.
+ */
+Plugin_t *Plugin_CreateStub(const char *path, const char *pluginName) {
+
+  Plugin_t *stub = calloc(sizeof(Plugin_t), 1);
+  if (!stub) {
+    SYSLOG(LOG_ERR, "Plugin_CreateStub: Error allocating memory...");
+    return NULL;
+  }
+
+  stub->basePath = strdup(path);
+  if (!stub->basePath || Plugin_SetName(stub, pluginName)) {
+    Plugin_Free(stub, 1);
+    return NULL;
+  }
+
+  generateUUID(stub);
+  stub->flags = PLUGIN_FLAG_STUB;
+  stub->bgScriptPID = -1;
+  return stub;
+}
+
+/*
+ * Drop everything but a disabled plugin's identity, turning it back into a stub.
+ */
+void Plugin_MakeStub(Plugin_t *plugin) {
+
+  plugin_freeSettings(plugin);
+  Plugin_ClientFreeResponse(plugin);
+  PluginCSS_free(plugin);
+
+  plugin->flags = PLUGIN_FLAG_STUB;
+}
+
+int Plugin_IsStub(Plugin_t *plugin) {
+
+  return plugin->flags & PLUGIN_FLAG_STUB;
+}
+
+/*
+ * Fully load a stub plugin in place. The plugin keeps its address, name,
+ * directory and uuid, so list indexes and anyone holding it stay valid.
+ */
+int Plugin_Materialize(Plugin_t *plugin) {
+
+  if (!Plugin_IsStub(plugin))
+    return 0;
+
+  Plugin_t *full = Plugin_Parse(Plugin_GetDirectory(plugin), Plugin_GetName(plugin));
+  if (!full) {
+    SYSLOG(LOG_ERR, "Plugin_Materialize: failed loading %s", Plugin_GetName(plugin));
+    return -1;
+  }
+
+  free(full->name);
+  free(full->basePath);
+  full->name = plugin->name;
+  full->basePath = plugin->basePath;
+  memcpy(full->uuid, plugin->uuid, PLUGIN_UUID_LEN);
+  memcpy(full->uuidShort, plugin->uuidShort, PLUGIN_UUID_SHORT_LEN);
+
+  //start-on-load doesn't apply, a stub isn't running so neither is the plugin
+  //it becomes until its caller enables it
+  PLUGIN_SET_DISABLED(full);
+
+  //nothing refers to the freshly parsed plugin yet, so it can move wholesale
+  *plugin = *full;
+  free(full);
+  return 0;
+}
+
+/*
+ * Bind a frontend connection to a plugin. When muxed is set, wsi is the shared
+ * PluginMux connection and everything sent to the plugin is tagged with its
+ * channel. Returns -1 if the plugin already has a frontend connection.
+ */
+int Plugin_ClientAttach(Plugin_t *plugin, struct lws *wsi, int muxed) {
+
+  if (plugin->socketInstance)
+    return -1;
+
+  SYSLOG(LOG_INFO, "Plugin_ClientAttach: got instance![%s]", Plugin_GetName(plugin));
+  plugin->socketInstance = wsi;
+  if (muxed)
+    plugin->flags |= PLUGIN_FLAG_MUXED;
+
+  lws_callback_on_writable(plugin->socketInstance);
+  //send the frontend data to the browser once the plugin connects
+  if (!Plugin_isFrontendLoaded(plugin))
+    Plugin_LoadFrontend(plugin);
+
+  return 0;
+}
+
+/*
+ * Unbind a plugin from its frontend connection.
+ */
+void Plugin_ClientDetach(Plugin_t *plugin) {
+
+  if (!plugin->socketInstance)
+    return;
+
+  //if the plugin disconnects, either the plugin was unloaded, or the browser closed
+  //for both situations, unload the plugin frontend
+  Plugin_ClientFreeResponse(plugin);
+  Plugin_UnloadFrontEnd(plugin);
+
+  //a muxed connection's write queue is shared with every other channel on it
+  if (!(plugin->flags & PLUGIN_FLAG_MUXED))
+    PluginSocket_clearWriteBuffers(plugin->socketInstance, 0);
+
+  plugin->flags &= ~PLUGIN_FLAG_MUXED;
+  plugin->socketInstance = NULL;
+}
+
+/*
+ * Handle a complete message from a plugin's frontend. The session is
+ * emptied, either freed or handed over to plugin->clientResponse.
+ */
+void Plugin_ClientReceive(Plugin_t *plugin, struct lws *wsi, SocketResponse_t *session) {
+
+  char *clientData = SocketResponse_get(session);
+  size_t clientSize = SocketResponse_size(session);
+
+  //process any api calls made by plugin client controller
+  if(API_Parse(wsi, clientData, clientSize)) {
+    SocketResponse_free(session);
+    return;
+  }
+
+  //check for plugin client confirmed load
+  else if (!strcmp((char *) clientData, PLUGIN_CLIENT_LOADED_MSG)) {
+    //set plugin as loaded
+    plugin->flags |= PLUGIN_FLAG_LOADED;
+    SYSLOG(LOG_INFO, "Plugin_ClientReceive: confirmed plugin load: %s", Plugin_GetName(plugin));
+    SocketResponse_free(session);
+    return;
+  }
+
+  //if there is an external client connected specifically for this plugin, send them a response
+  if (plugin->externSocketInstance)
+    PluginSocket_writeToSocket(plugin->externSocketInstance, clientData, clientSize - 1, 0);
+
+  //publish the completed message for any pending api request waiting on it
+  SocketResponse_take(&plugin->clientResponse, session);
+}
+
 /*
  * This socket callback is used between this daemon and the webpage front end.
  */
@@ -131,50 +291,25 @@ static int Plugin_SocketCallback(struct lws *wsi, websocket_callback_type reason
       //SYSLOG(LOG_INFO, "Plugin_SocketCallback established[%s]", proto->name);
       Plugin_t *plugin = (Plugin_t *) proto->user;
       SYSLOG(LOG_INFO, "Plugin_SocketCallback get plugin %s", Plugin_GetName(plugin));
-      if (!plugin->socketInstance) {
-        SYSLOG(LOG_INFO, "Plugin_SocketCallback got instance![%s]", Plugin_GetName(plugin));
-        plugin->socketInstance = wsi;
-        lws_callback_on_writable(plugin->socketInstance);
-        //send the frontend data to the browser once the plugin connects
-        if (!Plugin_isFrontendLoaded(plugin))
-          Plugin_LoadFrontend(plugin);
-      }
+      PluginSocket_openWriteBuffers(wsi);
+      Plugin_ClientAttach(plugin, wsi, 0);
     }
       break;
 
     case LWS_CALLBACK_RECEIVE: {
 
-      if (!proto || !len)
+      if (!proto || !len || !user)
         return 0;
 
       Plugin_t *plugin = (Plugin_t *) proto->user;
       //SYSLOG(LOG_INFO, "Plugin_SocketCallback received[%s] %s", proto->name, (char *) in);
 
-      SocketResponse_t *clientResponse = &plugin->clientResponse;
-      SocketResponse_build(clientResponse, wsi, (char *) in, len);
-      if (SocketResponse_done(clientResponse)) {
-
-        char *clientData = SocketResponse_get(clientResponse);
-        size_t clientSize = SocketResponse_size(clientResponse);
-
-        //process any api calls made by plugin client controller
-        if(API_Parse(wsi, clientData, clientSize))
-          break;
-
-        //check for plugin client confirmed load
-        else if (!strcmp((char *) clientData, PLUGIN_CLIENT_LOADED_MSG)) {
-          //set plugin as loaded
-          plugin->flags |= PLUGIN_FLAG_LOADED;
-          SYSLOG(LOG_INFO, "Plugin_SocketCallback: confirmed plugin load: %s", proto->name);
-          PluginCSS_sendAll(plugin);
-          return 0;
-        }
-        else {
-          //if there is an external client connected specifically for this plugin, send them a response
-          if (plugin->externSocketInstance)
-            PluginSocket_writeToSocket(plugin->externSocketInstance, in, len, 0);
-        }
-      }
+      //reassemble in this connection's session data so a second connection on the
+      //same plugin protocol can't interleave with this one
+      SocketResponse_t *session = (SocketResponse_t *) user;
+      SocketResponse_build(session, wsi, (char *) in, len);
+      if (SocketResponse_done(session))
+        Plugin_ClientReceive(plugin, wsi, session);
     }
       break;
 
@@ -182,12 +317,13 @@ static int Plugin_SocketCallback(struct lws *wsi, websocket_callback_type reason
       if (proto) {
         SYSLOG(LOG_INFO, "Plugin_SocketCallback disconnect[%s]", proto->name);
         Plugin_t *plugin = (Plugin_t *) proto->user;
-        //if the plugin disconnects, either the plugin was unloaded, or the browser closed
-        //for both situations, unload the plugin frontend
-        Plugin_ClientFreeResponse(plugin);
-        Plugin_UnloadFrontEnd(plugin);
-        PluginSocket_clearWriteBuffers(plugin->socketInstance, 0);
-        plugin->socketInstance = NULL;
+        if (user)
+          SocketResponse_free((SocketResponse_t *) user);
+        //a second connection on this plugin's protocol closing shouldn't detach the first
+        if (plugin->socketInstance == wsi)
+          Plugin_ClientDetach(plugin);
+
+        PluginSocket_closeWriteBuffers(wsi);
       }
       break;
 
@@ -209,6 +345,7 @@ struct lws_protocols Plugin_MakeProtocol(Plugin_t *plugin) {
   proto.name = Plugin_GetWebProtocol(plugin);
   proto.callback = &Plugin_SocketCallback;
   proto.rx_buffer_size = PLUGIN_RX_BUFFER_SIZE;
+  proto.per_session_data_size = sizeof(SocketResponse_t);
   proto.user = (void *) plugin;
   return proto;
 }
@@ -247,30 +384,30 @@ static int Plugin_ExternalSocketCallback(struct lws *wsi, websocket_callback_typ
 
       if (proto) {
         Plugin_t *plugin = (Plugin_t *) proto->user;
+        PluginSocket_openWriteBuffers(wsi);
         plugin->externSocketInstance = wsi;
         lws_callback_on_writable(plugin->externSocketInstance);
       }
     }
       break;
 
-    case LWS_CALLBACK_RECEIVE:
+    case LWS_CALLBACK_RECEIVE: {
 
-      if (!proto || !len)
+      if (!proto || !len || !user)
         return 0;
 
-
       Plugin_t *plugin = (Plugin_t *) proto->user;
+      SocketResponse_t *externResponse = (SocketResponse_t *) user;
 
       if (!plugin->socketInstance) {
         SYSLOG(LOG_ERR, "Plugin_ExternalSocketCallback: Error, no connection to front end [%s->%s]",
                proto->name, Plugin_GetWebProtocol(plugin));
 
         //discard partial messages from disconnection
-        SocketResponse_free(&plugin->externResponse);
+        SocketResponse_free(externResponse);
         return 0;
       }
 
-      SocketResponse_t *externResponse = &plugin->externResponse;
       SocketResponse_build(externResponse, wsi, (char *) in, len);
       if (SocketResponse_done(externResponse)) {
         /*
@@ -278,19 +415,25 @@ static int Plugin_ExternalSocketCallback(struct lws *wsi, websocket_callback_typ
          * it to the right plugin interface.
          */
 
-        PluginSocket_writeToSocket(plugin->socketInstance,
-                                   SocketResponse_get(externResponse),
-                                   SocketResponse_size(externResponse) - 1, 0);
+        Plugin_SendRaw(plugin, SocketResponse_get(externResponse),
+                       SocketResponse_size(externResponse) - 1);
+        SocketResponse_free(externResponse);
       }
-
-
+    }
       break;
+
     case LWS_CALLBACK_CLOSED: {
       SYSLOG(LOG_INFO, "Plugin_ExternalSocketCallback disconnect[%s]", proto->name);
       Plugin_t *plugin = (Plugin_t *) proto->user;
-      PluginSocket_clearWriteBuffers(plugin->externSocketInstance, 0);
-      SocketResponse_free(&plugin->externResponse);
-      plugin->externSocketInstance = NULL;
+      if (user)
+        SocketResponse_free((SocketResponse_t *) user);
+
+      //only detach if the plugin's tracked external client is the one closing
+      if (plugin->externSocketInstance == wsi) {
+        PluginSocket_clearWriteBuffers(plugin->externSocketInstance, 0);
+        plugin->externSocketInstance = NULL;
+      }
+      PluginSocket_closeWriteBuffers(wsi);
     }
       break;
 
@@ -312,6 +455,7 @@ struct lws_protocols Plugin_MakeExternalProtocol(Plugin_t *plugin) {
   proto.name = plugin->uuidShort;
   proto.callback = &Plugin_ExternalSocketCallback;
   proto.rx_buffer_size = PLUGIN_RX_BUFFER_SIZE;
+  proto.per_session_data_size = sizeof(SocketResponse_t);
   proto.user = (void *) plugin;
   return proto;
 }
@@ -326,14 +470,10 @@ char Plugin_Exists(Plugin_t *plugin) {
   if (!plugin) return 0;
 
   int cssCount = 0;
-  char **temp = PluginConf_GetCSS(plugin, &cssCount);
-  if (temp)
-    free(temp);
+  PluginConf_GetCSS(plugin, &cssCount);
 
   int jsCount = 0;
-  temp = PluginConf_GetJS(plugin, &jsCount);
-  if (temp)
-    free(temp);
+  PluginConf_GetJS(plugin, &jsCount);
 
 
   return (
@@ -347,10 +487,9 @@ char Plugin_Exists(Plugin_t *plugin) {
 */
 static void plugin_freeSettings(Plugin_t *plugin) {
 
-  if (plugin->config.table)
-    HashTable_destroy(plugin->config.table);
-
-  memset(&plugin->config, 0, sizeof(PluginConf_t));
+  PluginConf_Free(plugin);
+  //the bundle is made from the config
+  _pluginFreeBundle(plugin);
 }
 
 void Plugin_Free(Plugin_t *plugin, int freeContainer) {
@@ -368,11 +507,9 @@ void Plugin_Free(Plugin_t *plugin, int freeContainer) {
   if (plugin->name) free(plugin->name);
   plugin_freeSettings(plugin);
   Plugin_ClientFreeResponse(plugin);
-  SocketResponse_free(&plugin->externResponse);
 
   //free stored css attributes
-  if (plugin->cssAttr)
-    HashTable_destroy(plugin->cssAttr);
+  PluginCSS_free(plugin);
 
   memset(plugin, 0, sizeof(Plugin_t));
   if (freeContainer) free(plugin);
@@ -394,10 +531,13 @@ void Plugin_Free(Plugin_t *plugin, int freeContainer) {
     pluginName: refers to the folder inside the base plugin directory for a
                 specific plugin.
 
+  Plugin_Parse only touches the new plugin, so the plugin loader runs it on
+  several plugins at once. Plugin_Init also schedules the plugin if enabled.
+
   Returns:
     An instantiated plugin object
 */
-Plugin_t *Plugin_Init(const char *path, const char *pluginName) {
+Plugin_t *Plugin_Parse(const char *path, const char *pluginName) {
   //plugin folder must contain at least a script file
   //if no script file found, must have at least an html file
 
@@ -416,12 +556,12 @@ Plugin_t *Plugin_Init(const char *path, const char *pluginName) {
   strncpy(newPlugin->basePath, path, basePathSize);
   SYSLOG(LOG_INFO, "Plugin Init: base path: %s", newPlugin->basePath);
 
-  //load any saved settings for plugin
-  PluginCSS_load(newPlugin);
-
   //create plugin name
   if (Plugin_SetName(newPlugin, pluginName)) goto err;
 
+  //load any saved settings for plugin, the state store finds them by name
+  PluginCSS_load(newPlugin);
+
   //get plugin details from plugin config file
   if (Plugin_loadConfig(newPlugin)) {
     SYSLOG(LOG_ERR, "Plugin Conf: failed reading plugin config file...");
@@ -435,12 +575,6 @@ Plugin_t *Plugin_Init(const char *path, const char *pluginName) {
     goto err;
   }
 
-  //start scheduling if the plugin is enabled
-  if (Plugin_isEnabled(newPlugin)) {
-    Plugin_Enable(newPlugin);
-  }
-
-
   return newPlugin;
 
   err:
@@ -449,6 +583,20 @@ Plugin_t *Plugin_Init(const char *path, const char *pluginName) {
 
 }
 
+Plugin_t *Plugin_Init(const char *path, const char *pluginName) {
+
+  Plugin_t *newPlugin = Plugin_Parse(path, pluginName);
+  if (!newPlugin)
+    return NULL;
+
+  //start scheduling if the plugin is enabled
+  if (Plugin_isEnabled(newPlugin)) {
+    Plugin_Enable(newPlugin);
+  }
+
+  return newPlugin;
+}
+
 /*
  * Reload a plugin:
  *
@@ -459,8 +607,11 @@ Plugin_t *Plugin_Init(const char *path, const char *pluginName) {
  * 2. The plugin name, since its based on the directory.
  * 3. uuid values
  * 4. whether the plugin is running or not for scheduling
+ *
+ * Returns -1 if the plugin couldn't be reloaded. The plugin is still listed
+ * under its name, but may be left empty, so the caller should remove it.
  */
-void Plugin_Reload(Plugin_t *plugin) {
+int Plugin_Reload(Plugin_t *plugin) {
 
   char *newName = NULL, *newPath = NULL;
 
@@ -493,7 +644,7 @@ void Plugin_Reload(Plugin_t *plugin) {
 
   if (!newName) {
     SYSLOG(LOG_ERR, "Plugin_Reload: Error allocating space for old plugin name: %s", oldName);
-    goto _err;
+    return -1;
   }
 
   memcpy(newName, oldName, nameSize);
@@ -505,7 +656,8 @@ void Plugin_Reload(Plugin_t *plugin) {
   newPath = malloc(pathSize);
   if (!newPath) {
     SYSLOG(LOG_ERR, "Plugin_Reload: Error allocating space for old plugin path %s", oldPath);
-    goto _err;
+    free(newName);
+    return -1;
   }
 
   memcpy(newPath, oldPath, pathSize);
@@ -522,34 +674,30 @@ void Plugin_Reload(Plugin_t *plugin) {
   //update protocol details
   frontEndProto->name = Plugin_GetName(plugin);
   daemonProto->name = Plugin_GetDaemonProtocol(plugin);
+  plugin->channel = frontEndProto->id;
 
-  //start loading the rest of the plugin as normal
-  int pluginStarted = 1;
+  //start loading the rest of the plugin as normal, from here on the
+  //plugin owns newName and newPath and frees them itself
+
+  //Plugin_Free dropped the css table along with everything else
+  if (PluginCSS_init(plugin))
+    return -1;
+  PluginCSS_load(plugin);
 
   //reload details from the config file
   if (Plugin_loadConfig(plugin)) {
     SYSLOG(LOG_ERR, "Plugin Conf: failed reading plugin config file...");
-    goto _err;
+    return -1;
   }
 
   //check that the plugin actually has entries in the config file
-  if (!Plugin_Exists(plugin)) goto _err;
+  if (!Plugin_Exists(plugin)) return -1;
 
   //set plugin to render on load
   if (wasRunning)
     Plugin_Enable(plugin);
 
-
-  return;
-  //error handling / cleanup
-  _err:
-  if (newName) free(newName);
-  if (newPath) free(newPath);
-
-  //last case, ditch the plugin if something errors badly
-  if (pluginStarted) Plugin_Free(plugin, 1);
-
-  return;
+  return 0;
 }
 
 /*
@@ -594,16 +742,42 @@ char *Plugin_GetID(Plugin_t *plugin) {
 }
 
 
-int Plugin_SendMsg(Plugin_t *plugin, char *command, char *data) {
+static int sendMsg(Plugin_t *plugin, char *command, char *data, unsigned int tag) {
 
   if (!plugin->socketInstance) return -1;
 
   char *cmd = PluginComLib_makeMsg(command, data);
   if (!cmd) return -1;
 
+  //on a shared connection the message has to be re-framed with the plugin's channel
+  if (plugin->flags & PLUGIN_FLAG_MUXED) {
+    char *msg = cmd + LWS_SEND_BUFFER_PRE_PADDING;
+    int status = PluginMux_Write(plugin->socketInstance, plugin->channel, msg, strlen(msg), tag);
+    free(cmd);
+    return status;
+  }
+
   //PluginComLib_makeMsg creates a message with the LWS padding, use noHeader flag
   //for writing, and it (cmd) will get free'd after its written
-  return PluginSocket_writeToSocket(plugin->socketInstance, cmd, -1, 1);
+  return PluginSocket_writeTagged(plugin->socketInstance, cmd, -1, 1, tag);
+}
+
+int Plugin_SendMsg(Plugin_t *plugin, char *command, char *data) {
+
+  return sendMsg(plugin, command, data, 0);
+}
+
+/*
+ * Send an already formatted message to a plugin's frontend as is.
+ */
+int Plugin_SendRaw(Plugin_t *plugin, char *msg, size_t len) {
+
+  if (!plugin->socketInstance) return -1;
+
+  if (plugin->flags & PLUGIN_FLAG_MUXED)
+    return PluginMux_Write(plugin->socketInstance, plugin->channel, msg, len, 0);
+
+  return PluginSocket_writeToSocket(plugin->socketInstance, msg, len, 0);
 }
 
 
@@ -661,7 +835,6 @@ void Plugin_Disable(Plugin_t *plugin) {
   if (!Plugin_isEnabled(plugin)) return;
   //free some disposable memory
   Plugin_ClientFreeResponse(plugin);
-  SocketResponse_free(&plugin->externResponse);
   //remove plugin from scheduler
   Plugin_StopSchedule(plugin);
   PLUGIN_SET_DISABLED(plugin);
@@ -698,179 +871,256 @@ int Plugin_isConnected(Plugin_t *plugin) {
 }
 
 
-static char *_pluginLoadHTML(Plugin_t *plugin) {
+static char *_pluginLoadHTML(const char *filepath, size_t size) {
 
-  char *filepath = PluginConf_GetHTML(plugin);
-  if (!filepath)
-    return NULL;
-
-
-  FILE *file = fopen(filepath, "r");
-  if (!file) {
+  int fd = open(filepath, O_RDONLY);
+  if (fd < 0) {
     SYSLOG(LOG_ERR, "_pluginLoadHTML: Failed opening html file: %s", filepath);
     return NULL;
   }
-  SYSLOG(LOG_INFO, "_pluginLoadHTML: Reading in html file");
-  size_t dataSize = 0;
-  char *data = NULL;
 
-  //read 4kb of data at a time
-  char buffer[4 * 1024];
+  char *data = malloc(size + 1);
+  if (!data) {
+    SYSLOG(LOG_ERR, "_pluginLoadHTML: Failed allocating memory for html file\n");
+    close(fd);
+    return NULL;
+  }
 
+  //the file is read whole, up to the size it was stat'ed at
   size_t dataRead = 0;
-  int firstAlloc = 0;
-
-  while (!feof(file)) {
-    SYSLOG(LOG_INFO, "Doing read");
-    memset(buffer, 0, sizeof(buffer));
-    size_t curRead = fread(buffer, 1, sizeof(buffer), file);
-    if (!curRead)
+  while (dataRead < size) {
+    ssize_t curRead = read(fd, data + dataRead, size - dataRead);
+    if (curRead < 0 && errno == EINTR)
+      continue;
+    if (curRead <= 0)
       break;
 
     dataRead += curRead;
-
-    if (dataRead > dataSize) {
-      SYSLOG(LOG_INFO, "Reallocating");
-      if (!data) {
-        dataSize = dataRead + 1;
-        firstAlloc++;
-      } else
-        dataSize *= 2;
-
-      char *temp = realloc(data, dataSize);
-      if (!temp) {
-        SYSLOG(LOG_ERR, "_pluginLoadHTML: Failed allocating memory for html file\n");
-        fclose(file);
-        return NULL;
-      }
-      SYSLOG(LOG_INFO, "Realloc'd");
-
-      data = temp;
-      //check if this is first allocation
-      if (firstAlloc) {
-        data[0] = '\0';
-        firstAlloc = 0;
-      }
-
-    }
-
-    SYSLOG(LOG_INFO, "StrCat");
-    strcat(data, buffer);
   }
+  close(fd);
 
-  SYSLOG(LOG_INFO, "Closing file");
-  //all file in memory now
-  fclose(file);
+  data[dataRead] = '\0';
   return data;
 }
 
-/*
- * Tells the front end to load a plugin's
- * css and javascript file, as well as
- * sending any html data that needs to be loaded.
- */
-void Plugin_LoadFrontend(Plugin_t *plugin) {    //load some data
+static void _pluginFreeBundle(Plugin_t *plugin) {
 
-  if (!Plugin_isEnabled(plugin))
-    return;
+  //loads still queued hold their own reference
+  Protocol_releaseShared(plugin->bundle.buffer);
+  memset(&plugin->bundle, 0, sizeof(PluginBundle_t));
+}
 
-  SYSLOG(LOG_INFO, "Plugin_LoadFrontend: preparing to send frontend data");
+/*
+ * The "load" command's data: the plugin's css and js files, main object
+ * and saved css, as json. Free the string when done.
+ */
+static char *_pluginLoadString(Plugin_t *plugin) {
 
   char *mainClass = PluginConf_GetJSMain(plugin);
 
   int cssCount = 0;
-  char **cssPaths = PluginConf_GetCSS(plugin, &cssCount);
+  char *const *cssPaths = PluginConf_GetCSS(plugin, &cssCount);
 
   int jsCount = 0;
-  char **jsPaths = PluginConf_GetJS(plugin, &jsCount);
-
-  SYSLOG(LOG_INFO, "Plugin_LoadFrontend: %d js files", jsCount);
-  SYSLOG(LOG_INFO, "Plugin_LoadFrontend: %d css files", cssCount);
+  char *const *jsPaths = PluginConf_GetJS(plugin, &jsCount);
 
-  char *loadStr = NULL;
-  size_t loadStrSize = 1;
+  SYSLOG(LOG_INFO, "_pluginLoadString: %d js files", jsCount);
+  SYSLOG(LOG_INFO, "_pluginLoadString: %d css files", cssCount);
 
-  //calculate a preliminary size for the load string
-  loadStrSize += sstrlen(mainClass);
+  //saved css goes along, so the plugin is placed before its files even load
+  char *style = PluginCSS_serialize(plugin);
 
+  //each path is quoted and followed by a comma
+  size_t loadStrSize = sstrlen(mainClass) + 1;
   int i = 0;
   for (i = 0; i < cssCount; i++)
-    loadStrSize += sstrlen(cssPaths[i]);
-
-
-
-  //add the commas and quotes for each css file
-  loadStrSize += sstrlen(",\"\"") * cssCount;
+    loadStrSize += sstrlen(cssPaths[i]) + sstrlen(",\"\"");
 
   for (i = 0; i < jsCount; i++)
-    loadStrSize += sstrlen(jsPaths[i]);
+    loadStrSize += sstrlen(jsPaths[i]) + sstrlen(",\"\"");
 
-  //add comma and quotes for each js file
-  loadStrSize += sstrlen(",\"\"") * jsCount;
+  //style is escaped, which at most doubles it
+  loadStrSize += sstrlen(style) * 2;
 
   //now fine tune the size with the extra symbols
   loadStrSize += 128;
 
-  //now allocate the memory
-  SYSLOG(LOG_INFO, "Plugin_LoadFrontend: allocating load string %zu", loadStrSize);
-  loadStr = calloc(loadStrSize, sizeof(char));
+  SYSLOG(LOG_INFO, "_pluginLoadString: allocating load string %zu", loadStrSize);
+  char *loadStr = malloc(loadStrSize);
   if (!loadStr) {
-    SYSLOG(LOG_ERR, "Plugin_LoadFrontend: Error allocating load string space");
-    goto _cleanup;
+    SYSLOG(LOG_ERR, "_pluginLoadString: Error allocating load string space");
+    free(style);
+    return NULL;
   }
 
-  strcpy(loadStr, "{\"css\":[");
+  char *pos = stpcpy(loadStr, "{\"css\":[");
   for (i = 0; i < cssCount; i++) {
-    strcat(loadStr, "\"");
-    strcat(loadStr, cssPaths[i]);
-    if (i < cssCount - 1)
-      strcat(loadStr, "\",");
-    else
-      strcat(loadStr, "\"");
+    pos = stpcpy(pos, (i > 0) ? ",\"" : "\"");
+    pos = stpcpy(pos, cssPaths[i]);
+    pos = stpcpy(pos, "\"");
   }
 
-
-  strcat(loadStr, "],\"js\":[");
+  pos = stpcpy(pos, "],\"js\":[");
   for (i = 0; i < jsCount; i++) {
-    strcat(loadStr, "\"");
-    strcat(loadStr, jsPaths[i]);
-    if (i < jsCount - 1)
-      strcat(loadStr, "\",");
-    else
-      strcat(loadStr, "\"");
+    pos = stpcpy(pos, (i > 0) ? ",\"" : "\"");
+    pos = stpcpy(pos, jsPaths[i]);
+    pos = stpcpy(pos, "\"");
   }
+  pos = stpcpy(pos, "]");
 
+  if (mainClass) {
+    pos = stpcpy(pos, ",\"main\":\"");
+    pos = stpcpy(pos, mainClass);
+    pos = stpcpy(pos, "\"");
+  }
 
-  strcat(loadStr, "]");
+  if (style) {
+    pos = stpcpy(pos, ",\"style\":\"");
+    pos += PluginComLib_escape(pos, style);
+    pos = stpcpy(pos, "\"");
+  }
+  stpcpy(pos, "}");
 
-  if (mainClass) {
-    strcat(loadStr, ",\"main\":\"");
-    strcat(loadStr, mainClass);
-    strcat(loadStr, "\"");
+  free(style);
+  return loadStr;
+}
+
+/*
+ * Copy a message made by PluginComLib_makeMsg into the bundle at pos, behind
+ * the mux header if there is one. Returns the length of the framed message.
+ */
+static size_t _pluginBundleCopy(unsigned char *pos, char *header, size_t headerLen, char *msg, size_t msgLen) {
+
+  pos += LWS_SEND_BUFFER_PRE_PADDING;
+  memcpy(pos, header, headerLen);
+  memcpy(pos + headerLen, msg + LWS_SEND_BUFFER_PRE_PADDING, msgLen);
+  return headerLen + msgLen;
+}
+
+/*
+ * Build the plugin's bundle, see PluginBundle_t. htmlStat is the html
+ * file's, or NULL if the plugin has none.
+ */
+static int _pluginBuildBundle(Plugin_t *plugin, struct stat *htmlStat) {
+
+  _pluginFreeBundle(plugin);
+
+  char *loadStr = _pluginLoadString(plugin);
+  if (!loadStr)
+    return -1;
+
+  char *loadMsg = PluginComLib_makeMsg("load", loadStr);
+  free(loadStr);
+  if (!loadMsg)
+    return -1;
+
+  char *htmlMsg = NULL;
+  if (htmlStat) {
+    SYSLOG(LOG_INFO, "_pluginBuildBundle: Reading in html file");
+    char *html = _pluginLoadHTML(PluginConf_GetHTML(plugin), htmlStat->st_size);
+    if (html) {
+      htmlMsg = PluginComLib_makeMsg("innerdiv", html);
+      free(html);
+    }
   }
-  strcat(loadStr, "}");
 
+  //muxed plugins have their channel header baked in
+  char header[PLUGIN_MUX_HEADER_MAX];
+  size_t headerLen = 0;
+  unsigned int channel = 0;
+  if (plugin->flags & PLUGIN_FLAG_MUXED) {
+    channel = plugin->channel;
+    headerLen = PluginMux_Header(header, channel);
+  }
 
-  //send the js and css files to load
-  //SYSLOG(LOG_INFO, "Sending %s to browser", loadStr);
-  Plugin_SendMsg(plugin, "load", loadStr);
+  size_t loadMsgLen = strlen(loadMsg + LWS_SEND_BUFFER_PRE_PADDING);
+  size_t htmlMsgLen = htmlMsg ? strlen(htmlMsg + LWS_SEND_BUFFER_PRE_PADDING) : 0;
 
+  size_t htmlOffset = LWS_SEND_BUFFER_PRE_PADDING + headerLen + loadMsgLen;
+  size_t size = htmlOffset;
+  if (htmlMsg)
+    size += LWS_SEND_BUFFER_PRE_PADDING + headerLen + htmlMsgLen;
 
-  char *html = _pluginLoadHTML(plugin);
-  //send html first
-  if (html) {
-    //SYSLOG(LOG_INFO, "HTML TO SEND: %s", html);
-    Plugin_SendMsg(plugin, "innerdiv", html);
-    free(html);
-    html = NULL;
+  SharedWrite_t *buffer = Protocol_newShared(size);
+  if (!buffer) {
+    free(loadMsg);
+    free(htmlMsg);
+    return -1;
   }
 
-  _cleanup:
-  if (loadStr) free(loadStr);
-  if (jsPaths) free(jsPaths);
-  if (cssPaths) free(cssPaths);
+  PluginBundle_t *bundle = &plugin->bundle;
+  bundle->buffer = buffer;
+  bundle->channel = channel;
+  bundle->loadLen = _pluginBundleCopy(buffer->data, header, headerLen, loadMsg, loadMsgLen);
+  if (htmlMsg) {
+    bundle->htmlOffset = htmlOffset;
+    bundle->htmlLen = _pluginBundleCopy(buffer->data + htmlOffset, header, headerLen, htmlMsg, htmlMsgLen);
+  }
 
-  return;
+  if (htmlStat) {
+    bundle->hasHTML = 1;
+    bundle->htmlIno = htmlStat->st_ino;
+    bundle->htmlSize = htmlStat->st_size;
+    bundle->htmlMtime = htmlStat->st_mtim;
+  }
+
+  free(loadMsg);
+  free(htmlMsg);
+  return 0;
+}
+
+/*
+ * Get the plugin's bundle, only building it again if the plugin moved
+ * to or from the mux, or its html file changed since it was built.
+ *
+ * The html file is checked with a stat on each load rather than through
+ * PluginWatch: its inotify watches only act on plugin.conf at the top of
+ * each plugin folder, html-path can point into a subfolder, and without
+ * inotify there are no events at all.
+ */
+static PluginBundle_t *_pluginGetBundle(Plugin_t *plugin) {
+
+  char *filepath = PluginConf_GetHTML(plugin);
+  struct stat st;
+  int hasHTML = (filepath && !stat(filepath, &st));
+  if (filepath && !hasHTML)
+    SYSLOG(LOG_ERR, "_pluginGetBundle: Failed opening html file: %s", filepath);
+
+  unsigned int channel = (plugin->flags & PLUGIN_FLAG_MUXED) ? plugin->channel : 0;
+
+  PluginBundle_t *bundle = &plugin->bundle;
+  if (bundle->buffer && bundle->channel == channel && bundle->hasHTML == hasHTML &&
+      (!hasHTML || (bundle->htmlIno == st.st_ino && bundle->htmlSize == st.st_size &&
+                    bundle->htmlMtime.tv_sec == st.st_mtim.tv_sec &&
+                    bundle->htmlMtime.tv_nsec == st.st_mtim.tv_nsec)))
+    return bundle;
+
+  if (_pluginBuildBundle(plugin, hasHTML ? &st : NULL))
+    return NULL;
+
+  return bundle;
+}
+
+/*
+ * Tells the front end to load a plugin's
+ * css and javascript file, as well as
+ * sending any html data that needs to be loaded.
+ */
+void Plugin_LoadFrontend(Plugin_t *plugin) {    //load some data
+
+  if (!Plugin_isEnabled(plugin) || !plugin->socketInstance)
+    return;
+
+  SYSLOG(LOG_INFO, "Plugin_LoadFrontend: preparing to send frontend data");
+
+  PluginBundle_t *bundle = _pluginGetBundle(plugin);
+  if (!bundle)
+    return;
+
+  //send the js and css files to load, then the html
+  PluginSocket_writeShared(plugin->socketInstance, bundle->buffer, 0, bundle->loadLen);
+  if (bundle->htmlLen)
+    PluginSocket_writeShared(plugin->socketInstance, bundle->buffer, bundle->htmlOffset, bundle->htmlLen);
 }
 
 /*
@@ -886,11 +1136,79 @@ void Plugin_UnloadFrontend(Plugin_t *plugin) {
 /*=======================================================================================
  * Plugin CSS attribute storage
 =======================================================================================*/
+/*
+ * Attributes and their values live in a per-plugin arena. Replaced values
+ * stay behind in the arena, so once it has grown well past what the table
+ * still uses, the table is copied into a fresh arena.
+ */
+int PluginCSS_init(Plugin_t *plugin) {
+
+  plugin->cssArena = Arena_init(CSS_ARENA_BLOCK);
+  if (!plugin->cssArena)
+    return -1;
+
+  plugin->cssAttr = HashTable_initArena(CSS_HASH_INIT_SIZE, plugin->cssArena);
+  if (!plugin->cssAttr) {
+    PluginCSS_free(plugin);
+    return -1;
+  }
+
+  plugin->cssCompactAt = CSS_ARENA_COMPACT_MIN;
+  return 0;
+}
+
+void PluginCSS_free(Plugin_t *plugin) {
+
+  _pluginFreeBundle(plugin);
+
+  if (plugin->cssAttr)
+    HashTable_destroy(plugin->cssAttr);
+  Arena_destroy(plugin->cssArena);
+
+  plugin->cssAttr = NULL;
+  plugin->cssArena = NULL;
+}
+
+static void pluginCSS_compact(Plugin_t *plugin) {
+
+  HashTable_t *oldTable = plugin->cssAttr;
+  Arena_t *oldArena = plugin->cssArena;
+
+  if (PluginCSS_init(plugin)) {
+    plugin->cssAttr = oldTable;
+    plugin->cssArena = oldArena;
+    return;
+  }
+
+  size_t i = 0;
+  for (i = 0; i < oldTable->size; i++) {
+    HashData_t *entry = oldTable->entries[i];
+    if (entry && !HashTable_set(plugin->cssAttr, entry->key, entry->value)) {
+      //keep the old table rather than lose attributes
+      PluginCSS_free(plugin);
+      plugin->cssAttr = oldTable;
+      plugin->cssArena = oldArena;
+      return;
+    }
+  }
+
+  HashTable_destroy(oldTable);
+  Arena_destroy(oldArena);
+
+  size_t used = Arena_getUsed(plugin->cssArena);
+  if (used * 4 > plugin->cssCompactAt)
+    plugin->cssCompactAt = used * 4;
+
+  SYSLOG(LOG_INFO, "PluginCSS_compact: %s css arena down to %zu bytes", Plugin_GetName(plugin), used);
+}
+
 //Any css sent through the main API will get parsed through here and stored into
 //a hash table for saving
 void PluginCSS_store(Plugin_t *plugin, char *cssValString) {
   //cssValString will be in the form of a <cssattr>=<value>;...
   SYSLOG(LOG_INFO, "Storing CSS: %s", cssValString);
+  //the bundle's load message carries the css
+  _pluginFreeBundle(plugin);
   char *cssSetting = strtok(cssValString, ";");
   do {
 
@@ -903,10 +1221,9 @@ void PluginCSS_store(Plugin_t *plugin, char *cssValString) {
         char *attr = cssSetting;
         char *value = separator + 1;
 
-        if (attr && value && attr[0] != '\0' && value[0] != '\0') {
-          HashData_t *data = HashData_create(attr, value);
-          HashTable_add(plugin->cssAttr, data);
-        }
+        //an empty value clears the style, which the display takes as NULL
+        if (attr && value && attr[0] != '\0')
+          HashTable_set(plugin->cssAttr, attr, (value[0] != '\0') ? value : PLUGIN_CSS_CLEAR);
       }
     }
 
@@ -914,11 +1231,54 @@ void PluginCSS_store(Plugin_t *plugin, char *cssValString) {
     cssSetting = strtok(NULL, ";");
   } while (cssSetting);
 
+  if (Arena_getUsed(plugin->cssArena) > plugin->cssCompactAt)
+    pluginCSS_compact(plugin);
+
+}
+
+/*
+ * Store css set through the API, to be sent to the display by the next
+ * PluginCSS_flush. Attributes set again before then only send their
+ * latest value.
+ */
+void PluginCSS_queue(Plugin_t *plugin, char *cssValString) {
+
+  PluginCSS_store(plugin, cssValString);
+  plugin->flags |= PLUGIN_FLAG_CSS_DIRTY;
+}
+
+/*
+ * Send the css queued for a plugin as a single setcss message. The message
+ * carries the whole table, so it replaces any earlier one the display
+ * hasn't been sent yet rather than queueing behind it.
+ */
+int PluginCSS_flush(Plugin_t *plugin) {
+
+  if (!(plugin->flags & PLUGIN_FLAG_CSS_DIRTY))
+    return 0;
+
+  plugin->flags &= ~PLUGIN_FLAG_CSS_DIRTY;
+
+  //a plugin without a frontend gets its css with the next load
+  if (!plugin->socketInstance)
+    return 0;
+
+  char *css = PluginCSS_serialize(plugin);
+  if (!css)
+    return 0;
+
+  //the web protocol's handle is unique to the plugin, even on a shared mux queue
+  int status = sendMsg(plugin, "setcss", css, plugin->channel);
+  free(css);
+  return status;
 }
 
 void PluginCSS_dump(Plugin_t *plugin) {
 
+  if (!PluginState_SaveCSS(plugin))
+    return;
 
+  //without a state store, fall back to the plugin's own file
   char filepath[PATH_MAX];
   snprintf(filepath, PATH_MAX, PLUGIN_SAVED_CSS_LOCATION, Plugin_GetDirectory(plugin));
 
@@ -933,8 +1293,17 @@ void PluginCSS_dump(Plugin_t *plugin) {
   fclose(dumpFile);
 }
 
+/*
+ * Saved css comes from the state store. A plugin the store doesn't know yet
+ * has its position.txt read instead and is then added to the store, so the
+ * file is only read the first time.
+ */
 void PluginCSS_load(Plugin_t *plugin) {
 
+  _pluginFreeBundle(plugin);
+  if (!PluginState_LoadCSS(plugin))
+    return;
+
   //generate path for saved css settings
   char filepath[PATH_MAX];
   snprintf(filepath, PATH_MAX, PLUGIN_SAVED_CSS_LOCATION, Plugin_GetDirectory(plugin));
@@ -942,6 +1311,7 @@ void PluginCSS_load(Plugin_t *plugin) {
   FILE *dumpFile = fopen(filepath, "r");
   if (!dumpFile) {
     SYSLOG(LOG_ERR, "PluginCSS_load: Error opening input file: %s", filepath);
+    PluginState_SaveCSS(plugin);
     return;
   }
 
@@ -973,44 +1343,49 @@ void PluginCSS_load(Plugin_t *plugin) {
     char *value = separator + 1;
 
     if (attr && value) {
-      HashData_t *data = HashData_create(attr, value);
       SYSLOG(LOG_INFO, "CSS loading: %s=%s", attr, value);
-      HashTable_add(plugin->cssAttr, data);
+      HashTable_set(plugin->cssAttr, attr, value);
     }
 
   }
 
   //close input file
   fclose(dumpFile);
+  PluginState_SaveCSS(plugin);
 }
 
-int PluginCSS_sendAll(Plugin_t *plugin) {
-
-  SYSLOG(LOG_INFO, "PluginCSS_sendSaved: Sending saved CSS");
-  if (!plugin->cssAttr) {
-    SYSLOG(LOG_INFO, "PluginCSS_sendSaved: No CSS to send!");
-    return 0;
-  }
-
+/*
+ * All of a plugin's saved css as one setcss string, "attr=value;...", or NULL
+ * if it has none. Free the string when done.
+ */
+char *PluginCSS_serialize(Plugin_t *plugin) {
 
-  char buf[PATH_MAX];
   HashTable_t *table = plugin->cssAttr;
+  if (!table || !table->count)
+    return NULL;
 
-  int entryIndex = 0;
-  //skip empty entries
-  while (entryIndex < table->size) {
+  size_t len = 1, i = 0;
+  for (i = 0; i < table->size; i++) {
+    HashData_t *entry = table->entries[i];
+    if (entry && entry->key && entry->value)
+      len += strlen(entry->key) + strlen(entry->value) + 2;
+  }
 
-    HashData_t *entry = table->entries[entryIndex];
+  char *css = malloc(len);
+  if (!css) {
+    SYSLOG(LOG_ERR, "PluginCSS_serialize: Error allocating %zu bytes", len);
+    return NULL;
+  }
 
-    if (entry && entry->key && entry->value) {
-      snprintf(buf, PATH_MAX, "%s=%s;", entry->key, entry->value);
-      SYSLOG(LOG_INFO, "PluginCSS_sendSaved: %s", buf);
-      Plugin_SendMsg(plugin, "setcss", buf);
-    }
-    entryIndex++;
+  char *pos = css;
+  for (i = 0; i < table->size; i++) {
+    HashData_t *entry = table->entries[i];
+    if (entry && entry->key && entry->value)
+      pos += sprintf(pos, "%s=%s;", entry->key, entry->value);
   }
 
-  return 0;
+  SYSLOG(LOG_INFO, "PluginCSS_serialize: %s", css);
+  return css;
 }
 
 
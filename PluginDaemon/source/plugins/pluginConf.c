@@ -4,24 +4,27 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <syslog.h>
 #include <limits.h>
+#include <string.h>
+#include <ctype.h>
 #include "plugin.h"
 #include "configReader.h"
 #include "misc.h"
+#include "configWriter.h"
 
 #define PLUGIN_CONF_FILE "/" PLUGIN_CONF_FILENAME
 #define PLUGIN_CONF_OUT "/" PLUGIN_CONF_OUTFILE
 
 #define PLUGIN_CONF_HASH_SIZE 13
+//a typical plugin.conf, applied and original settings together, fits in one block
+#define PLUGIN_CONF_ARENA_BLOCK 4096
 
 //Used for tagging original read settings in hash table keys
 #define PLUGIN_CONF_ORIGTAG "[r]"
 #define PLUGIN_CONF_TAG_DELIM ':'
 
-#define PLUGIN_CONF_MAX_PATHLIST 128
-static char *pathList[128];
-
 typedef enum {
     TYPE_NOTPATH = 0,
     TYPE_FILEPATH,
@@ -29,276 +32,437 @@ typedef enum {
 } ConfigPropertyType_e;
 
 
-static char *configGetString(Plugin_t *plugin, char *setting) {
+//returned for multi-valued settings that have no values
+static char *const emptyList[] = {NULL};
 
-  HashData_t *entry = HashTable_find(plugin->config.table, setting);
-  if (!entry)
-    return NULL;
+/*
+ * Multi-valued settings are keys ending in ':' and an index, eg. js-path:0.
+ * Sets the length of the key up to and including the ':', and the index.
+ */
+static int multiValueKey(const char *key, size_t *prefixLen, int *index) {
+
+  const char *delim = strrchr(key, PLUGIN_CONF_TAG_DELIM);
+  if (!delim || !isdigit((unsigned char) delim[1]))
+    return 0;
 
-  return entry->value;
+  const char *digit = delim + 1;
+  while (isdigit((unsigned char) *digit))
+    digit++;
+
+  if (*digit != '\0')
+    return 0;
+
+  *prefixLen = (size_t) (delim - key) + 1;
+  *index = atoi(delim + 1);
+  return 1;
 }
 
-//For settings that might have multiple definitions, need to do partial key search
-//and return list of results
-static char **configGetAllStrings(Plugin_t *plugin, char *partialKey, int *count) {
+static PluginConfList_t *findList(PluginConf_t *config, const char *prefix, size_t prefixLen) {
 
-  HashTable_t *table = plugin->config.table;
-  if (!table || !table->entries)
+  size_t i = 0;
+  for (i = 0; i < config->listCount; i++) {
+    PluginConfList_t *list = &config->lists[i];
+    if (!strncmp(list->prefix, prefix, prefixLen) && list->prefix[prefixLen] == '\0')
+      return list;
+  }
+
+  return NULL;
+}
+
+static PluginConfList_t *addList(PluginConf_t *config, const char *prefix, size_t prefixLen) {
+
+  PluginConfList_t *lists = realloc(config->lists, (config->listCount + 1) * sizeof(PluginConfList_t));
+  if (!lists)
     return NULL;
 
+  config->lists = lists;
 
-  SYSLOG(LOG_INFO, "CONFIG PARTIAL MATCHING: %s", partialKey);
+  PluginConfList_t *list = &lists[config->listCount];
+  memset(list, 0, sizeof(PluginConfList_t));
+  list->prefix = Arena_internLen(config->arena, prefix, prefixLen);
+  if (!list->prefix)
+    return NULL;
 
-  int curCount = 0;
-  //loop through all symbol table entries
-  size_t i = 0;
-  for (i = 0; i < table->size; i++) {
+  config->listCount++;
+  return list;
+}
 
-    //skip empty entries
-    if (!table->entries[i])
-      continue;
+/*
+ * Keep a multi-valued setting's list in index order as its
+ * values are added to (or replaced in) the config table.
+ */
+static int indexValue(PluginConf_t *config, const char *key, char *value) {
 
-    //skip entries where key may not be set (malformed entries)
-    HashData_t *entry = table->entries[i];
-    if (!entry->key)
-      continue;
+  size_t prefixLen = 0;
+  int index = 0;
+  if (!multiValueKey(key, &prefixLen, &index))
+    return 0;
 
-    SYSLOG(LOG_INFO, "Comparing %s to %s", entry->key, partialKey);
-    if (!strncmp(entry->key, partialKey, strlen(partialKey))) {
-      //entry has been found
-      SYSLOG(LOG_INFO, "Partial match made: %s", entry->value);
-      pathList[curCount] = entry->value;
-      curCount++;
-    }
+  PluginConfList_t *list = findList(config, key, prefixLen);
+  if (!list)
+    list = addList(config, key, prefixLen);
+  if (!list) {
+    SYSLOG(LOG_ERR, "Plugin Conf: Error allocating value list for %s", key);
+    return -1;
   }
 
-  //set the entry in the list after the last item as null
-  pathList[curCount] = NULL;
+  //values mostly arrive in index order, so search from the end
+  size_t pos = list->count;
+  while (pos > 0 && list->order[pos - 1] > index)
+    pos--;
 
-  char **newPathList = calloc(1, sizeof(char *) * curCount);
-  if (!newPathList) {
-    SYSLOG(LOG_ERR, "Config Path Listing failed to allocate.");
-    return NULL;
+  //same index given again, the table already replaced the old value
+  if (pos > 0 && list->order[pos - 1] == index) {
+    list->values[pos - 1] = value;
+    return 0;
   }
 
-  for (i = 0; i < curCount; i++)
-    newPathList[i] = pathList[i];
+  //room for the new value and the NULL terminator
+  if (list->count + 2 > list->size) {
+    size_t newSize = list->size ? list->size * 2 : 4;
+    int *order = realloc(list->order, newSize * sizeof(int));
+    if (!order)
+      return -1;
+    list->order = order;
+
+    char **values = realloc(list->values, newSize * sizeof(char *));
+    if (!values)
+      return -1;
+    list->values = values;
+
+    list->size = newSize;
+  }
+
+  memmove(&list->order[pos + 1], &list->order[pos], (list->count - pos) * sizeof(int));
+  memmove(&list->values[pos + 1], &list->values[pos], (list->count - pos) * sizeof(char *));
+  list->order[pos] = index;
+  list->values[pos] = value;
+  list->count++;
+  list->values[list->count] = NULL;
+  return 0;
+}
 
+//set a config value, keeping the multi-valued lists up to date
+static int configSet(Plugin_t *plugin, char *key, char *value) {
+
+  HashData_t **position = HashTable_set(plugin->config.table, key, value);
+  if (!position) {
+    SYSLOG(LOG_ERR, "Plugin Conf: Failed adding config option to hash: %s:%s", key, value);
+    return -1;
+  }
+
+  return indexValue(&plugin->config, (*position)->key, (*position)->value);
+}
+
+/*
+ * Settings that might have multiple definitions are kept in lists, so the
+ * values are borrowed straight from there; nothing to free afterwards.
+ */
+static char *const *configGetAllStrings(Plugin_t *plugin, char *prefix, int *count) {
+
+  PluginConfList_t *list = findList(&plugin->config, prefix, strlen(prefix));
 
-  //return count
   if (count)
-    *count = curCount;
+    *count = list ? (int) list->count : 0;
 
-  //and list
-  return newPathList;
+  return list ? list->values : emptyList;
 }
 
-static char *makeAbsPath(Plugin_t *plugin, char *path) {
+//write the absolute version of path into absPath, which holds PATH_MAX characters
+static int makeAbsPath(Plugin_t *plugin, char *path, char *absPath) {
 
   SYSLOG(LOG_INFO, "makeAbsPath: original path: %s", path);
   if (!plugin || !path) {
     SYSLOG(LOG_ERR, "makeAbsPath: No path or plugin provided");
-    return NULL;
+    return -1;
   }
 
-  //first check if path is already absolute
-  int isRelPath = (*path != '/');
+  int written = 0;
+  //relative paths are relative to the plugin directory
+  if (*path != '/')
+    written = snprintf(absPath, PATH_MAX, "%s/%s", Plugin_GetDirectory(plugin), path);
+  else
+    written = snprintf(absPath, PATH_MAX, "%s", path);
 
+  if (written < 0 || written >= PATH_MAX) {
+    SYSLOG(LOG_ERR, "makeAbsPath: Path too long %s", path);
+    return -1;
+  }
 
-  //otherwise, make path absolute
-  char *dir = Plugin_GetDirectory(plugin);
+  SYSLOG(LOG_INFO, "makeAbsPath: Created path %s", absPath);
+  return 0;
+}
 
-  size_t pathLen = strlen(path) + 1;
 
-  //if relative path, add the root dir and divider
-  if (isRelPath)
-    pathLen += strlen(dir) + strlen("/");
+/*
+ * Known settings are described by a schema entry: its key, what kind of
+ * value it takes, the parser that applies it and, for settings kept in a
+ * typed PluginConf_t field, the field's offset.
+ */
+typedef struct PluginConfSchema_s PluginConfSchema_t;
 
-  char *absPath = calloc(pathLen + 1, sizeof(char));
-  if (!absPath) {
-    SYSLOG(LOG_ERR, "makeAbsPath: Error allocating memory for path %s", path);
-    return NULL;
-  }
+typedef int (*SchemaParser_f)(Plugin_t *plugin, const PluginConfSchema_t *schema, char *property, char *value);
 
-  //copy path over
-  if (isRelPath)
-    snprintf(absPath, pathLen, "%s/%s", dir, path);
-  else
-    strncpy(absPath, path, pathLen);
+struct PluginConfSchema_s {
+    const char *key;
+    size_t len;
+    ConfigPropertyType_e type;
+    SchemaParser_f parse;
+    size_t field;
+};
 
-  SYSLOG(LOG_INFO, "makeAbsPath: Created path %s", absPath);
-  return absPath;
+#define SCHEMA_FIELD(name) offsetof(PluginConf_t, name)
+#define SCHEMA_NO_FIELD 0
+
+static char **schemaString(Plugin_t *plugin, const PluginConfSchema_t *schema) {
+
+  return (char **) ((char *) &plugin->config + schema->field);
 }
 
+static int *schemaInt(Plugin_t *plugin, const PluginConfSchema_t *schema) {
 
-static ConfigPropertyType_e getKnownSettingType(char *property) {
+  return (int *) ((char *) &plugin->config + schema->field);
+}
 
-  ConfigPropertyType_e type = TYPE_NOTPATH;
-  //element it coresponds to.
-  if (!strncmp(property, PLUGIN_CONF_TAG_HTML, strlen(property))) {
-    type = TYPE_FILEPATH;
-  }
-  else if (!strncmp(property, PLUGIN_CONF_TAG_SCRIPT, strlen(property))) {
-    type = TYPE_SCRIPTPATH;
-  }
-    //webgui property is a file path that needs to be escaped
-  else if (!strncmp(property, PLUGIN_CONF_WEBGUI, strlen(property))) {
-    type = TYPE_FILEPATH;
-  }
-    //these two settings can have multiple values assigne dto them
-  else if (!strncmp(property, PLUGIN_CONF_TAG_JS, strlen(PLUGIN_CONF_TAG_JS))) {
-    type = TYPE_FILEPATH;
-  }
-  else if (!strncmp(property, PLUGIN_CONF_TAG_CSS, strlen(PLUGIN_CONF_TAG_CSS))) {
-    type = TYPE_FILEPATH;
+/*
+ * (SchemaParser_f) callback function.
+ * Single valued strings, file paths made absolute and script paths
+ * made absolute along with an escaped copy for the shell.
+ */
+static int parseString(Plugin_t *plugin, const PluginConfSchema_t *schema, char *property, char *value) {
+
+  //paths are built on the stack, the arena interns its own copy
+  char absPath[PATH_MAX];
+  if (schema->type != TYPE_NOTPATH) {
+    if (makeAbsPath(plugin, value, absPath))
+      return -1;
+    value = absPath;
   }
 
-  return type;
+  char *str = Arena_intern(plugin->config.arena, value);
+  if (!str)
+    return -1;
+
+  *schemaString(plugin, schema) = str;
+  if (schema->type != TYPE_SCRIPTPATH)
+    return 0;
+
+  char escaped[PATH_MAX * 2];
+  if (!ConfigReader_escapePathTo(absPath, escaped, sizeof(escaped)))
+    plugin->config.scriptEscaped = Arena_intern(plugin->config.arena, escaped);
+
+  return 0;
 }
 
-static int pluginStoreSettingWithType(Plugin_t *plugin, char *property, char *value, ConfigPropertyType_e fileType) {
+/*
+ * (SchemaParser_f) callback function.
+ * Multi-valued file paths, kept absolute in the setting's list.
+ */
+static int parseList(Plugin_t *plugin, const PluginConfSchema_t *schema, char *property, char *value) {
 
-  //store original config value into config hash for plugin
-  size_t origKeyLen = strlen(property) + strlen(PLUGIN_CONF_ORIGTAG) + 1;
-  char origKey[origKeyLen];
-  snprintf(origKey, origKeyLen, "%s%s", PLUGIN_CONF_ORIGTAG, property);
+  char absPath[PATH_MAX];
+  if (makeAbsPath(plugin, value, absPath))
+    return -1;
 
-  HashData_t *newSetting = HashData_create(origKey, value);
-  if (!newSetting) {
-    SYSLOG(LOG_INFO, "Plugin_Conf_Apply: Failed adding config option to hash: %s:%s", origKey, value);
+  char *str = Arena_intern(plugin->config.arena, absPath);
+  if (!str)
     return -1;
-  }
 
-  HashTable_add(plugin->config.table, newSetting);
+  return indexValue(&plugin->config, property, str);
+}
 
+/*
+ * (SchemaParser_f) callback function.
+ */
+static int parseTimer(Plugin_t *plugin, const PluginConfSchema_t *schema, char *property, char *value) {
 
-  HashData_t *appliedSetting = NULL;
-  //store the applied setting without the original tag into the hash
-  switch (fileType) {
-    case TYPE_NOTPATH:
-    default:
-      //no need to escape any paths
-      appliedSetting = HashData_create(property, value);
-      if (appliedSetting)
-        HashTable_add(plugin->config.table, appliedSetting);
-      break;
-
-    case TYPE_FILEPATH: {
-      //make all file paths absolute
-      char *absPath = makeAbsPath(plugin, value);
-      if (absPath) {
-        appliedSetting = HashData_create(property, absPath);
-        if (appliedSetting)
-          HashTable_add(plugin->config.table, appliedSetting);
-
-        free(absPath);
-      }
-    }
-      break;
-
-    case TYPE_SCRIPTPATH: {
-      //script paths will be made absolute
-      char *absPath = makeAbsPath(plugin, value);
-      if (absPath) {
-        appliedSetting = HashData_create(property, absPath);
-        if (appliedSetting)
-          HashTable_add(plugin->config.table, appliedSetting);
-
-
-        //then an escaped version of the path will be stored
-        char *escaped = ConfigReader_escapePath(absPath);
-        free(absPath);
-
-        if (escaped) {
-          appliedSetting = HashData_create(PLUGIN_CONF_TAG_SCRIPT_ESCAPED, escaped);
-          free(escaped);
-
-          if (appliedSetting)
-            HashTable_add(plugin->config.table, appliedSetting);
-        }
-      }
-    }
-      break;
+  int *period = schemaInt(plugin, schema);
+  *period = atoi(value);
+
+  //negative values will only run the script once
+  if (*period < 0) {
+    *period = -*period; //make it positive
+    plugin->flags |= PLUGIN_FLAG_SCRIPT_ONESHOT;
   }
 
   return 0;
 }
 
+/*
+ * (SchemaParser_f) callback function.
+ */
+static int parseProcess(Plugin_t *plugin, const PluginConfSchema_t *schema, char *property, char *value) {
+
+  if (!strcmp(value, PLUGIN_CONF_TAG_SCRIPT_PROCESS_2)) {
+    plugin->flags |= PLUGIN_FLAG_OUTPUT_CLEAR;
+    plugin->flags &= ~PLUGIN_FLAG_OUTPUT_APPEND;
+  }
+  else {
+    plugin->flags |= PLUGIN_FLAG_OUTPUT_APPEND;
+    plugin->flags &= ~PLUGIN_FLAG_OUTPUT_CLEAR;
+  }
+
+  return 0;
+}
 
 /*
-  Applies a value to the plugin struct based on property name from the
-  plugin.conf file.
-*/
-int Plugin_confApply(void *data, char *property, char *value) {
+ * (SchemaParser_f) callback function.
+ */
+static int parseBackground(Plugin_t *plugin, const PluginConfSchema_t *schema, char *property, char *value) {
 
-  if (!data) return -1;
+  plugin->flags |= PLUGIN_FLAG_SCRIPT_BACKGROUND;
 
-  Plugin_t *plugin = (Plugin_t *) data;
+  //if no time has yet been defined for the background script, add a time
+  //to get it into the scheduler so it can be executed
+  if (!strcmp(value, PLUGIN_CONF_OPT_TRUE) && !PluginConf_GetScriptPeriod(plugin))
+    plugin->config.periodLen = 1;
 
-  if (!property) return 0;
+  return 0;
+}
 
+/*
+ * (SchemaParser_f) callback function.
+ */
+static int parseStartOnLoad(Plugin_t *plugin, const PluginConfSchema_t *schema, char *property, char *value) {
 
-  ConfigPropertyType_e fileType = getKnownSettingType(property);
-  SYSLOG(LOG_INFO, "Plugin_Conf_Apply: Initial: attr: %s, value: %s", property, value);
+  //check if plugin is supposed to start once it is loaded.
+  if (!strcmp(value, PLUGIN_CONF_OPT_TRUE))
+    PLUGIN_SET_ENABLED(plugin);
 
+  return 0;
+}
 
 
+/*
+ * Every known setting:
+ *  X(id, key, first char, last char, type, parser, field)
+ *
+ * Multi-valued settings are matched on their key up to the ':'.
+ * The first and last characters of each key feed SCHEMA_HASH.
+ */
+#define PLUGIN_CONF_SCHEMA(X) \
+  X(HTML,       PLUGIN_CONF_TAG_HTML,              'h', 'h', TYPE_FILEPATH,   parseString,      SCHEMA_FIELD(html)) \
+  X(JS,         PLUGIN_CONF_TAG_JS,                'j', ':', TYPE_FILEPATH,   parseList,        SCHEMA_NO_FIELD) \
+  X(CSS,        PLUGIN_CONF_TAG_CSS,               'c', ':', TYPE_FILEPATH,   parseList,        SCHEMA_NO_FIELD) \
+  X(JS_CLASS,   PLUGIN_CONF_TAG_JS_CLASS,          'j', 'j', TYPE_NOTPATH,    parseString,      SCHEMA_FIELD(jsMain)) \
+  X(SCRIPT,     PLUGIN_CONF_TAG_SCRIPT,            's', 'h', TYPE_SCRIPTPATH, parseString,      SCHEMA_FIELD(script)) \
+  X(TIMER,      PLUGIN_CONF_TAG_SCRIPT_TIME,       's', 'r', TYPE_NOTPATH,    parseTimer,       SCHEMA_FIELD(periodLen)) \
+  X(PROCESS,    PLUGIN_CONF_TAG_SCRIPT_PROCESS,    's', 's', TYPE_NOTPATH,    parseProcess,     SCHEMA_NO_FIELD) \
+  X(BACKGROUND, PLUGIN_CONF_TAG_SCRIPT_BACKGROUND, 's', 'd', TYPE_NOTPATH,    parseBackground,  SCHEMA_NO_FIELD) \
+  X(START,      PLUGIN_CONF_START_ON_LOAD,         's', 'd', TYPE_NOTPATH,    parseStartOnLoad, SCHEMA_NO_FIELD) \
+  X(WEBGUI,     PLUGIN_CONF_WEBGUI,                'w', 'l', TYPE_FILEPATH,   parseString,      SCHEMA_FIELD(webgui))
 
-  //Based on which property is being set, change pathPtr to the struct
-  //element it coresponds to.
-  if (!strncmp(property, PLUGIN_CONF_TAG_SCRIPT_TIME, strlen(property))) {
-    if (value == NULL || strlen(value) == 0) return 0;
+/*
+ * Perfect hash over the known keys. Every key's slot is a case label in
+ * schemaFind, so adding a key that collides with another fails to compile;
+ * pick a different mix here if that happens.
+ */
+#define SCHEMA_SLOTS 16
+#define SCHEMA_HASH(len, first, last) (((len) + (first) + 2 * (last)) & (SCHEMA_SLOTS - 1))
 
-    plugin->config.periodLen = atoi(value);
+typedef enum {
+#define SCHEMA_ID(id, key, first, last, type, parse, field) SCHEMA_##id,
+    PLUGIN_CONF_SCHEMA(SCHEMA_ID)
+#undef SCHEMA_ID
+    SCHEMA_COUNT
+} PluginConfSchemaId_e;
 
-    //negative values will only run the script once
-    if (plugin->config.periodLen < 0) {
-      plugin->config.periodLen = -plugin->config.periodLen; //make it positive
-      plugin->flags |= PLUGIN_FLAG_SCRIPT_ONESHOT;
-    }
-  }
-  else if (!strncmp(property, PLUGIN_CONF_TAG_SCRIPT_PROCESS, strlen(property))) {
-    if (value == NULL || strlen(value) == 0) return 0;
-
-    if (!strncmp(value, PLUGIN_CONF_TAG_SCRIPT_PROCESS_2, strlen(value))) {
-      plugin->flags |= PLUGIN_FLAG_OUTPUT_CLEAR;
-      plugin->flags &= ~PLUGIN_FLAG_OUTPUT_APPEND;
-    }
-    else {
-      plugin->flags |= PLUGIN_FLAG_OUTPUT_APPEND;
-      plugin->flags &= ~PLUGIN_FLAG_OUTPUT_CLEAR;
-    }
+static const PluginConfSchema_t _schema[SCHEMA_COUNT] = {
+#define SCHEMA_ENTRY(id, key, first, last, type, parse, field) [SCHEMA_##id] = {key, sizeof(key) - 1, type, parse, field},
+    PLUGIN_CONF_SCHEMA(SCHEMA_ENTRY)
+#undef SCHEMA_ENTRY
+};
 
-  }
-  else if (!strncmp(property, PLUGIN_CONF_TAG_SCRIPT_BACKGROUND, strlen(property))) {
-    plugin->flags |= PLUGIN_FLAG_SCRIPT_BACKGROUND;
+static const PluginConfSchema_t *schemaFind(const char *key, size_t len) {
+
+  if (!len)
+    return NULL;
 
-    //if no time has yet been defined for the background script, add a time
-    //to get it into the scheduler so it can be executed
-    if (!strncmp(value, PLUGIN_CONF_OPT_TRUE, strlen(value)) && !PluginConf_GetScriptPeriod(plugin))
-      plugin->config.periodLen = 1;
+  const PluginConfSchema_t *schema = NULL;
+  switch (SCHEMA_HASH(len, (unsigned char) key[0], (unsigned char) key[len - 1])) {
+#define SCHEMA_CASE(id, k, first, last, type, parse, field) \
+    case SCHEMA_HASH(sizeof(k) - 1, first, last): schema = &_schema[SCHEMA_##id]; break;
+    PLUGIN_CONF_SCHEMA(SCHEMA_CASE)
+#undef SCHEMA_CASE
+    default:
+      return NULL;
   }
-  else if (!strncmp(property, PLUGIN_CONF_START_ON_LOAD, strlen(property))) {
-    //check if plugin is supposed to start once it is loaded.
-    if (value != NULL && !strncmp(value, PLUGIN_CONF_OPT_TRUE, strlen(value)))
-      PLUGIN_SET_ENABLED(plugin);
+
+  if (schema->len != len || memcmp(schema->key, key, len))
+    return NULL;
+
+  return schema;
+}
+
+//schema entry for a config file key of length len, NULL for keys that aren't known
+static const PluginConfSchema_t *schemaLookup(const char *property, size_t len) {
+
+  size_t prefixLen = 0;
+  int index = 0;
+  if (multiValueKey(property, &prefixLen, &index))
+    len = prefixLen;
+
+  return schemaFind(property, len);
+}
+
+//apply a known setting to its typed field, anything else goes in the table
+static int pluginApplySetting(Plugin_t *plugin, char *property, size_t propertyLen, char *value) {
+
+  const PluginConfSchema_t *schema = schemaLookup(property, propertyLen);
+  if (!schema)
+    return configSet(plugin, property, value);
+
+  if (schema->parse(plugin, schema, property, value)) {
+    SYSLOG(LOG_ERR, "Plugin Conf: Error applying %s: %s", property, value);
+    return -1;
   }
 
+  return 0;
+}
+
+
+/*
+  Applies a value to the plugin struct based on property name from the
+  plugin.conf file.
+*/
+int Plugin_confApply(void *data, char *property, size_t propertyLen, char *value, size_t valueLen) {
+
+  if (!data) return -1;
+
+  Plugin_t *plugin = (Plugin_t *) data;
+
+  if (!property) return 0;
+
+  SYSLOG(LOG_INFO, "Plugin_Conf_Apply: Initial: attr: %s, value: %s", property, value);
 
-  if (value == NULL || strlen(value) <= 0)
+  if (value == NULL || valueLen == 0)
     return 0;
 
+  //store original config value into config hash for plugin
+  size_t tagLen = strlen(PLUGIN_CONF_ORIGTAG);
+  char origKey[tagLen + propertyLen + 1];
+  memcpy(origKey, PLUGIN_CONF_ORIGTAG, tagLen);
+  memcpy(origKey + tagLen, property, propertyLen + 1);
 
-  pluginStoreSettingWithType(plugin, property, value, fileType);
+  if (configSet(plugin, origKey, value))
+    return 0;
 
+  pluginApplySetting(plugin, property, propertyLen, value);
   return 0;
 }
 
 
 int Plugin_initConfig(Plugin_t *plugin) {
 
+  //every setting, key and path of the plugin's config is kept in one arena
+  plugin->config.arena = Arena_init(PLUGIN_CONF_ARENA_BLOCK);
+  if (!plugin->config.arena) {
+    SYSLOG(LOG_ERR, "Plugin Create: Error allocating plugin configuration arena.");
+    return -1;
+  }
+
   //allocate plugin configuration hash
-  plugin->config.table = HashTable_init(PLUGIN_CONF_HASH_SIZE);
+  plugin->config.table = HashTable_initArena(PLUGIN_CONF_HASH_SIZE, plugin->config.arena);
   if (!plugin->config.table) {
     SYSLOG(LOG_ERR, "Plugin Create: Error allocating plugin configuration hash.");
     return -1;
@@ -330,17 +494,76 @@ int Plugin_loadConfig(Plugin_t *plugin) {
   if (Plugin_initConfig(plugin))
     return -1;
 
+  //changes still waiting to be written would otherwise be lost to a reload
+  ConfigWriter_Flush(pluginFile);
+
   int status = ConfigReader_readConfig(pluginFile, Plugin_confApply, plugin);
 
+#ifdef PLUGIN_CONF_DEBUG
   //print plugin hash table
   printf("========================\n");
   printf("%s\n", Plugin_GetName(plugin));
   printf("=========================\n");
   HashTable_print(stdout, plugin->config.table);
+#endif
 
   return status;
 }
 
+/*
+ * Rebuild the typed settings and multi-valued lists from a config table
+ * that was filled in directly, rather than through Plugin_loadConfig.
+ * Known settings are applied again from the originals kept in the table.
+ */
+int PluginConf_Materialize(Plugin_t *plugin) {
+
+  HashTable_t *table = plugin->config.table;
+  if (!table)
+    return -1;
+
+  size_t origTagLen = strlen(PLUGIN_CONF_ORIGTAG);
+  size_t i = 0;
+  for (i = 0; i < table->size; i++) {
+    HashData_t *entry = table->entries[i];
+    if (!entry)
+      continue;
+
+    if (indexValue(&plugin->config, entry->key, entry->value))
+      return -1;
+
+    if (strncmp(entry->key, PLUGIN_CONF_ORIGTAG, origTagLen))
+      continue;
+
+    char *property = entry->key + origTagLen;
+    size_t propertyLen = strlen(property);
+    if (schemaLookup(property, propertyLen))
+      pluginApplySetting(plugin, property, propertyLen, entry->value);
+  }
+
+  return 0;
+}
+
+/*
+ * Release a plugin's config. Its settings all live in the config arena,
+ * so this is a handful of frees however long the config file was.
+ */
+void PluginConf_Free(Plugin_t *plugin) {
+
+  if (plugin->config.table)
+    HashTable_destroy(plugin->config.table);
+
+  size_t i = 0;
+  for (i = 0; i < plugin->config.listCount; i++) {
+    PluginConfList_t *list = &plugin->config.lists[i];
+    free(list->order);
+    free(list->values);
+  }
+  free(plugin->config.lists);
+  Arena_destroy(plugin->config.arena);
+
+  memset(&plugin->config, 0, sizeof(PluginConf_t));
+}
+
 
 int PluginConf_setValue(Plugin_t *plugin, char *property, char *value) {
 
@@ -373,30 +596,30 @@ int PluginConf_setValue(Plugin_t *plugin, char *property, char *value) {
   }
   strncat(outfile, PLUGIN_CONF_OUT, remainingSpace);
 
-  ConfigReader_writeConfig(outfile, pluginFile, property, value);
-  return 0;
+  //written out later by the config writer, bulk changes share one rewrite
+  return ConfigWriter_Set(outfile, pluginFile, property, value);
 }
 
 
-char **PluginConf_GetCSS(Plugin_t *plugin, int *count) {
+char *const *PluginConf_GetCSS(Plugin_t *plugin, int *count) {
 
   return configGetAllStrings(plugin, PLUGIN_CONF_TAG_CSS, count);
 }
 
-char **PluginConf_GetJS(Plugin_t *plugin, int *count) {
+char *const *PluginConf_GetJS(Plugin_t *plugin, int *count) {
 
   return configGetAllStrings(plugin, PLUGIN_CONF_TAG_JS, count);
 }
 
 char *PluginConf_GetHTML(Plugin_t *plugin) {
 
-  return configGetString(plugin, PLUGIN_CONF_TAG_HTML);
+  return plugin->config.html;
 }
 
 
 char *PluginConf_GetScript(Plugin_t *plugin) {
 
-  return configGetString(plugin, PLUGIN_CONF_TAG_SCRIPT);
+  return plugin->config.script;
 }
 
 char *Plugin_GetDirectory(Plugin_t *plugin) {
@@ -406,11 +629,10 @@ char *Plugin_GetDirectory(Plugin_t *plugin) {
 
 char *PluginConf_GetEscapeScript(Plugin_t *plugin) {
 
-  char *escaped = configGetString(plugin, PLUGIN_CONF_TAG_SCRIPT_ESCAPED);
-  if (!escaped)
+  if (!plugin->config.scriptEscaped)
     return PluginConf_GetScript(plugin);
 
-  return escaped;
+  return plugin->config.scriptEscaped;
 }
 
 char *Plugin_GetWebProtocol(Plugin_t *plugin) {
@@ -431,18 +653,33 @@ int PluginConf_GetScriptPeriod(Plugin_t *plugin) {
 
 char *PluginConf_GetJSMain(Plugin_t *plugin) {
 
-  return configGetString(plugin, PLUGIN_CONF_TAG_JS_CLASS);
+  return plugin->config.jsMain;
 }
 
 /*
  * Look up the value of a property as it would be displayed in
- * the config file.
+ * the config file. A multi-valued property can be asked for with
+ * or without its trailing ':'. Returns *count borrowed values.
  */
-char **PluginConf_GetConfigValue(Plugin_t *plugin, char *property, int *count) {
+char *const *PluginConf_GetConfigValue(Plugin_t *plugin, char *property, int *count) {
 
-  size_t origKeyLen = strlen(property) + strlen(PLUGIN_CONF_ORIGTAG) + 1;
+  //room to append the ':' of a multi-valued property
+  size_t origKeyLen = strlen(property) + strlen(PLUGIN_CONF_ORIGTAG) + 2;
   char origKey[origKeyLen];
   snprintf(origKey, origKeyLen, "%s%s", PLUGIN_CONF_ORIGTAG, property);
 
+  HashData_t *entry = HashTable_find(plugin->config.table, origKey);
+  if (entry) {
+    if (count)
+      *count = 1;
+    return &entry->value;
+  }
+
+  size_t keyLen = strlen(origKey);
+  if (keyLen && origKey[keyLen - 1] != PLUGIN_CONF_TAG_DELIM) {
+    origKey[keyLen] = PLUGIN_CONF_TAG_DELIM;
+    origKey[keyLen + 1] = '\0';
+  }
+
   return configGetAllStrings(plugin, origKey, count);
 }
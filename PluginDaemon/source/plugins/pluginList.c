@@ -5,9 +5,20 @@
 #include <syslog.h>
 #include "plugin.h"
 #include "btree.h"
+#include "hashIndex.h"
 #include "misc.h"
 
+#define PLUGIN_INDEX_INIT_SIZE 64
+
+/*
+ * Plugins are kept in a binary tree so they are always visited in name order,
+ * with hash indexes on the side for lookups by name and by short uuid.
+ * The indexes only borrow the Plugin_t pointers; the tree owns them.
+ */
 static BTree_t *allPlugins = NULL;
+static HashIndex_t *pluginsByName = NULL;
+static HashIndex_t *pluginsByUUID = NULL;
+
 /*=======================================================================================
 Binary Tree accessors
 =======================================================================================*/
@@ -43,16 +54,6 @@ BTreeNode_t *PluginNode_create(Plugin_t *plugin) {
   return BTreeNode_create(plugin);
 }
 
-//Creates a binary tree node that is used for searching the binary tree
-BTreeNode_t *PluginNode_searchKey(const char *searchTerm) {
-
-  Plugin_t *temp = Plugin_Create();
-  if (!temp) return NULL;
-  if (Plugin_SetName(temp, searchTerm)) return NULL;
-  return PluginNode_create(temp);
-}
-
-
 //Initialize a binary tree for storing plugins
 int PluginList_Init(void) {
 
@@ -61,53 +62,98 @@ int PluginList_Init(void) {
     SYSLOG(LOG_ERR, "PluginList_Init: error initializing binary tree for plugins");
     return -1;
   }
+
+  pluginsByName = HashIndex_init(PLUGIN_INDEX_INIT_SIZE);
+  pluginsByUUID = HashIndex_init(PLUGIN_INDEX_INIT_SIZE);
+  if (!pluginsByName || !pluginsByUUID) {
+    SYSLOG(LOG_ERR, "PluginList_Init: error initializing plugin indexes");
+    PluginList_Free();
+    return -1;
+  }
   return 0;
 }
 
-//Add plugin to internalized binary tree
-void PluginList_Add(Plugin_t *plugin) {
+/*
+ * Add plugin to internalized binary tree. Returns -1 if it couldn't be added,
+ * in which case the caller still owns the plugin.
+ */
+int PluginList_Add(Plugin_t *plugin) {
 
   if (!allPlugins) {
     SYSLOG(LOG_ERR, "PluginList_Add: plugin list hasn't been initialized yet");
-    return;
+    return -1;
   }
-  BTree_add(allPlugins, PluginNode_create(plugin));
+
+  if (HashIndex_find(pluginsByName, Plugin_GetName(plugin))) {
+    SYSLOG(LOG_ERR, "PluginList_Add: plugin %s is already in the list", Plugin_GetName(plugin));
+    return -1;
+  }
+
+  if (HashIndex_add(pluginsByName, Plugin_GetName(plugin), plugin)) {
+    SYSLOG(LOG_ERR, "PluginList_Add: error indexing plugin %s", Plugin_GetName(plugin));
+    return -1;
+  }
+
+  if (HashIndex_add(pluginsByUUID, plugin->uuidShort, plugin)) {
+    SYSLOG(LOG_ERR, "PluginList_Add: error indexing plugin %s", Plugin_GetName(plugin));
+    HashIndex_remove(pluginsByName, Plugin_GetName(plugin));
+    return -1;
+  }
+
+  if (BTree_add(allPlugins, PluginNode_create(plugin))) {
+    SYSLOG(LOG_ERR, "PluginList_Add: error adding plugin %s", Plugin_GetName(plugin));
+    HashIndex_remove(pluginsByName, Plugin_GetName(plugin));
+    HashIndex_remove(pluginsByUUID, plugin->uuidShort);
+    return -1;
+  }
+
+  return 0;
 }
 
 //Retrieve a specific plugin based on plugin name
 Plugin_t *PluginList_Find(const char *pluginName) {
 
-  BTreeNode_t *result = NULL;
-  BTreeNode_t *keyNode = PluginNode_searchKey(pluginName);
-  if (!keyNode) {
-    SYSLOG(LOG_ERR, "PluginList_Find: error creating search key node.");
+  if (!pluginsByName || !pluginName)
     return NULL;
-  }
 
-  result = BTree_find(allPlugins, keyNode);
-  BTreeNode_destroy(keyNode, &PluginNode_destroy);
+  return (Plugin_t *) HashIndex_find(pluginsByName, pluginName);
+}
+
+//Retrieve a specific plugin based on its short uuid (its daemon protocol name)
+Plugin_t *PluginList_FindByUUID(const char *uuidShort) {
+
+  if (!pluginsByUUID || !uuidShort)
+    return NULL;
 
-  if (!result) return NULL;
-  return (Plugin_t *) BTreeNode_getData(result);
+  return (Plugin_t *) HashIndex_find(pluginsByUUID, uuidShort);
 }
 
 void PluginList_Delete(const char *pluginName) {
 
-  BTreeNode_t *keyNode = PluginNode_searchKey(pluginName);
-  if (!keyNode) {
-    SYSLOG(LOG_ERR, "PluginList_Delete: error creating search key node.");
+  Plugin_t *plugin = PluginList_Find(pluginName);
+  if (!plugin) {
+    SYSLOG(LOG_ERR, "PluginList_Delete: no plugin named %s", pluginName);
     return;
   }
-  BTree_rmNode(allPlugins, keyNode);
 
-  //done with search key, destroy it
-  BTreeNode_destroy(keyNode, &PluginNode_destroy);
+  HashIndex_remove(pluginsByName, Plugin_GetName(plugin));
+  HashIndex_remove(pluginsByUUID, plugin->uuidShort);
+
+  //the plugin itself is the search key, the tree frees it along with its node
+  BTreeNode_t keyNode = {.data = plugin};
+  BTree_rmNode(allPlugins, &keyNode);
 }
 
 //Cleanup plugin list
 void PluginList_Free(void) {
 
+  HashIndex_destroy(pluginsByName);
+  HashIndex_destroy(pluginsByUUID);
+  pluginsByName = NULL;
+  pluginsByUUID = NULL;
+
   BTree_destroy(allPlugins);
+  allPlugins = NULL;
 }
 
 /*
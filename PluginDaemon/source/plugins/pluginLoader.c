@@ -6,13 +6,43 @@
 #include <libgen.h>
 #include <sys/stat.h>
 #include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <dirent.h>
 
 #include "pluginLoader.h"
+#include "pluginManifest.h"
+#include "pluginState.h"
 #include "display.h"
 #include "misc.h"
 
 #define INSTALL_CMD "cd %s && git clone -q %s"
 
+//upper bound on threads used to parse plugins at startup
+#define LOADER_MAX_THREADS 8
+#define LOADER_BASE_ENTRIES 32
+
+
+typedef struct LoaderEntry_s {
+    char *path;
+    Plugin_t *plugin;
+    //0: parsed, 1: skipped (not a directory), -1: failed
+    int status;
+    //restored from the manifest rather than parsed
+    int cached;
+    PluginStamp_t stamp;
+} LoaderEntry_t;
+
+typedef struct LoaderJob_s {
+    PluginManifest_t *manifest;
+    LoaderEntry_t *entries;
+    size_t count;
+    size_t next;
+} LoaderJob_t;
+
 
 /*
  * (PluginList_forEach) callback function.
@@ -27,6 +57,11 @@ int PluginLoader_InitSocketConnection(Plugin_t *plugin) {
   struct lws_protocols proto = Plugin_MakeProtocol(plugin);
   PluginSocket_AddProtocol(&proto);
 
+  //the web protocol's handle identifies the plugin on the shared mux connection
+  struct lws_protocols *webProto = PluginSocket_getProtocol(Plugin_GetWebProtocol(plugin));
+  if (webProto)
+    plugin->channel = webProto->id;
+
   //Add a handler for external applications to interact with plugins
   struct lws_protocols extProto = Plugin_MakeExternalProtocol(plugin);
   PluginSocket_AddProtocol(&extProto);
@@ -42,6 +77,22 @@ int PluginLoader_InitSocketConnection(Plugin_t *plugin) {
 
 
 
+/*
+ * Load a plugin that was only registered at startup (see PluginLoader_LoadAll)
+ * and give it its protocols. Does nothing for a plugin that is already loaded.
+ */
+int PluginLoader_EnsureLoaded(Plugin_t *plugin) {
+
+  if (!Plugin_IsStub(plugin))
+    return 0;
+
+  if (Plugin_Materialize(plugin))
+    return -1;
+
+  SYSLOG(LOG_INFO, "PluginLoader: loaded deferred plugin %s", Plugin_GetName(plugin));
+  return PluginLoader_InitSocketConnection(plugin);
+}
+
 int PluginLoader_InitClient(Plugin_t *plugin) {
 
   return Display_LoadPlugin(plugin);
@@ -64,6 +115,28 @@ int PluginLoader_RescheduleDisconnectedPlugin(Plugin_t *plugin) {
   return 0;
 }
 
+/*
+ * Being enabled or disabled through the API sticks across boots, and wins over
+ * start-on-load in the plugin's config. A stub that is to be enabled is
+ * loaded in full first.
+ */
+static int applySavedState(Plugin_t *plugin) {
+
+  int enabled = PluginState_GetEnabled(Plugin_GetName(plugin));
+  if (enabled < 0)
+    return 0;
+
+  if (enabled && Plugin_IsStub(plugin) && Plugin_Materialize(plugin))
+    return -1;
+
+  if (enabled)
+    PLUGIN_SET_ENABLED(plugin);
+  else
+    PLUGIN_SET_DISABLED(plugin);
+
+  return 0;
+}
+
 /*
  * Loads a plugin from a directory to the mirror.
  * This should be called after a connection has been made to
@@ -74,25 +147,41 @@ int PluginLoader_LoadPlugin(char *directory) {
   SYSLOG(LOG_INFO, "Loading Directory: %s", directory);
 
   struct stat st;
-  lstat(directory, &st);
 
   //must pass in a plugin directory
-  if (!S_ISDIR(st.st_mode)) {
+  if (lstat(directory, &st) || !S_ISDIR(st.st_mode)) {
     SYSLOG(LOG_ERR, "LoadPlugin: Skipped regular file, requires directory");
     return 0;
   }
 
   char *dirName = basename(directory);
 
-  Plugin_t *plugin = Plugin_Init(directory, dirName);
+  Plugin_t *plugin = Plugin_Parse(directory, dirName);
 
   if (!plugin) {
     SYSLOG(LOG_ERR, "LoadPlugin: Error initializing plugin.");
     return -1;
   }
 
-  //Add plugin to the plugin list
-  PluginList_Add(plugin);
+  //a freshly parsed plugin is never a stub, so this can't fail
+  applySavedState(plugin);
+
+  //like at startup, a plugin that doesn't start on load is only registered
+  int enabled = Plugin_isEnabled(plugin);
+  if (!enabled)
+    Plugin_MakeStub(plugin);
+
+  //Add plugin to the plugin list before anything refers to it
+  if (PluginList_Add(plugin)) {
+    Plugin_Free(plugin, 1);
+    return -1;
+  }
+
+  if (!enabled)
+    return 0;
+
+  //start scheduling
+  Plugin_Enable(plugin);
 
   //start communications
   if (PluginLoader_InitSocketConnection(plugin)) return 0;
@@ -109,6 +198,274 @@ int PluginLoader_LoadPlugin(char *directory) {
   return 0;
 }
 
+static void freeEntries(LoaderEntry_t *entries, size_t count) {
+
+  size_t i = 0;
+  for (i = 0; i < count; i++) {
+    free(entries[i].path);
+    if (entries[i].plugin)
+      Plugin_Free(entries[i].plugin, 1);
+  }
+
+  free(entries);
+}
+
+/*
+ * List the candidate plugin folders in a directory, in readdir order.
+ */
+static LoaderEntry_t *scanDirectory(char *directory, size_t *count) {
+
+  DIR *dir = opendir(directory);
+  if (!dir) {
+    SYSLOG(LOG_ERR, "PluginLoader: error opening: %s", directory);
+    return NULL;
+  }
+
+  size_t size = LOADER_BASE_ENTRIES, used = 0;
+  LoaderEntry_t *entries = calloc(size, sizeof(LoaderEntry_t));
+  if (!entries) {
+    SYSLOG(LOG_ERR, "PluginLoader: error allocating directory listing");
+    closedir(dir);
+    return NULL;
+  }
+
+  size_t dirLen = strlen(directory);
+  int needSlash = (dirLen == 0 || directory[dirLen - 1] != '/');
+
+  struct dirent *dirInfo = NULL;
+  while ((dirInfo = readdir(dir)) != NULL) {
+    if (!strcmp(dirInfo->d_name, ".") || !strcmp(dirInfo->d_name, ".."))
+      continue;
+
+    //d_type saves the lstat for anything that clearly isn't a plugin folder
+    if (dirInfo->d_type != DT_DIR && dirInfo->d_type != DT_UNKNOWN)
+      continue;
+
+    if (used == size) {
+      LoaderEntry_t *grown = realloc(entries, size * 2 * sizeof(LoaderEntry_t));
+      if (!grown) {
+        SYSLOG(LOG_ERR, "PluginLoader: error growing directory listing");
+        break;
+      }
+      memset(grown + size, 0, size * sizeof(LoaderEntry_t));
+      entries = grown;
+      size *= 2;
+    }
+
+    size_t pathLen = dirLen + strlen(dirInfo->d_name) + 2;
+    char *path = malloc(pathLen);
+    if (!path)
+      break;
+
+    snprintf(path, pathLen, needSlash ? "%s/%s" : "%s%s", directory, dirInfo->d_name);
+    entries[used++].path = path;
+  }
+
+  closedir(dir);
+  *count = used;
+  return entries;
+}
+
+static void parseEntry(LoaderEntry_t *entry, PluginManifest_t *manifest) {
+
+  struct stat st;
+  if (lstat(entry->path, &st) || !S_ISDIR(st.st_mode)) {
+    SYSLOG(LOG_ERR, "LoadPlugin: Skipped regular file, requires directory");
+    entry->status = 1;
+    return;
+  }
+
+  //basename() may modify its argument, so find the folder name by hand
+  char *dirName = strrchr(entry->path, '/');
+  dirName = (dirName) ? dirName + 1 : entry->path;
+
+  //a plugin whose files are unchanged since the last boot comes straight from the manifest
+  if (!PluginManifest_Stamp(entry->path, &entry->stamp))
+    entry->plugin = PluginManifest_Restore(manifest, entry->path, dirName, &entry->stamp);
+
+  entry->cached = (entry->plugin != NULL);
+  if (!entry->cached)
+    entry->plugin = Plugin_Parse(entry->path, dirName);
+
+  entry->status = (entry->plugin) ? 0 : -1;
+}
+
+static void *parseWorker(void *data) {
+
+  LoaderJob_t *job = (LoaderJob_t *) data;
+
+  size_t i = 0;
+  while ((i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->count)
+    parseEntry(&job->entries[i], job->manifest);
+
+  return NULL;
+}
+
+/*
+ * Parse every entry on a small thread pool. Each plugin's config and saved css
+ * are independent files, so only the claim on the next entry is shared.
+ */
+static void parseEntries(LoaderEntry_t *entries, size_t count, PluginManifest_t *manifest) {
+
+  LoaderJob_t job = {.manifest = manifest, .entries = entries, .count = count, .next = 0};
+
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  size_t threadCount = (cpus > 0) ? (size_t) cpus : 1;
+  if (threadCount > LOADER_MAX_THREADS)
+    threadCount = LOADER_MAX_THREADS;
+  if (threadCount > count)
+    threadCount = count;
+
+  pthread_t threads[LOADER_MAX_THREADS];
+  size_t started = 0;
+
+  //workers inherit a blocked mask so scheduler timer signals stay on the main thread
+  sigset_t all, old;
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+
+  //the calling thread works too, so spawn one less
+  for (started = 0; started + 1 < threadCount; started++) {
+    if (pthread_create(&threads[started], NULL, parseWorker, &job))
+      break;
+  }
+
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+  parseWorker(&job);
+
+  size_t i = 0;
+  for (i = 0; i < started; i++)
+    pthread_join(threads[i], NULL);
+
+  SYSLOG(LOG_INFO, "PluginLoader: parsed %zu entries on %zu threads", count, started + 1);
+}
+
+/*
+ * Rewrite the manifest if any plugin was parsed from its files, or
+ * plugins were removed since it was written.
+ */
+static void updateManifest(char *directory, PluginManifest_t *manifest, LoaderEntry_t *entries, size_t count) {
+
+  Plugin_t **plugins = calloc(count + 1, sizeof(Plugin_t *));
+  PluginStamp_t *stamps = calloc(count + 1, sizeof(PluginStamp_t));
+  if (!plugins || !stamps)
+    goto done;
+
+  size_t i = 0, parsed = 0, used = 0;
+  for (i = 0; i < count; i++) {
+    if (entries[i].status)
+      continue;
+
+    if (!entries[i].cached)
+      parsed++;
+
+    plugins[used] = entries[i].plugin;
+    stamps[used++] = entries[i].stamp;
+  }
+
+  if (parsed || used != PluginManifest_Count(manifest))
+    PluginManifest_Save(directory, manifest, plugins, stamps, used);
+
+  done:
+  free(plugins);
+  free(stamps);
+}
+
+/*
+ * Load every plugin folder in a directory at startup.
+ *
+ * Directory entries are parsed in parallel; adding plugins to the list,
+ * registering protocols and scheduling stay serial and keep directory order.
+ * Plugins that don't start on load are kept as stubs until
+ * PluginLoader_EnsureLoaded is called on them.
+ * Like the one-at-a-time loader, a plugin that fails to parse aborts the load.
+ */
+int PluginLoader_LoadAll(char *directory) {
+
+  struct timespec start, phase;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  size_t count = 0;
+  LoaderEntry_t *entries = scanDirectory(directory, &count);
+  if (!entries)
+    return -1;
+
+  double scanMs = ElapsedMs(&start);
+  clock_gettime(CLOCK_MONOTONIC, &phase);
+
+  PluginManifest_t *manifest = PluginManifest_Open(directory);
+  parseEntries(entries, count, manifest);
+
+  int status = 0;
+  size_t i = 0, loaded = 0, cached = 0, deferred = 0;
+  for (i = 0; i < count; i++) {
+    if (entries[i].status < 0)
+      status = -1;
+    else if (!entries[i].status && entries[i].cached)
+      cached++;
+  }
+
+  //plugins are saved untouched by scheduling or the frontend
+  if (!status)
+    updateManifest(directory, manifest, entries, count);
+
+  PluginManifest_Close(manifest);
+
+  double parseMs = ElapsedMs(&phase);
+  clock_gettime(CLOCK_MONOTONIC, &phase);
+
+  for (i = 0; i < count; i++) {
+    LoaderEntry_t *entry = &entries[i];
+    if (entry->status > 0)
+      continue;
+
+    if (entry->status < 0) {
+      SYSLOG(LOG_ERR, "LoadPlugin: Error initializing plugin %s.", entry->path);
+      status = -1;
+      break;
+    }
+
+    Plugin_t *plugin = entry->plugin;
+    entry->plugin = NULL;
+
+    //a plugin that fails to load here stays registered as a stub
+    if (applySavedState(plugin))
+      SYSLOG(LOG_ERR, "LoadPlugin: Error loading enabled plugin %s.", entry->path);
+
+    //disabled plugins are only registered, they load on first use
+    int enabled = Plugin_isEnabled(plugin);
+    if (!enabled && !Plugin_IsStub(plugin))
+      Plugin_MakeStub(plugin);
+
+    //Add plugin to the plugin list before anything refers to it
+    if (PluginList_Add(plugin)) {
+      SYSLOG(LOG_ERR, "LoadPlugin: Error registering plugin %s.", entry->path);
+      Plugin_Free(plugin, 1);
+      continue;
+    }
+
+    if (!enabled) {
+      deferred++;
+      continue;
+    }
+
+    //start scheduling if the plugin is enabled
+    Plugin_Enable(plugin);
+    PluginLoader_InitSocketConnection(plugin);
+    loaded++;
+  }
+
+  double registerMs = ElapsedMs(&phase);
+  freeEntries(entries, count);
+
+  syslog(LOG_INFO, "Plugin load: %zu plugins (%zu cached, %zu deferred), "
+                 "scan %.1fms, parse %.1fms, register %.1fms, total %.1fms",
+         loaded, cached, deferred, scanMs, parseMs, registerMs, ElapsedMs(&start));
+
+  return status;
+}
+
 int PluginLoader_InstallPlugin(char *destDirectory, char *url) {
 
 
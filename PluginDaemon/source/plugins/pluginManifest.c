@@ -0,0 +1,441 @@
+/*
+ * PluginManifest:
+ *
+ * A single file caching every plugin's parsed configuration so a cold start
+ * can skip reading and parsing plugin.conf for plugins that have not changed.
+ * The file is mapped read only and entries are copied out of it, so the
+ * loader's worker threads can restore plugins concurrently.
+ *
+ * Layout, all integers native endian:
+ *
+ *  header: "SRPM" u32 version, u32 entry count
+ *  entry:  str name, PluginStamp_t, i32 flags, i32 periodLen, table config
+ *  table:  u32 size, u32 count, count * (u32 slot, str key, str value)
+ *  str:    u32 length, length bytes, '\0'
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "pluginManifest.h"
+#include "hashIndex.h"
+#include "hashtable.h"
+#include "misc.h"
+#include "pluginState.h"
+
+#define MANIFEST_MAGIC "SRPM"
+#define MANIFEST_MAGIC_LEN 4
+#define MANIFEST_VERSION 5
+
+//flags that come from a plugin's config file, everything else is runtime state
+#define MANIFEST_CONF_FLAGS (PLUGIN_FLAG_RENDER | PLUGIN_FLAG_SCRIPT_ONESHOT | PLUGIN_FLAG_OUTPUT_CLEAR |\
+                             PLUGIN_FLAG_OUTPUT_APPEND | PLUGIN_FLAG_SCRIPT_BACKGROUND)
+
+
+struct PluginManifest_s {
+    char *map;
+    size_t size;
+    //plugin name -> start of its entry in the map
+    HashIndex_t *entries;
+};
+
+typedef struct ManifestCursor_s {
+    char *pos, *end;
+} ManifestCursor_t;
+
+
+static int readBytes(ManifestCursor_t *cur, void *out, size_t len) {
+
+  if ((size_t) (cur->end - cur->pos) < len)
+    return -1;
+
+  memcpy(out, cur->pos, len);
+  cur->pos += len;
+  return 0;
+}
+
+static int readU32(ManifestCursor_t *cur, uint32_t *out) {
+
+  return readBytes(cur, out, sizeof(*out));
+}
+
+//strings are returned in place, the map keeps their terminator
+static char *readString(ManifestCursor_t *cur) {
+
+  uint32_t len = 0;
+  if (readU32(cur, &len) || (size_t) (cur->end - cur->pos) <= len || cur->pos[len] != '\0')
+    return NULL;
+
+  char *str = cur->pos;
+  cur->pos += len + 1;
+  return str;
+}
+
+//tables are restored into the plugin's config arena
+static HashTable_t *readTable(ManifestCursor_t *cur, Arena_t *arena) {
+
+  uint32_t size = 0, count = 0;
+  if (readU32(cur, &size) || readU32(cur, &count) || size == 0 || count > size)
+    return NULL;
+
+  //the saved slots are only valid in a table of exactly the saved size
+  HashTable_t *table = HashTable_initArena(1, arena);
+  if (!table)
+    return NULL;
+
+  if (table->size != size && HashTable_resize(table, size))
+    goto err;
+
+  if (table->size != size)
+    goto err;
+
+  //entries go back into the slots they were saved from, so lookups
+  //see the same table the parser built
+  uint32_t i = 0;
+  for (i = 0; i < count; i++) {
+    uint32_t slot = 0;
+    if (readU32(cur, &slot) || slot >= size || table->entries[slot])
+      goto err;
+
+    char *key = readString(cur), *value = readString(cur);
+    if (!key || !value)
+      goto err;
+
+    table->entries[slot] = HashTable_newEntry(table, key, value);
+    if (!table->entries[slot])
+      goto err;
+
+    table->count++;
+  }
+
+  return table;
+
+  err:
+  HashTable_destroy(table);
+  return NULL;
+}
+
+static int skipTable(ManifestCursor_t *cur) {
+
+  uint32_t size = 0, count = 0;
+  if (readU32(cur, &size) || readU32(cur, &count))
+    return -1;
+
+  uint32_t i = 0, slot = 0;
+  for (i = 0; i < count; i++) {
+    if (readU32(cur, &slot) || !readString(cur) || !readString(cur))
+      return -1;
+  }
+
+  return 0;
+}
+
+//skip over one whole entry, returns -1 if it runs past the end of the map
+static int skipEntry(ManifestCursor_t *cur) {
+
+  if (!readString(cur) || (size_t) (cur->end - cur->pos) < sizeof(PluginStamp_t) + 2 * sizeof(int32_t))
+    return -1;
+
+  cur->pos += sizeof(PluginStamp_t) + 2 * sizeof(int32_t);
+  return skipTable(cur);
+}
+
+static int statStamp(char *path, char *file, int64_t *size, int64_t *sec, int64_t *nsec) {
+
+  char filePath[PATH_MAX];
+  snprintf(filePath, PATH_MAX, "%s/%s", path, file);
+
+  struct stat st;
+  if (stat(filePath, &st))
+    return -1;
+
+  *size = st.st_size;
+  *sec = st.st_mtim.tv_sec;
+  *nsec = st.st_mtim.tv_nsec;
+  return 0;
+}
+
+/*
+ * Record the size and modification time of the files a plugin is parsed from.
+ * Take the stamp before parsing, so a file changed mid-parse is re-read next boot.
+ */
+int PluginManifest_Stamp(char *path, PluginStamp_t *stamp) {
+
+  memset(stamp, 0, sizeof(PluginStamp_t));
+
+  if (statStamp(path, PLUGIN_CONF_FILENAME, &stamp->confSize, &stamp->confSec, &stamp->confNsec))
+    return -1;
+
+  return 0;
+}
+
+/*
+ * Map the manifest of a plugin directory and index its entries.
+ *
+ * Returns NULL if there is no usable manifest, in which case every
+ * plugin is parsed from its files.
+ */
+PluginManifest_t *PluginManifest_Open(char *pluginDir) {
+
+  char filePath[PATH_MAX];
+  snprintf(filePath, PATH_MAX, "%s/%s", pluginDir, PLUGIN_MANIFEST_FILE);
+
+  int fd = open(filePath, O_RDONLY);
+  if (fd < 0)
+    return NULL;
+
+  struct stat st;
+  if (fstat(fd, &st) || st.st_size < MANIFEST_MAGIC_LEN + 2 * sizeof(uint32_t)) {
+    close(fd);
+    return NULL;
+  }
+
+  char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    SYSLOG(LOG_ERR, "PluginManifest: Error mapping %s", filePath);
+    return NULL;
+  }
+
+  PluginManifest_t *manifest = calloc(1, sizeof(PluginManifest_t));
+  if (!manifest) {
+    munmap(map, st.st_size);
+    return NULL;
+  }
+
+  manifest->map = map;
+  manifest->size = st.st_size;
+
+  ManifestCursor_t cur = {.pos = map, .end = map + st.st_size};
+  uint32_t version = 0, count = 0;
+
+  if (memcmp(cur.pos, MANIFEST_MAGIC, MANIFEST_MAGIC_LEN))
+    goto err;
+
+  cur.pos += MANIFEST_MAGIC_LEN;
+  if (readU32(&cur, &version) || version != MANIFEST_VERSION || readU32(&cur, &count))
+    goto err;
+
+  manifest->entries = HashIndex_init(count);
+  if (!manifest->entries)
+    goto err;
+
+  //validate the whole file up front, restoring then never has to back out
+  uint32_t i = 0;
+  for (i = 0; i < count; i++) {
+    char *entry = cur.pos;
+    if (skipEntry(&cur))
+      goto err;
+
+    //the name leads the entry, so a second cursor can read it back in place
+    ManifestCursor_t nameCur = {.pos = entry, .end = cur.pos};
+    if (HashIndex_add(manifest->entries, readString(&nameCur), entry))
+      goto err;
+  }
+
+  SYSLOG(LOG_INFO, "PluginManifest: %u cached plugins", count);
+  return manifest;
+
+  err:
+  SYSLOG(LOG_ERR, "PluginManifest: Ignoring malformed manifest %s", filePath);
+  PluginManifest_Close(manifest);
+  return NULL;
+}
+
+size_t PluginManifest_Count(PluginManifest_t *manifest) {
+
+  if (!manifest || !manifest->entries)
+    return 0;
+
+  return HashIndex_getCount(manifest->entries);
+}
+
+/*
+ * Build a plugin from its cached entry.
+ *
+ * Returns NULL if the plugin is not in the manifest or its files no longer
+ * match stamp; the caller then parses the plugin as usual.
+ */
+Plugin_t *PluginManifest_Restore(PluginManifest_t *manifest, char *path, char *name, PluginStamp_t *stamp) {
+
+  if (!manifest)
+    return NULL;
+
+  char *entry = HashIndex_find(manifest->entries, name);
+  if (!entry)
+    return NULL;
+
+  ManifestCursor_t cur = {.pos = entry, .end = manifest->map + manifest->size};
+  PluginStamp_t saved;
+  int32_t flags = 0, periodLen = 0;
+
+  readString(&cur);
+  readBytes(&cur, &saved, sizeof(saved));
+  if (memcmp(&saved, stamp, sizeof(saved)))
+    return NULL;
+
+  readBytes(&cur, &flags, sizeof(flags));
+  readBytes(&cur, &periodLen, sizeof(periodLen));
+
+  //a plugin that doesn't start on load is only registered
+  if (!(flags & PLUGIN_FLAG_RENDER))
+    return Plugin_CreateStub(path, name);
+
+  Plugin_t *plugin = Plugin_Create();
+  if (!plugin)
+    return NULL;
+
+  plugin->basePath = strdup(path);
+  if (!plugin->basePath || Plugin_SetName(plugin, name))
+    goto err;
+
+  if (Plugin_initConfig(plugin))
+    goto err;
+
+  HashTable_destroy(plugin->config.table);
+  plugin->config.table = readTable(&cur, plugin->config.arena);
+  if (!plugin->config.table || PluginConf_Materialize(plugin))
+    goto err;
+
+  //the saved state wins over whatever materializing the settings set
+  plugin->flags = (plugin->flags & ~MANIFEST_CONF_FLAGS) | (flags & MANIFEST_CONF_FLAGS);
+  plugin->config.periodLen = periodLen;
+
+  //saved css lives in the state store rather than the manifest
+  PluginCSS_load(plugin);
+
+  SYSLOG(LOG_INFO, "PluginManifest: restored %s", name);
+  return plugin;
+
+  err:
+  Plugin_Free(plugin, 1);
+  return NULL;
+}
+
+void PluginManifest_Close(PluginManifest_t *manifest) {
+
+  if (!manifest)
+    return;
+
+  if (manifest->entries)
+    HashIndex_destroy(manifest->entries);
+
+  munmap(manifest->map, manifest->size);
+  free(manifest);
+}
+
+
+static void writeU32(FILE *out, uint32_t value) {
+
+  fwrite(&value, sizeof(value), 1, out);
+}
+
+static void writeString(FILE *out, char *str) {
+
+  uint32_t len = strlen(str);
+  writeU32(out, len);
+  fwrite(str, 1, len + 1, out);
+}
+
+static void writeTable(FILE *out, HashTable_t *table) {
+
+  uint32_t count = 0;
+  size_t i = 0;
+  for (i = 0; i < table->size; i++) {
+    if (table->entries[i] && table->entries[i]->key && table->entries[i]->value)
+      count++;
+  }
+
+  writeU32(out, table->size);
+  writeU32(out, count);
+
+  for (i = 0; i < table->size; i++) {
+    HashData_t *entry = table->entries[i];
+    if (!entry || !entry->key || !entry->value)
+      continue;
+
+    writeU32(out, i);
+    writeString(out, entry->key);
+    writeString(out, entry->value);
+  }
+}
+
+//the bytes of a stub's entry in the previous manifest, NULL if it has none
+static char *previousEntry(PluginManifest_t *previous, Plugin_t *plugin, size_t *len) {
+
+  if (!previous)
+    return NULL;
+
+  char *entry = HashIndex_find(previous->entries, Plugin_GetName(plugin));
+  if (!entry)
+    return NULL;
+
+  ManifestCursor_t cur = {.pos = entry, .end = previous->map + previous->size};
+  skipEntry(&cur);
+  *len = cur.pos - entry;
+  return entry;
+}
+
+/*
+ * Write the manifest for freshly parsed plugins. stamps[i] must have been taken
+ * before plugins[i] was parsed. Stubs are copied from the previous manifest.
+ * The new file replaces the old one atomically.
+ */
+int PluginManifest_Save(char *pluginDir, PluginManifest_t *previous, Plugin_t **plugins, PluginStamp_t *stamps,
+                        size_t count) {
+
+  char filePath[PATH_MAX];
+  snprintf(filePath, PATH_MAX, "%s/%s", pluginDir, PLUGIN_MANIFEST_FILE);
+
+  //built in memory, then written out in one go
+  char *data = NULL;
+  size_t dataLen = 0;
+  FILE *out = open_memstream(&data, &dataLen);
+  if (!out) {
+    SYSLOG(LOG_ERR, "PluginManifest: Error building %s", filePath);
+    return -1;
+  }
+
+  size_t i = 0, len = 0, written = 0;
+  for (i = 0; i < count; i++)
+    written += !Plugin_IsStub(plugins[i]) || previousEntry(previous, plugins[i], &len);
+
+  fwrite(MANIFEST_MAGIC, 1, MANIFEST_MAGIC_LEN, out);
+  writeU32(out, MANIFEST_VERSION);
+  writeU32(out, written);
+
+  for (i = 0; i < count; i++) {
+    Plugin_t *plugin = plugins[i];
+    if (Plugin_IsStub(plugin)) {
+      char *entry = previousEntry(previous, plugin, &len);
+      if (entry)
+        fwrite(entry, 1, len, out);
+      continue;
+    }
+
+    int32_t flags = plugin->flags & MANIFEST_CONF_FLAGS;
+    int32_t periodLen = plugin->config.periodLen;
+
+    writeString(out, Plugin_GetName(plugin));
+    fwrite(&stamps[i], sizeof(PluginStamp_t), 1, out);
+    fwrite(&flags, sizeof(flags), 1, out);
+    fwrite(&periodLen, sizeof(periodLen), 1, out);
+    writeTable(out, plugin->config.table);
+  }
+
+  int status = ferror(out);
+  status = fclose(out) || status || WriteFileAtomic(filePath, data, dataLen, 0644);
+  free(data);
+  if (status) {
+    SYSLOG(LOG_ERR, "PluginManifest: Error writing %s", filePath);
+    return -1;
+  }
+
+  return 0;
+}
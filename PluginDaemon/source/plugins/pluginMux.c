@@ -0,0 +1,224 @@
+/*
+ * PluginMux:
+ *
+ * Carries every plugin's daemon <-> frontend traffic over a single display
+ * connection instead of one websocket per plugin. Each frame is tagged with
+ * the plugin's channel, see pluginMux.h for the framing.
+ *
+ * Once a channel is attached, the plugin treats the mux connection as its
+ * socketInstance, so everything that works over a plugin's own protocol
+ * (load, write, setcss, jsPluginCmd, [API] calls) works here unchanged.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <libwebsockets.h>
+
+#include "pluginMux.h"
+#include "pluginSocket.h"
+#include "plugin.h"
+#include "socketResponse.h"
+#include "misc.h"
+
+#define MUX_CHANNEL_OPEN '+'
+#define MUX_CHANNEL_CLOSE '-'
+#define MUX_CHANNEL_SEP '\n'
+
+
+static int _muxEnabled = 1;
+
+static int _muxCallback(struct lws *wsi, enum lws_callback_reasons reason, void *user, void *in, size_t len);
+
+static struct lws_protocols muxProtocol = {
+        .name=PLUGIN_MUX_PROTOCOL, .callback=_muxCallback,
+        .per_session_data_size=sizeof(SocketResponse_t),
+        .rx_buffer_size=PLUGIN_RX_BUFFER_SIZE
+};
+
+
+/*
+ * Parse a channel number and return the plugin it belongs to.
+ * end is set to the first character after the number.
+ */
+static Plugin_t *channelPlugin(char *str, char **end) {
+
+  unsigned long channel = strtoul(str, end, 10);
+  if (*end == str)
+    return NULL;
+
+  struct lws_protocols *proto = PluginSocket_getProtocolByHandle((unsigned int) channel);
+  if (!proto || !proto->user)
+    return NULL;
+
+  //the plugin's daemon protocol also points at the plugin, only its web protocol is a channel
+  Plugin_t *plugin = (Plugin_t *) proto->user;
+  if (plugin->channel != channel)
+    return NULL;
+
+  return plugin;
+}
+
+/*
+ * (PluginList_ForEach) callback function.
+ *
+ * Detaches every plugin that is using the closing mux connection.
+ */
+static int detachConnection(void *plug, void *wsi) {
+
+  Plugin_t *plugin = (Plugin_t *) plug;
+
+  if (plugin->flags & PLUGIN_FLAG_MUXED && plugin->socketInstance == wsi)
+    Plugin_ClientDetach(plugin);
+
+  return 0;
+}
+
+static void muxReceive(struct lws *wsi, SocketResponse_t *session) {
+
+  char *msg = SocketResponse_get(session);
+  char *end = NULL;
+  Plugin_t *plugin = NULL;
+
+  switch (msg[0]) {
+    case MUX_CHANNEL_OPEN:
+      plugin = channelPlugin(msg + 1, &end);
+      if (plugin)
+        Plugin_ClientAttach(plugin, wsi, 1);
+      else
+        SYSLOG(LOG_ERR, "PluginMux: open for unknown channel %s", msg + 1);
+      break;
+
+    case MUX_CHANNEL_CLOSE:
+      plugin = channelPlugin(msg + 1, &end);
+      if (plugin && plugin->socketInstance == wsi)
+        Plugin_ClientDetach(plugin);
+      break;
+
+    default:
+      plugin = channelPlugin(msg, &end);
+      if (!plugin || *end != MUX_CHANNEL_SEP || plugin->socketInstance != wsi) {
+        SYSLOG(LOG_ERR, "PluginMux: dropping message for unattached channel");
+        break;
+      }
+
+      //strip the channel header, then handle it like the plugin's own socket would
+      SocketResponse_skip(session, (end + 1) - msg);
+      Plugin_ClientReceive(plugin, wsi, session);
+      return;
+  }
+
+  SocketResponse_free(session);
+}
+
+static int _muxCallback(struct lws *wsi, enum lws_callback_reasons reason, void *user, void *in, size_t len) {
+
+  SocketResponse_t *session = (SocketResponse_t *) user;
+
+  switch (reason) {
+    case LWS_CALLBACK_SERVER_WRITEABLE:
+      PluginSocket_writeBuffers(wsi);
+      lws_callback_on_writable(wsi);
+      break;
+
+    case LWS_CALLBACK_ESTABLISHED:
+      SYSLOG(LOG_INFO, "PluginMux: display connected");
+      PluginSocket_openWriteBuffers(wsi);
+      lws_callback_on_writable(wsi);
+      break;
+
+    case LWS_CALLBACK_RECEIVE:
+      if (!len || !session)
+        return 0;
+
+      SocketResponse_build(session, wsi, (char *) in, len);
+      if (SocketResponse_done(session))
+        muxReceive(wsi, session);
+      break;
+
+    case LWS_CALLBACK_CLOSED:
+      SYSLOG(LOG_INFO, "PluginMux: display disconnected");
+      if (session)
+        SocketResponse_free(session);
+
+      PluginList_ForEach(detachConnection, wsi);
+      PluginSocket_closeWriteBuffers(wsi);
+      break;
+
+    default:
+      break;
+  }
+
+  return 0;
+}
+
+/*
+ * Choose between the multiplexed display connection (default) and
+ * one websocket per plugin. Must be set before PluginMux_Init.
+ */
+void PluginMux_SetEnabled(int enabled) {
+
+  _muxEnabled = enabled;
+}
+
+int PluginMux_IsEnabled(void) {
+
+  return _muxEnabled;
+}
+
+/*
+ * Register the mux protocol with the socket server, if enabled.
+ */
+int PluginMux_Init(void) {
+
+  if (!_muxEnabled)
+    return 0;
+
+  return PluginSocket_AddProtocol(&muxProtocol);
+}
+
+/*
+ * Protocol name the display should open for the mux connection,
+ * or an empty string when plugins use their own sockets.
+ */
+char *PluginMux_GetProtocolName(void) {
+
+  if (!_muxEnabled)
+    return "";
+
+  return PLUGIN_MUX_PROTOCOL;
+}
+
+/*
+ * Write the frame header for a channel into buf, which needs room for
+ * PLUGIN_MUX_HEADER_MAX bytes. Returns the header's length.
+ */
+int PluginMux_Header(char *buf, unsigned int channel) {
+
+  return snprintf(buf, PLUGIN_MUX_HEADER_MAX, "%u%c", channel, MUX_CHANNEL_SEP);
+}
+
+/*
+ * Queue a message for one channel of a mux connection. Channels share the
+ * connection's queue, so a nonzero tag has to be unique across channels.
+ */
+int PluginMux_Write(struct lws *wsi, unsigned int channel, char *msg, size_t len, unsigned int tag) {
+
+  if (!wsi || !msg)
+    return -1;
+
+  char header[PLUGIN_MUX_HEADER_MAX];
+  int headerLen = PluginMux_Header(header, channel);
+
+  char *out = malloc(LWS_SEND_BUFFER_PRE_PADDING + headerLen + len);
+  if (!out) {
+    SYSLOG(LOG_ERR, "PluginMux_Write: Error allocating message for channel %u", channel);
+    return -1;
+  }
+
+  memcpy(out + LWS_SEND_BUFFER_PRE_PADDING, header, headerLen);
+  memcpy(out + LWS_SEND_BUFFER_PRE_PADDING + headerLen, msg, len);
+
+  //out already has the LWS padding and is free'd once written
+  return PluginSocket_writeTagged(wsi, out, headerLen + len, 1, tag);
+}
@@ -0,0 +1,541 @@
+/*
+ * PluginState:
+ *
+ * One file for the state every plugin picks up at runtime, replacing a
+ * position.txt per plugin folder and the start-on-load rewrites of each
+ * plugin.conf. The file is read with a single sequential read at startup
+ * into an index by plugin name; from then on every change only appends.
+ *
+ * Layout, one record per line, fields separated by tabs:
+ *
+ *  header: "SRPS" version
+ *  p name              plugin is known to the store
+ *  e name 0|1          enabled or disabled through the API
+ *  c name attr value   saved css attribute
+ *
+ * A later record for the same key replaces the earlier one. Once most of the
+ * log is replaced records, it is rewritten with only the live ones and
+ * renamed over the old file. A half written last line is dropped when read.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <syslog.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "pluginState.h"
+#include "hashIndex.h"
+#include "hashtable.h"
+#include "misc.h"
+
+#define STATE_MAGIC "SRPS"
+#define STATE_VERSION 1
+#define STATE_MAX_FIELDS 4
+
+#define STATE_INDEX_INIT_SIZE 32
+#define STATE_CSS_INIT_SIZE 8
+//stale records tolerated before the log is worth rewriting
+#define STATE_COMPACT_SLACK 256
+
+
+typedef struct StateEntry_s {
+    //-1 until the plugin is enabled or disabled through the API
+    int enabled;
+    HashTable_t *css;
+} StateEntry_t;
+
+typedef struct StateBuffer_s {
+    char *data;
+    size_t len, size;
+} StateBuffer_t;
+
+
+//guards everything below, the loader reads the store from its worker threads
+static pthread_mutex_t _lock = PTHREAD_MUTEX_INITIALIZER;
+static HashIndex_t *_plugins = NULL;
+static int _fd = -1;
+static char _path[PATH_MAX];
+//records in the log, replaced ones included
+static size_t _records = 0;
+
+
+static StateEntry_t *findEntry(const char *name, int create) {
+
+  StateEntry_t *entry = HashIndex_find(_plugins, name);
+  if (entry || !create)
+    return entry;
+
+  entry = calloc(1, sizeof(StateEntry_t));
+  if (!entry)
+    return NULL;
+
+  entry->enabled = -1;
+  entry->css = HashTable_init(STATE_CSS_INIT_SIZE);
+  if (!entry->css || HashIndex_add(_plugins, name, entry)) {
+    HashTable_destroy(entry->css);
+    free(entry);
+    return NULL;
+  }
+
+  return entry;
+}
+
+static void freeEntries(void) {
+
+  if (!_plugins)
+    return;
+
+  size_t i = 0;
+  for (i = 0; i < _plugins->size; i++) {
+    StateEntry_t *entry = _plugins->entries[i].value;
+    if (!_plugins->entries[i].key || !entry)
+      continue;
+
+    HashTable_destroy(entry->css);
+    free(entry);
+  }
+
+  HashIndex_destroy(_plugins);
+  _plugins = NULL;
+}
+
+//fields are tab separated and records newline terminated
+static int validField(const char *field) {
+
+  return field && !strpbrk(field, "\t\n");
+}
+
+static int bufferAppend(StateBuffer_t *buf, const char *fmt, ...) {
+
+  va_list args;
+  va_start(args, fmt);
+  int len = vsnprintf(buf->data ? buf->data + buf->len : NULL, buf->data ? buf->size - buf->len : 0, fmt, args);
+  va_end(args);
+
+  if (len < 0)
+    return -1;
+
+  if (buf->len + len < buf->size) {
+    buf->len += len;
+    return 0;
+  }
+
+  size_t newSize = buf->size ? buf->size : 256;
+  while (newSize <= buf->len + len)
+    newSize <<= 1;
+
+  char *data = realloc(buf->data, newSize);
+  if (!data)
+    return -1;
+
+  buf->data = data;
+  buf->size = newSize;
+
+  va_start(args, fmt);
+  vsnprintf(buf->data + buf->len, buf->size - buf->len, fmt, args);
+  va_end(args);
+
+  buf->len += len;
+  return 0;
+}
+
+static void applyRecord(char **fields, int count) {
+
+  if (count < 2 || fields[0][1] != '\0')
+    return;
+
+  StateEntry_t *entry = findEntry(fields[1], 1);
+  if (!entry)
+    return;
+
+  switch (fields[0][0]) {
+    case 'e':
+      if (count == 3)
+        entry->enabled = (fields[2][0] == '1');
+      break;
+    case 'c':
+      if (count == 4)
+        HashTable_set(entry->css, fields[2], fields[3]);
+      break;
+    default:
+      break;
+  }
+}
+
+/*
+ * Apply every complete record in data. Returns the length of the
+ * records read, so a torn last line can be cut off.
+ */
+static size_t parseLog(char *data, size_t len) {
+
+  char *pos = data, *end = data + len;
+  char *line = memchr(pos, '\n', len);
+  char magic[8];
+  int version = 0;
+
+  if (!line)
+    return 0;
+
+  *line = '\0';
+  if (sscanf(pos, "%4s %d", magic, &version) != 2 || strcmp(magic, STATE_MAGIC) || version != STATE_VERSION)
+    return 0;
+
+  pos = line + 1;
+  while (pos < end && (line = memchr(pos, '\n', end - pos))) {
+    *line = '\0';
+
+    char *fields[STATE_MAX_FIELDS];
+    int count = 0;
+    char *field = pos;
+    while (count < STATE_MAX_FIELDS) {
+      fields[count++] = field;
+      field = strchr(field, '\t');
+      if (!field)
+        break;
+
+      *field++ = '\0';
+    }
+
+    //a stray tab means the record isn't one of ours
+    if (!field)
+      applyRecord(fields, count);
+
+    _records++;
+    pos = line + 1;
+  }
+
+  return pos - data;
+}
+
+static size_t liveRecords(void) {
+
+  size_t i = 0, live = 0;
+  for (i = 0; i < _plugins->size; i++) {
+    StateEntry_t *entry = _plugins->entries[i].value;
+    if (!_plugins->entries[i].key || !entry)
+      continue;
+
+    size_t records = (entry->enabled >= 0) + entry->css->count;
+    live += records ? records : 1;
+  }
+
+  return live;
+}
+
+/*
+ * Rewrite the log with only its live records and swap it in,
+ * with _lock held.
+ */
+static int compact(void) {
+
+  StateBuffer_t buf = {0};
+  int status = bufferAppend(&buf, "%s %d\n", STATE_MAGIC, STATE_VERSION);
+  size_t records = 0;
+
+  size_t i = 0, j = 0;
+  for (i = 0; i < _plugins->size && !status; i++) {
+    char *name = _plugins->entries[i].key;
+    StateEntry_t *entry = _plugins->entries[i].value;
+    if (!name || !entry)
+      continue;
+
+    if (entry->enabled < 0 && !entry->css->count) {
+      status |= bufferAppend(&buf, "p\t%s\n", name);
+      records++;
+      continue;
+    }
+
+    if (entry->enabled >= 0) {
+      status |= bufferAppend(&buf, "e\t%s\t%d\n", name, entry->enabled);
+      records++;
+    }
+
+    for (j = 0; j < entry->css->size; j++) {
+      HashData_t *css = entry->css->entries[j];
+      if (!css)
+        continue;
+
+      status |= bufferAppend(&buf, "c\t%s\t%s\t%s\n", name, css->key, css->value);
+      records++;
+    }
+  }
+
+  status = status || WriteFileAtomic(_path, buf.data, buf.len, 0644);
+  free(buf.data);
+  if (status) {
+    SYSLOG(LOG_ERR, "PluginState: Error compacting %s", _path);
+    return -1;
+  }
+
+  //appends carry on at the end of the new file, the old one is gone
+  if (_fd >= 0)
+    close(_fd);
+  _fd = open(_path, O_RDWR | O_APPEND | O_CLOEXEC);
+  if (_fd < 0) {
+    SYSLOG(LOG_ERR, "PluginState: Error reopening %s, state won't be saved", _path);
+    return -1;
+  }
+
+  SYSLOG(LOG_INFO, "PluginState: compacted %zu records down to %zu", _records, records);
+  _records = records;
+  return 0;
+}
+
+static void compactIfStale(void) {
+
+  if (_records > STATE_COMPACT_SLACK && _records > 2 * liveRecords())
+    compact();
+}
+
+/*
+ * Append a batch of records in one write, with _lock held.
+ * Compaction rebuilds the log from memory, so callers only
+ * compactIfStale once the store holds what they appended.
+ */
+static int appendRecords(StateBuffer_t *buf, size_t records) {
+
+  if (!buf->len)
+    return 0;
+
+  if (_fd < 0 || WriteAll(_fd, buf->data, buf->len)) {
+    SYSLOG(LOG_ERR, "PluginState: Error appending to %s", _path);
+    return -1;
+  }
+
+  _records += records;
+  return 0;
+}
+
+
+/*
+ * Read the state file of a plugin directory, creating it if there is none.
+ * Until it is opened, or if it can't be, the store is empty and saving
+ * through it fails.
+ */
+int PluginState_Open(char *pluginDir) {
+
+  pthread_mutex_lock(&_lock);
+
+  int status = -1;
+  if (_plugins)
+    goto done;
+
+  _plugins = HashIndex_init(STATE_INDEX_INIT_SIZE);
+  if (!_plugins)
+    goto done;
+
+  _records = 0;
+  snprintf(_path, PATH_MAX, "%s/%s", pluginDir, PLUGIN_STATE_FILE);
+
+  _fd = open(_path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+  if (_fd < 0) {
+    SYSLOG(LOG_ERR, "PluginState: Error opening %s", _path);
+    goto done;
+  }
+
+  struct stat st;
+  char *data = NULL;
+  if (fstat(_fd, &st) || !(data = malloc(st.st_size + 1))) {
+    SYSLOG(LOG_ERR, "PluginState: Error reading %s", _path);
+    goto done;
+  }
+
+  ssize_t got = 0, total = 0;
+  while (total < st.st_size && (got = pread(_fd, data + total, st.st_size - total, total)) != 0) {
+    if (got < 0 && errno == EINTR)
+      continue;
+    if (got < 0)
+      break;
+    total += got;
+  }
+
+  size_t used = parseLog(data, total);
+  free(data);
+
+  //a new or unreadable log starts over, a torn last record is cut off
+  if (!used) {
+    if (compact())
+      goto done;
+  }
+  else if (used < (size_t) total && ftruncate(_fd, used))
+    SYSLOG(LOG_ERR, "PluginState: Error truncating %s", _path);
+  else
+    compactIfStale();
+
+  SYSLOG(LOG_INFO, "PluginState: %zu plugins from %zu records", HashIndex_getCount(_plugins), _records);
+  status = 0;
+
+  done:
+  if (status && _fd >= 0) {
+    close(_fd);
+    _fd = -1;
+  }
+  pthread_mutex_unlock(&_lock);
+  return status;
+}
+
+/*
+ * Whether a plugin was last enabled (1) or disabled (0) through the API,
+ * -1 if it never was and its config decides.
+ */
+int PluginState_GetEnabled(char *name) {
+
+  pthread_mutex_lock(&_lock);
+
+  StateEntry_t *entry = (_plugins && name) ? findEntry(name, 0) : NULL;
+  int enabled = entry ? entry->enabled : -1;
+
+  pthread_mutex_unlock(&_lock);
+  return enabled;
+}
+
+int PluginState_SetEnabled(char *name, int enabled) {
+
+  if (!validField(name))
+    return -1;
+
+  enabled = (enabled != 0);
+  pthread_mutex_lock(&_lock);
+
+  int status = -1;
+  StateEntry_t *entry = (_plugins && _fd >= 0) ? findEntry(name, 1) : NULL;
+  if (!entry)
+    goto done;
+
+  status = 0;
+  if (entry->enabled == enabled)
+    goto done;
+
+  StateBuffer_t buf = {0};
+  status = bufferAppend(&buf, "e\t%s\t%d\n", name, enabled) || appendRecords(&buf, 1);
+  if (!status) {
+    entry->enabled = enabled;
+    compactIfStale();
+  }
+  free(buf.data);
+
+  done:
+  pthread_mutex_unlock(&_lock);
+  return status;
+}
+
+/*
+ * Copy a plugin's saved css into its table.
+ *
+ * Returns -1 if the store doesn't know the plugin yet.
+ */
+int PluginState_LoadCSS(Plugin_t *plugin) {
+
+  char *name = Plugin_GetName(plugin);
+  if (!name || !plugin->cssAttr)
+    return -1;
+
+  pthread_mutex_lock(&_lock);
+
+  StateEntry_t *entry = _plugins ? findEntry(name, 0) : NULL;
+  if (entry) {
+    size_t i = 0;
+    for (i = 0; i < entry->css->size; i++) {
+      HashData_t *css = entry->css->entries[i];
+      if (css)
+        HashTable_set(plugin->cssAttr, css->key, css->value);
+    }
+  }
+
+  pthread_mutex_unlock(&_lock);
+  return entry ? 0 : -1;
+}
+
+/*
+ * Save a plugin's css table. Only attributes that differ from what the
+ * store already holds are appended, all in one write; a plugin new to
+ * the store is added even if it has no css.
+ */
+int PluginState_SaveCSS(Plugin_t *plugin) {
+
+  char *name = Plugin_GetName(plugin);
+  if (!validField(name) || !plugin->cssAttr)
+    return -1;
+
+  pthread_mutex_lock(&_lock);
+
+  int status = -1;
+  StateBuffer_t buf = {0};
+  size_t records = 0;
+
+  if (!_plugins || _fd < 0)
+    goto done;
+
+  StateEntry_t *entry = findEntry(name, 0);
+  int known = (entry != NULL);
+  if (!entry && !(entry = findEntry(name, 1)))
+    goto done;
+
+  HashTable_t *css = plugin->cssAttr;
+  status = 0;
+
+  size_t i = 0;
+  for (i = 0; i < css->size && !status; i++) {
+    HashData_t *attr = css->entries[i];
+    if (!attr || !attr->key || !attr->value)
+      continue;
+
+    HashData_t *saved = HashTable_find(entry->css, attr->key);
+    if (saved && !strcmp(saved->value, attr->value))
+      continue;
+
+    if (!validField(attr->key) || !validField(attr->value)) {
+      SYSLOG(LOG_ERR, "PluginState: Skipping unsaveable css %s for %s", attr->key, name);
+      continue;
+    }
+
+    status = bufferAppend(&buf, "c\t%s\t%s\t%s\n", name, attr->key, attr->value);
+    records++;
+  }
+
+  if (!status && !known && !records) {
+    status = bufferAppend(&buf, "p\t%s\n", name);
+    records++;
+  }
+
+  if (!status)
+    status = appendRecords(&buf, records);
+
+  //the store only takes on what made it into the file
+  for (i = 0; i < css->size && !status; i++) {
+    HashData_t *attr = css->entries[i];
+    if (attr && attr->key && attr->value && validField(attr->key) && validField(attr->value))
+      HashTable_set(entry->css, attr->key, attr->value);
+  }
+
+  if (!status)
+    compactIfStale();
+
+  done:
+  pthread_mutex_unlock(&_lock);
+  free(buf.data);
+  return status;
+}
+
+/*
+ * Close the state file and drop the store.
+ */
+void PluginState_Close(void) {
+
+  pthread_mutex_lock(&_lock);
+
+  if (_fd >= 0)
+    close(_fd);
+  _fd = -1;
+
+  freeEntries();
+  _records = 0;
+
+  pthread_mutex_unlock(&_lock);
+}
@@ -0,0 +1,461 @@
+/*
+ * PluginWatch:
+ *
+ * inotify watches on the plugin directory (folders coming and going) and on
+ * every plugin folder in it (plugin.conf being written or replaced).
+ *
+ * Changes are collected for a whole batch of events before being applied, so
+ * an editor or git writing a file several times only costs one reload.
+ *
+ * Every folder also remembers the plugin.conf its plugin was last loaded from,
+ * which lets PluginWatch_Rescan diff the whole directory without inotify.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+
+#include "pluginWatch.h"
+#include "pluginLoader.h"
+#include "api.h"
+#include "configWriter.h"
+#include "misc.h"
+
+#define WATCH_ROOT_EVENTS (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR)
+#define WATCH_PLUGIN_EVENTS (IN_CLOSE_WRITE | IN_MOVED_TO | IN_ONLYDIR)
+#define WATCH_BASE_DIRS 16
+#define WATCH_BUF_LEN 4096
+
+
+typedef struct WatchedDir_s {
+    int wd;
+    //plugin folder name, which is also the plugin's name
+    char *name;
+    //folder appeared or its plugin.conf changed since the last batch
+    int changed;
+    //still on disk, used while rescanning
+    int seen;
+    //plugin.conf as last loaded or written by the daemon, confValid is 0 when there was none
+    int confValid;
+    off_t confSize;
+    struct timespec confMtime;
+} WatchedDir_t;
+
+static int _watchFd = -1;
+static int _rootWd = -1;
+static char *_pluginDir = NULL;
+//events were dropped, only a full rescan can catch up
+static int _overflowed = 0;
+
+static WatchedDir_t *_dirs = NULL;
+static size_t _dirCount = 0, _dirSize = 0;
+
+
+static WatchedDir_t *findByWd(int wd) {
+
+  size_t i = 0;
+  for (i = 0; i < _dirCount; i++) {
+    if (_dirs[i].wd == wd)
+      return &_dirs[i];
+  }
+
+  return NULL;
+}
+
+static WatchedDir_t *findByName(const char *name) {
+
+  size_t i = 0;
+  for (i = 0; i < _dirCount; i++) {
+    if (!strcmp(_dirs[i].name, name))
+      return &_dirs[i];
+  }
+
+  return NULL;
+}
+
+static void dropDir(WatchedDir_t *dir) {
+
+  free(dir->name);
+  *dir = _dirs[--_dirCount];
+}
+
+static int statConf(const char *name, struct stat *st) {
+
+  char path[PATH_MAX];
+  snprintf(path, PATH_MAX, "%s/%s/%s", _pluginDir, name, PLUGIN_CONF_FILENAME);
+  return stat(path, st);
+}
+
+static void recordConf(WatchedDir_t *dir) {
+
+  struct stat st;
+  dir->confValid = !statConf(dir->name, &st);
+  dir->confSize = dir->confValid ? st.st_size : 0;
+  dir->confMtime = dir->confValid ? st.st_mtim : (struct timespec) {0};
+}
+
+//the daemon's own writes are recorded by noteOwnWrite, so they don't count
+static int confChanged(WatchedDir_t *dir) {
+
+  struct stat st;
+  if (statConf(dir->name, &st))
+    return dir->confValid;
+
+  return !dir->confValid || st.st_size != dir->confSize || st.st_mtim.tv_sec != dir->confMtime.tv_sec ||
+         st.st_mtim.tv_nsec != dir->confMtime.tv_nsec;
+}
+
+/*
+ * Track a plugin folder, watching it when inotify is available. A folder
+ * found at startup was loaded along with everything else, so its current
+ * plugin.conf is recorded; a new one is left unrecorded so it gets loaded.
+ */
+static WatchedDir_t *watchDir(const char *name, int loaded) {
+
+  WatchedDir_t *dir = findByName(name);
+  if (dir)
+    return dir;
+
+  int wd = -1;
+  if (_watchFd >= 0) {
+    char path[PATH_MAX];
+    snprintf(path, PATH_MAX, "%s/%s", _pluginDir, name);
+
+    wd = inotify_add_watch(_watchFd, path, WATCH_PLUGIN_EVENTS);
+    if (wd < 0)
+      SYSLOG(LOG_ERR, "PluginWatch: Error watching %s", path);
+  }
+
+  if (_dirCount == _dirSize) {
+    size_t newSize = _dirSize ? _dirSize * 2 : WATCH_BASE_DIRS;
+    WatchedDir_t *dirs = realloc(_dirs, newSize * sizeof(WatchedDir_t));
+    if (!dirs) {
+      if (wd >= 0)
+        inotify_rm_watch(_watchFd, wd);
+      return NULL;
+    }
+
+    _dirs = dirs;
+    _dirSize = newSize;
+  }
+
+  dir = &_dirs[_dirCount];
+  memset(dir, 0, sizeof(WatchedDir_t));
+  dir->wd = wd;
+  dir->name = strdup(name);
+  if (!dir->name) {
+    if (wd >= 0)
+      inotify_rm_watch(_watchFd, wd);
+    return NULL;
+  }
+
+  if (loaded)
+    recordConf(dir);
+
+  _dirCount++;
+  return dir;
+}
+
+/*
+ * (DirectoryAction) callback function.
+ */
+static int watchExisting(char *path, struct dirent *dirInfo, void *data) {
+
+  struct stat st;
+  if (!lstat(path, &st) && S_ISDIR(st.st_mode))
+    watchDir(dirInfo->d_name, 1);
+
+  return 0;
+}
+
+/*
+ * (DirectoryAction) callback function.
+ */
+static int rescanEntry(char *path, struct dirent *dirInfo, void *data) {
+
+  struct stat st;
+  if (lstat(path, &st) || !S_ISDIR(st.st_mode))
+    return 0;
+
+  WatchedDir_t *dir = watchDir(dirInfo->d_name, 0);
+  if (dir) {
+    dir->seen = 1;
+    dir->changed = 1;
+  }
+
+  return 0;
+}
+
+/*
+ * (PluginList_ForEach) callback function.
+ */
+static int removeIfGone(void *plug, void *data) {
+
+  Plugin_t *plugin = (Plugin_t *) plug;
+  WatchedDir_t *dir = findByName(Plugin_GetName(plugin));
+  if (dir && dir->seen)
+    return 0;
+
+  SYSLOG(LOG_INFO, "PluginWatch: %s removed", Plugin_GetName(plugin));
+  API_RemovePlugin(plugin);
+  return 0;
+}
+
+static void pluginRemoved(const char *name) {
+
+  //name may belong to the tracked folder, so look the plugin up before dropping it
+  Plugin_t *plugin = PluginList_Find(name);
+  if (plugin) {
+    SYSLOG(LOG_INFO, "PluginWatch: %s removed", name);
+    API_RemovePlugin(plugin);
+  }
+
+  WatchedDir_t *dir = findByName(name);
+  if (dir) {
+    if (dir->wd >= 0)
+      inotify_rm_watch(_watchFd, dir->wd);
+    dropDir(dir);
+  }
+}
+
+/*
+ * Returns -1 if the plugin failed to load or reload, in which case
+ * it is no longer listed.
+ */
+static int pluginChanged(WatchedDir_t *dir) {
+
+  dir->changed = 0;
+  if (!confChanged(dir))
+    return 0;
+
+  recordConf(dir);
+
+  char path[PATH_MAX];
+  snprintf(path, PATH_MAX, "%s/%s", _pluginDir, dir->name);
+
+  Plugin_t *plugin = PluginList_Find(dir->name);
+  if (plugin && !dir->confValid) {
+    SYSLOG(LOG_INFO, "PluginWatch: %s lost its config", dir->name);
+    API_RemovePlugin(plugin);
+    return 0;
+  }
+
+  //a stub has nothing loaded to keep, so it is registered again from scratch
+  //in case its config now starts it on load
+  if (plugin && Plugin_IsStub(plugin)) {
+    API_RemovePlugin(plugin);
+    plugin = NULL;
+  }
+
+  if (!plugin) {
+    //either a new folder, or one that only just got its plugin.conf
+    if (!dir->confValid)
+      return 0;
+
+    SYSLOG(LOG_INFO, "PluginWatch: loading %s", dir->name);
+    return PluginLoader_LoadPlugin(path);
+  }
+
+  SYSLOG(LOG_INFO, "PluginWatch: reloading %s", dir->name);
+  return API_ReloadPlugin(plugin);
+}
+
+/*
+ * (ConfigWritten_f) callback function.
+ * The daemon's own setopt/enable/disable writes don't need a reload.
+ */
+static void noteOwnWrite(const char *file, struct stat *st, void *data) {
+
+  //file is <plugin dir>/<name>/plugin.conf
+  const char *end = strrchr(file, '/');
+  if (!end || end == file)
+    return;
+
+  const char *start = end - 1;
+  while (start > file && *(start - 1) != '/')
+    start--;
+
+  char name[PATH_MAX];
+  snprintf(name, sizeof(name), "%.*s", (int) (end - start), start);
+
+  WatchedDir_t *dir = findByName(name);
+  if (!dir)
+    return;
+
+  dir->confValid = 1;
+  dir->confSize = st->st_size;
+  dir->confMtime = st->st_mtim;
+}
+
+/*
+ * Plugins that fail to load or reload are left out and passed to failed,
+ * if given, so the rest still get their changes.
+ */
+static void applyChanges(PluginWatchFailed_f failed, void *data) {
+
+  //events are read before this, so any write they are about is already noted
+  ConfigWriter_TakeWritten(noteOwnWrite, NULL);
+
+  size_t i = 0;
+  for (i = 0; i < _dirCount; i++) {
+    if (!_dirs[i].changed || !pluginChanged(&_dirs[i]))
+      continue;
+
+    SYSLOG(LOG_ERR, "PluginWatch: Error loading %s", _dirs[i].name);
+    if (failed)
+      failed(_dirs[i].name, data);
+  }
+}
+
+static void handleEvent(struct inotify_event *event) {
+
+  if (event->mask & IN_Q_OVERFLOW) {
+    SYSLOG(LOG_ERR, "PluginWatch: event queue overflowed, rescanning plugins");
+    _overflowed = 1;
+    return;
+  }
+
+  if (event->wd == _rootWd) {
+    if (!(event->mask & IN_ISDIR) || !event->len)
+      return;
+
+    if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+      WatchedDir_t *dir = watchDir(event->name, 0);
+      if (dir)
+        dir->changed = 1;
+    }
+    else if (event->mask & (IN_DELETE | IN_MOVED_FROM))
+      pluginRemoved(event->name);
+
+    return;
+  }
+
+  WatchedDir_t *dir = findByWd(event->wd);
+  if (!dir)
+    return;
+
+  //the kernel dropped the watch, its folder is gone
+  if (event->mask & IN_IGNORED) {
+    dropDir(dir);
+    return;
+  }
+
+  if (event->len && !strcmp(event->name, PLUGIN_CONF_FILENAME))
+    dir->changed = 1;
+}
+
+/*
+ * Start watching a plugin directory and every folder already in it.
+ * Call after the plugins have been loaded, with the same path.
+ *
+ * Without inotify, folders are still tracked so PluginWatch_Rescan works.
+ */
+int PluginWatch_Init(char *pluginDir) {
+
+  _pluginDir = strdup(pluginDir);
+  if (!_pluginDir)
+    return -1;
+
+  _watchFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (_watchFd < 0)
+    SYSLOG(LOG_ERR, "PluginWatch: inotify unavailable, plugin changes need a reboot");
+  else {
+    _rootWd = inotify_add_watch(_watchFd, pluginDir, WATCH_ROOT_EVENTS);
+    if (_rootWd < 0) {
+      SYSLOG(LOG_ERR, "PluginWatch: Error watching %s", pluginDir);
+      close(_watchFd);
+      _watchFd = -1;
+    }
+  }
+
+  DirectoryAction(pluginDir, watchExisting, NULL);
+  return 0;
+}
+
+/*
+ * Bring the loaded plugins in line with the plugin directory without
+ * restarting anything: new folders are loaded, missing ones removed and
+ * plugins whose plugin.conf changed since they were loaded are reloaded.
+ * Everything else, including the display connection, is left alone.
+ *
+ * A plugin that fails to load or reload is dropped and passed to failed,
+ * if given. Returns -1 only if the plugin directory isn't being tracked or
+ * can't be read, in which case nothing is changed.
+ */
+int PluginWatch_Rescan(PluginWatchFailed_f failed, void *data) {
+
+  if (!_pluginDir)
+    return -1;
+
+  size_t i = 0;
+  for (i = 0; i < _dirCount; i++)
+    _dirs[i].seen = 0;
+
+  //an unreadable directory would look like every plugin was removed
+  if (DirectoryAction(_pluginDir, rescanEntry, NULL))
+    return -1;
+
+  PluginList_ForEach(removeIfGone, NULL);
+  i = 0;
+  while (i < _dirCount) {
+    if (_dirs[i].seen)
+      i++;
+    else
+      pluginRemoved(_dirs[i].name);
+  }
+
+  applyChanges(failed, data);
+  _overflowed = 0;
+  return 0;
+}
+
+/*
+ * Apply any plugin changes seen since the last update. Never blocks.
+ */
+void PluginWatch_Update(void) {
+
+  if (_watchFd < 0)
+    return;
+
+  char buf[WATCH_BUF_LEN] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+  int events = 0;
+
+  ssize_t len = 0;
+  while ((len = read(_watchFd, buf, sizeof(buf))) > 0) {
+    char *pos = buf;
+    while (pos < buf + len) {
+      struct inotify_event *event = (struct inotify_event *) pos;
+      handleEvent(event);
+      pos += sizeof(struct inotify_event) + event->len;
+      events++;
+    }
+  }
+
+  if (_overflowed)
+    PluginWatch_Rescan(NULL, NULL);
+  else if (events)
+    applyChanges(NULL, NULL);
+}
+
+void PluginWatch_Cleanup(void) {
+
+  size_t i = 0;
+  for (i = 0; i < _dirCount; i++)
+    free(_dirs[i].name);
+
+  free(_dirs);
+  _dirs = NULL;
+  _dirCount = _dirSize = 0;
+
+  free(_pluginDir);
+  _pluginDir = NULL;
+
+  if (_watchFd >= 0)
+    close(_watchFd);
+  _watchFd = -1;
+  _rootWd = -1;
+}
@@ -4,14 +4,55 @@
 
 /*
  * Socket writes are buffered on a per-protocol basis. As each protocol is created,
- * it is given an ID number that is used to index to the correct write queue.
+ * it is given a handle (see PROTOCOL_HANDLE) whose slot bits index the correct
+ * write queue. Queues are never moved when a protocol is removed; the slot is
+ * simply invalidated until the protocol list hands it out again.
+ *
+ * A slot only holds a queue while the protocol has open connections. The queue
+ * is allocated by the first Protocol_openQueue and released by the last
+ * Protocol_closeQueue, so protocols nobody is connected to cost no queue memory.
  */
+#include <stdlib.h>
+#include <string.h>
 #include <syslog.h>
 #include <libwebsockets.h>
 
 #include "misc.h"
 #include "protocolWrite.h"
 
+/*
+ * Allocate a shared buffer of size bytes, holding one reference.
+ */
+SharedWrite_t *Protocol_newShared(size_t size) {
+
+  SharedWrite_t *shared = malloc(sizeof(SharedWrite_t) + size);
+  if (!shared) {
+    SYSLOG(LOG_ERR, "Protocol_newShared: Error allocating %zu bytes", size);
+    return NULL;
+  }
+
+  shared->refs = 1;
+  shared->size = size;
+  return shared;
+}
+
+void Protocol_releaseShared(SharedWrite_t *shared) {
+
+  if (shared && !--shared->refs)
+    free(shared);
+}
+
+static void releaseWrite(BufferedWrite_t *write) {
+
+  if (write->shared)
+    Protocol_releaseShared(write->shared);
+  else
+    free(write->msg);
+
+  write->msg = NULL;
+  write->shared = NULL;
+}
+
 static void _clearQueue(WriteQueue_t *queue, int fd) {
 
   size_t i = 0;
@@ -23,66 +64,148 @@ static void _clearQueue(WriteQueue_t *queue, int fd) {
       continue;
 
     if (buffers->msg)
-      free(buffers->msg);
+      releaseWrite(buffers);
 
-    buffers->msg = NULL;
     buffers->len = 0;
   }
 
+  //other connections may still have writes pending in a shared queue
+  if (fd > -1)
+    return;
+
   queue->lastWritten = 0;
   queue->lastBuffered = 0;
 }
 
 
-static int getProtocolID(struct lws *socket) {
+/*
+ * Find the queue slot belonging to a socket's protocol. Returns NULL if the
+ * protocol has no slot, or if the slot now belongs to another protocol.
+ */
+static ProtocolQueue_t *getSlot(ProtocolWrites_t *protowrites, struct lws *socket) {
 
   struct lws_protocols *proto = (struct lws_protocols *) lws_get_protocol(socket);
-  if (!proto || proto->id < 0) {
+  if (!proto || proto->id == PROTOCOL_HANDLE_INVALID) {
     SYSLOG(LOG_ERR, "ERROR: Socket has no protocol associated");
-    return -1;
+    return NULL;
+  }
+
+  unsigned int slot = PROTOCOL_HANDLE_SLOT(proto->id);
+  if (!protowrites->buffer || slot >= protowrites->bufferCount)
+    return NULL;
+
+  ProtocolQueue_t *entry = &protowrites->buffer[slot];
+  if (entry->handle != proto->id) {
+    SYSLOG(LOG_ERR, "ERROR: Stale protocol handle %u", proto->id);
+    return NULL;
   }
 
-  return proto->id;
+  return entry;
 }
 
+static WriteQueue_t *getQueue(ProtocolWrites_t *protowrites, struct lws *socket) {
 
+  ProtocolQueue_t *entry = getSlot(protowrites, socket);
+  if (!entry)
+    return NULL;
 
-void Protocol_addWriteToQueue(ProtocolWrites_t * protowrites, struct lws *socket, void *msg, size_t len) {
+  return entry->queue;
+}
 
-  if (!protowrites)
+static void freeSlotQueue(ProtocolQueue_t *entry) {
+
+  if (!entry->queue)
     return;
 
-  int protoID = getProtocolID(socket);
-  if (!protowrites->buffer || protoID < 0 || protoID > protowrites->bufferCount)
+  _clearQueue(entry->queue, -1);
+  free(entry->queue);
+  entry->queue = NULL;
+}
+
+
+
+/*
+ * Queue a message for the socket. A message with a nonzero tag takes the place
+ * of a message with the same tag still waiting for the same connection, so
+ * only the latest of them is ever written.
+ */
+static void queueWrite(ProtocolWrites_t *protowrites, struct lws *socket, void *msg, SharedWrite_t *shared,
+                       size_t len, unsigned int tag) {
+
+  BufferedWrite_t write = {.msg = msg, .shared = shared};
+
+  WriteQueue_t *curBuffer = protowrites ? getQueue(protowrites, socket) : NULL;
+  if (!curBuffer) {
+    SYSLOG(LOG_ERR, "Protocol_addWriteToQueue: No open queue for socket, dropping message");
+    releaseWrite(&write);
     return;
+  }
+
+  int fd = lws_get_socket_fd(socket);
+
+  //writes skipped for other connections can sit anywhere in the ring
+  size_t i = 0;
+  for (i = 0; tag && i < NUM_BUFFERED_WRITES; i++) {
+    BufferedWrite_t *queued = &curBuffer->writes[i];
+    if (queued->msg && queued->tag == tag && queued->descriptor == fd) {
+      releaseWrite(queued);
+      queued->msg = msg;
+      queued->shared = shared;
+      queued->len = len;
+      return;
+    }
+  }
 
   //SYSLOG(LOG_INFO, "Protocol_addWriteToCueue: Buffering queue [%d]", proto->id);
-  WriteQueue_t *curBuffer = &protowrites->buffer[protoID];
   BufferedWrite_t *curWrite = &curBuffer->writes[curBuffer->lastBuffered];
 
   if (curWrite->msg) {
     SYSLOG(LOG_ERR, "WRITING OVER BUFFERED MSG");
-    free(curWrite->msg);
+    releaseWrite(curWrite);
   }
 
-  curWrite->descriptor = lws_get_socket_fd(socket);
+  curWrite->descriptor = fd;
+  curWrite->tag = tag;
   curWrite->msg = msg;
+  curWrite->shared = shared;
   curWrite->len = len;
 
   curBuffer->lastBuffered++;
   curBuffer->lastBuffered %= NUM_BUFFERED_WRITES;
 }
 
+/*
+ * Queue a message the queue owns, msg is free'd once written or dropped.
+ */
+void Protocol_addWriteToQueue(ProtocolWrites_t *protowrites, struct lws *socket, void *msg, size_t len,
+                              unsigned int tag) {
+
+  queueWrite(protowrites, socket, msg, NULL, len, tag);
+}
+
+/*
+ * Queue len bytes of a shared buffer, starting with the padding at offset.
+ * The queue takes its own reference, the caller keeps theirs.
+ */
+void Protocol_addSharedToQueue(ProtocolWrites_t *protowrites, struct lws *socket, SharedWrite_t *shared,
+                               size_t offset, size_t len, unsigned int tag) {
+
+  if (!shared || offset + LWS_SEND_BUFFER_PRE_PADDING + len > shared->size)
+    return;
+
+  shared->refs++;
+  queueWrite(protowrites, socket, shared->data + offset, shared, len, tag);
+}
+
 void Protocol_processQueue(struct lws *socket, ProtocolWrites_t *protowrites) {
 
   if (!socket || !protowrites)
     return;
 
-  int protoID = getProtocolID(socket);
-  if (!protowrites->buffer || protoID < 0 || protoID > protowrites->bufferCount)
+  WriteQueue_t *curBuffer = getQueue(protowrites, socket);
+  if (!curBuffer)
     return;
 
-  WriteQueue_t *curBuffer = &protowrites->buffer[protoID];
   int fd = lws_get_socket_fd(socket);
 
   do {
@@ -91,9 +214,10 @@ void Protocol_processQueue(struct lws *socket, ProtocolWrites_t *protowrites) {
     if (!curWrite->msg || fd != curWrite->descriptor || lws_partial_buffered(socket))
       goto increment;
 
+    //lws writes the frame header into the padding, shared buffers included;
+    //writes happen one at a time so each message's padding is its own
     lws_write(socket, curWrite->msg + LWS_SEND_BUFFER_PRE_PADDING, curWrite->len, LWS_WRITE_TEXT);
-    free(curWrite->msg);
-    curWrite->msg = NULL;
+    releaseWrite(curWrite);
 
     increment:
     curBuffer->lastWritten++;
@@ -102,43 +226,105 @@ void Protocol_processQueue(struct lws *socket, ProtocolWrites_t *protowrites) {
   } while (curBuffer->lastWritten != curBuffer->lastBuffered);
 }
 
-//allocates memory for each protocol queue
+/*
+ * Makes sure there is a queue slot for every protocol up to and including
+ * newCount. Slots are small; the queues themselves are only allocated once
+ * a connection opens (Protocol_openQueue). The slot array only ever grows;
+ * removed protocols leave their slot behind to be reused.
+ */
 int Protocol_setProtocolCount(ProtocolWrites_t *protowrites, size_t newCount) {
 
-  WriteQueue_t *newBuffer = realloc(protowrites->buffer, sizeof(WriteQueue_t) * (newCount + 1));
+  newCount++;
+  if (newCount <= protowrites->bufferCount)
+    return 0;
+
+  //grow geometrically so adding many plugins doesn't copy the slots every time
+  size_t allocCount = protowrites->bufferCount ? protowrites->bufferCount : 1;
+  while (allocCount < newCount)
+    allocCount *= 2;
+
+  ProtocolQueue_t *newBuffer = realloc(protowrites->buffer, sizeof(ProtocolQueue_t) * allocCount);
   if (!newBuffer) {
     SYSLOG(LOG_INFO, "Protocol_addBuffer: Failed to resize old buffers");
     return -1;
   }
-  newCount++;
+
+  memset(&newBuffer[protowrites->bufferCount], 0,
+         sizeof(ProtocolQueue_t) * (allocCount - protowrites->bufferCount));
 
   protowrites->buffer = newBuffer;
-  protowrites->bufferCount = newCount;
-  SYSLOG(LOG_INFO, "Protocol_addBuffer: new count: %d", newCount);
+  protowrites->bufferCount = allocCount;
+  SYSLOG(LOG_INFO, "Protocol_addBuffer: new count: %zu", allocCount);
 
   return 0;
 }
 
 
-int Protocol_removeProtocol(ProtocolWrites_t *protowrites, unsigned int protocolID) {
+int Protocol_removeProtocol(ProtocolWrites_t *protowrites, unsigned int handle) {
 
-  _clearQueue(&protowrites->buffer[protocolID], -1);
+  unsigned int slot = PROTOCOL_HANDLE_SLOT(handle);
+  if (!protowrites->buffer || slot >= protowrites->bufferCount)
+    return -1;
 
-  unsigned int i = 0;
-  for (i = protocolID; i < protowrites->bufferCount - 1; i++) {
-    memcpy(&protowrites->buffer[i], &protowrites->buffer[i + 1], sizeof(WriteQueue_t));
+  ProtocolQueue_t *entry = &protowrites->buffer[slot];
+  if (entry->handle != handle)
+    return -1;
+
+  //any connections still open on the protocol lose their pending writes
+  freeSlotQueue(entry);
+  entry->connections = 0;
+  entry->handle = PROTOCOL_HANDLE_INVALID;
+  return 0;
+}
+
+/*
+ * A connection has been established on the socket's protocol, allocate the
+ * protocol's queue if it is the first.
+ */
+int Protocol_openQueue(struct lws *socket, ProtocolWrites_t *protowrites) {
+
+  ProtocolQueue_t *entry = getSlot(protowrites, socket);
+  if (!entry)
+    return -1;
+
+  if (!entry->queue) {
+    entry->queue = calloc(1, sizeof(WriteQueue_t));
+    if (!entry->queue) {
+      SYSLOG(LOG_ERR, "Protocol_openQueue: Error allocating write queue");
+      return -1;
+    }
   }
 
-  return Protocol_setProtocolCount(protowrites, protowrites->bufferCount - 1);
+  entry->connections++;
+  return 0;
+}
+
+/*
+ * A connection on the socket's protocol has closed. Drop its pending writes,
+ * and release the queue once no connections are left.
+ */
+void Protocol_closeQueue(struct lws *socket, ProtocolWrites_t *protowrites) {
+
+  ProtocolQueue_t *entry = getSlot(protowrites, socket);
+  if (!entry || !entry->queue)
+    return;
+
+  _clearQueue(entry->queue, lws_get_socket_fd(socket));
+
+  if (entry->connections > 0)
+    entry->connections--;
+
+  if (!entry->connections)
+    freeSlotQueue(entry);
 }
 
 void Protocol_clearQueue(struct lws *socket, ProtocolWrites_t *protowrites) {
 
-  int protoID = getProtocolID(socket);
-  if (!protowrites->buffer || protoID < 0 || protoID > protowrites->bufferCount)
+  WriteQueue_t *queue = getQueue(protowrites, socket);
+  if (!queue)
     return;
 
-  _clearQueue(&protowrites->buffer[protoID], lws_get_socket_fd(socket));
+  _clearQueue(queue, lws_get_socket_fd(socket));
 }
 
 
@@ -149,20 +335,25 @@ void Protocol_destroyQueues(ProtocolWrites_t *protowrites) {
 
   unsigned int i = 0;
   for (i = 0; i < protowrites->bufferCount; i++) {
-    _clearQueue(&protowrites->buffer[i], -1);
+    freeSlotQueue(&protowrites->buffer[i]);
   }
 
   free(protowrites->buffer);
   protowrites->buffer = NULL;
+  protowrites->bufferCount = 0;
 }
 
 
-void Protocol_initQueue(ProtocolWrites_t *protowrites, unsigned int protocolID) {
+void Protocol_initQueue(ProtocolWrites_t *protowrites, unsigned int handle) {
 
-  if (protocolID < 0 || protocolID >= protowrites->bufferCount) {
+  unsigned int slot = PROTOCOL_HANDLE_SLOT(handle);
+  if (!protowrites->buffer || slot >= protowrites->bufferCount) {
     SYSLOG(LOG_ERR, "Protocol_initQueue: initializing queue out of bounds");
     return;
   }
 
-  memset(&protowrites->buffer[protocolID], 0, sizeof(WriteQueue_t));
-}
\ No newline at end of file
+  ProtocolQueue_t *entry = &protowrites->buffer[slot];
+  freeSlotQueue(entry);
+  entry->connections = 0;
+  entry->handle = handle;
+}
@@ -3,6 +3,7 @@
 //
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <syslog.h>
 
 #include <libwebsockets.h>
@@ -69,3 +70,31 @@ size_t SocketResponse_size(SocketResponse_t *sockr) {
 
   return sockr->len;
 }
+
+/*
+ * Move a response out of one holder and into another. Used to hand
+ * a message reassembled in a connection's per-session data over to
+ * whoever is waiting on it, leaving the session free for the next message.
+ */
+void SocketResponse_take(SocketResponse_t *dest, SocketResponse_t *src) {
+
+  SocketResponse_free(dest);
+  *dest = *src;
+
+  src->data = NULL;
+  src->len = 0;
+  src->complete = 0;
+}
+
+/*
+ * Drop the first count bytes of a completed response, e.g. a routing
+ * header, so the rest can be handled as if it arrived on its own.
+ */
+void SocketResponse_skip(SocketResponse_t *sockr, size_t count) {
+
+  if (!sockr->data || count >= sockr->len)
+    return;
+
+  memmove(sockr->data, sockr->data + count, sockr->len - count);
+  sockr->len -= count;
+}
@@ -149,6 +149,13 @@ var MirrorAPI = function(addr) {
         mirrorsize: function(plugin, data) {
         	instance.apiSend("mirrorsize", null, null);
         },
+        //size changes are then answered as mirrorsize responses
+        watchsize: function(plugin, data) {
+        	instance.apiSend("mirrorsize", null, "watch");
+        },
+        unwatchsize: function(plugin, data) {
+        	instance.apiSend("mirrorsize", null, "unwatch");
+        },
         display: function(plugin, data) {
         	instance.apiSend("display", null, null);
         },
@@ -1,4 +1,4 @@
-var Display = function(socket, port) {
+var Display = function(socket, port, muxProtocol) {
 	var instance = this;
 
 	this.doLogging = false;
@@ -6,6 +6,8 @@ var Display = function(socket, port) {
 	this.pluginList = {};
 	this.ipAddr = window.location.hostname;
 	this.port = port;
+	this.mux = null;
+	this.resizeTimer = null;
 
 
 	this.onmessage = function(data) {
@@ -20,6 +22,11 @@ var Display = function(socket, port) {
 		}, 50);
 	}
 
+	//the daemon keeps the last size pushed, so mirrorsize needn't ask for it
+	this.pushSize = function() {
+		instance.socket.send("size:" + window.innerWidth + "x" + window.innerHeight);
+	}
+
 	this.transform = function(name) {
 		return name + "Socket";
 	}
@@ -39,11 +46,17 @@ var Display = function(socket, port) {
 				console.log("Initializing: " + plugName);
 				console.log(data);
 			}
+			//plugins given a channel share one connection instead of opening their own
+			if (data.ch !== undefined && muxProtocol && !instance.mux)
+				instance.mux = new PluginMux(instance.ipAddr, instance.port, muxProtocol);
+
 			instance.pluginList[plugName] = new PluginClient({
 				protocol: data.pName,
 				containerID: data.pDiv,
 				ip: instance.ipAddr,
-				port: instance.port
+				port: instance.port,
+				mux: instance.mux,
+				channel: data.ch
 			});
 
 			instance.socket.send("loaded");
@@ -78,7 +91,16 @@ var Display = function(socket, port) {
 			instance.socket.onmessage = instance.onmessage;
 			instance.socket.onopen = function(e) {
 			instance.socket.send("ready");
+			instance.pushSize();
 		};
+
+		window.addEventListener('resize', function() {
+			clearTimeout(instance.resizeTimer);
+			instance.resizeTimer = setTimeout(function() {
+				if (instance.socket.readyState == WebSocket.OPEN)
+					instance.pushSize();
+			}, 250);
+		});
 	}
 
 	this.init();
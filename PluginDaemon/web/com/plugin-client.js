@@ -24,6 +24,24 @@ var PluginClient = function(clientSettings) {
 		return this.outDiv;
 	}
 
+	//apply "attr=value;attr=value;" rules to the plugin div
+	this.applyCss = function(data) {
+		var style = instance.getDiv().style;
+
+		var rules = data.split(';');
+		rules.forEach(function(css) {
+			var results=css.split("=", 2);
+			if (results.length > 1) {
+				//if the value is defined and not NULL, set the style
+				if (results[1] !== undefined && results[1] != "NULL" && results[1] != null)
+					style[results[0]] = results[1];
+				//otherwise, remove the style
+				else
+					style[results[0]] = "";
+			}
+		});
+	}
+
 	//break file caching done by browsers to allow for proper reloading of resources
 	this.breakCache = function(filename) {
 		return filename + "?" + Math.floor((Math.random() * 1000000) + 1);
@@ -230,6 +248,10 @@ var PluginClient = function(clientSettings) {
 	    	if (instance.doLogging)
 	    		console.log(data);
 
+	    	//saved css comes along with the load, place the div right away
+	    	if (data["style"] != null && data["style"].length > 0)
+	    		instance.applyCss(data["style"]);
+
 	    	//load new css file if given
 	    	if (data["css"] != null && data["css"].length > 0){
 	    		data["css"].forEach(function(cssFile) {
@@ -301,21 +323,7 @@ var PluginClient = function(clientSettings) {
 
 	    //set or modify a css style attribute for the plugin div.
 	    setcss: function(data) {
-	       	var style = instance.getDiv().style;
-
-	       	var rules = data.split(';');
-	       	rules.forEach(function(css) {
-	       		var results=css.split("=", 2);
-	       		if (results.length > 1) {
-	       			//if the value is defined and not NULL, set the style
-	       			if (results[1] !== undefined && results[1] != "NULL" && results[1] != null)
-	       				style[results[0]] = results[1];
-	       			//otherwise, remove the style
-	       			else
-	       				style[results[0]] = "";
-	       		}
-	       	});
-
+	       	instance.applyCss(data);
 	       	instance.socketObj.send("CSS Applied");
 	    },
 
@@ -410,7 +418,11 @@ var PluginClient = function(clientSettings) {
 		if (instance.doLogging)
 			console.log("Starting websocket: " + name);
 
-		instance.socketObj = new WebSocket("ws://" + server.ip + ":" + portNum, name);
+		//share the display's connection when the server assigned this plugin a channel
+		if (server.mux && server.channel !== undefined)
+			instance.socketObj = server.mux.open(server.channel);
+		else
+			instance.socketObj = new WebSocket("ws://" + server.ip + ":" + portNum, name);
 		instance.socketObj.onmessage = instance.socketReceive;
 		instance.socketObj.onopen = function(e) {
 			if (instance.doLogging)
@@ -435,7 +447,9 @@ var PluginClient = function(clientSettings) {
 		instance.serverConnect({
 			sockName: instance.clientInfo.protocol,
 			portNum: instance.clientInfo.port,
-			ip: instance.clientInfo.ip
+			ip: instance.clientInfo.ip,
+			mux: instance.clientInfo.mux,
+			channel: instance.clientInfo.channel
 		});
 	}
 
@@ -449,3 +463,75 @@ var PluginClient = function(clientSettings) {
 
 
 
+
+
+/*
+ * A single websocket shared by every plugin client. Each plugin gets a
+ * channel object that behaves like its own WebSocket (send, close, onopen,
+ * onmessage); frames are tagged "<channel>\n<data>" on the wire, with
+ * "+<channel>" and "-<channel>" opening and closing a channel.
+ */
+var PluginMux = function(ip, port, protocol) {
+
+	var instance = this;
+
+	this.channels = {};
+	this.pending = [];
+
+	this.socket = new WebSocket("ws://" + ip + ":" + port, protocol);
+
+	this.socket.onopen = function(e) {
+		while (instance.pending.length > 0)
+			instance.socket.send(instance.pending.shift());
+	};
+
+	this.socket.onmessage = function(e) {
+		var split = e.data.indexOf('\n');
+		if (split < 0)
+			return;
+
+		var channel = instance.channels[e.data.substring(0, split)];
+		if (channel && channel.onmessage)
+			channel.onmessage({ data: e.data.substring(split + 1) });
+	};
+
+	//frames sent before the socket opens are held until it does
+	this.send = function(data) {
+		if (instance.socket.readyState === 1)
+			instance.socket.send(data);
+		else
+			instance.pending.push(data);
+	};
+
+	this.open = function(ch) {
+		var channel = {
+			readyState: 1,
+			onopen: null,
+			onmessage: null,
+
+			send: function(data) {
+				instance.send(ch + "\n" + data);
+			},
+
+			close: function() {
+				if (instance.channels[ch] !== channel)
+					return;
+
+				delete instance.channels[ch];
+				channel.readyState = 3;
+				instance.send("-" + ch);
+			}
+		};
+
+		instance.channels[ch] = channel;
+		instance.send("+" + ch);
+
+		//fire onopen once the caller has had a chance to set it
+		setTimeout(function() {
+			if (channel.onopen)
+				channel.onopen();
+		}, 0);
+
+		return channel;
+	};
+};